@@ -0,0 +1,699 @@
+/** @file bench.c
+ *
+ * @brief Offline playback benchmark, built with "make bench.a" (JACK stub, no JACK server nor devices required).
+ * A generated song is played by process () for a number of cycles, for several period sizes and tempos, and the cost
+ * of a cycle is reported, together with the cost of read_from_song, of the music output and of the UI (led) output.
+ * The flood benchmark sends bursts of midi events to the keyboard input while recording, to measure how many events
+ * kbd_midi_in_process can absorb per cycle. The requantization benchmark measures the cost of requantizing each track,
+ * and the quantization benchmark compares the integer tick math of utils.c with the former double arithmetic.
+ * The pool benchmark times whole-song passes on the calling thread only, then with the worker pool.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static const int bench_nframes [] = {64, 128, 256, 512, 1024};		// period sizes
+static const int bench_bpm [] = {60, 120, 240};						// tempos
+static const char *bench_patterns [] = {"drum roll", "chords", "sustain", "knobs", "mixed"};	// bursts of the flood benchmark
+static const uint8_t bench_drums [] = {36, 38, 42, 46};				// kick, snare, closed and open hi-hat
+static const int bench_quantizers [] = {FREE_TIMING, QUARTER, EIGHTH, SIXTEENTH, THIRTY_SECOND};
+static const double bench_meters [][2] = {{480.0, 4.0}, {96.0, 3.0}, {960.0, 7.0}};		// ticks per beat, beats per bar
+
+
+// generate a song of nb_notes notes (note-on + note-off), spread evenly over the 8 instruments and the 512 bars
+// when there are more notes than sixteenths, notes are played together as chords
+static void bench_song (int nb_notes, unsigned int seed) {
+
+	int i, nb_pairs, qtime, time, length, step, song_ticks;
+
+	srand (seed);
+	if (nb_notes > SONG_SIZE) nb_notes = SONG_SIZE;
+	memset (song, 0, SONG_SIZE * sizeof (note_t));
+	nb_pairs = nb_notes / 2;
+	step = (int) (time_ticks_per_beat / SIXTEENTH);
+	song_ticks = 512 * (int) (time_ticks_per_beat * time_beats_per_bar);
+
+	for (i = 0; i < nb_pairs; i++) {
+		qtime = (int) (((double) i * song_ticks) / nb_pairs);
+		qtime -= qtime % step;
+		time = qtime + (rand () % 21) - 10;
+		if (time < 0) time = 0;
+		length = (1 + (rand () % 8)) * (int) (time_ticks_per_beat / EIGHTH);
+		if (qtime + length + 10 >= song_ticks) length = song_ticks - qtime - 11;
+
+		song [2 * i].instrument = i % 8;
+		song [2 * i].status = MIDI_NOTEON;
+		song [2 * i].key = 36 + (rand () % 60);
+		song [2 * i].vel = 40 + (rand () % 80);
+		song [2 * i].color = LO_YELLOW;
+		tick2note (qtime, &song [2 * i], TRUE);
+		tick2note (time, &song [2 * i], FALSE);
+
+		memcpy (&song [(2 * i) + 1], &song [2 * i], sizeof (note_t));
+		song [(2 * i) + 1].status = MIDI_NOTEOFF;
+		song [(2 * i) + 1].vel = 0;
+		tick2note (qtime + length - 1, &song [(2 * i) + 1], TRUE);
+		tick2note (time + length - 1, &song [(2 * i) + 1], FALSE);
+	}
+	song_length = 2 * nb_pairs;
+	qsort (song, song_length, sizeof (note_t), compare_notes);
+}
+
+
+// empty the midi send lists
+static void bench_flush () {
+
+	uint8_t buffer [3];
+
+	while (pull_from_list (UI, buffer));
+	while (pull_from_list (KBD, buffer));
+	while (pull_from_list (OUT, buffer));
+	while (pull_from_list (CLK, buffer));
+	while (pull_from_list (KBD_CLK, buffer));
+}
+
+
+static int compare_durations (const void *a, const void *b) {
+
+	const uint32_t *da = a, *db = b;
+
+	return (*da > *db) - (*da < *db);
+}
+
+
+// run the benchmark: play a song of nb_notes notes for nb_cycles cycles, for each period size and tempo
+// process () shall not be called by anything else (ie. client is not activated)
+void bench_playback (int nb_notes, int nb_cycles) {
+
+	uint32_t *durations;
+	uint64_t start, sum, mean, p99, max, r_mean, r_p99, r_max, o_mean, o_p99, o_max, u_mean, u_p99, u_max;
+	uint32_t notes, notes_max, leds, leds_max, n;
+	double period;
+	int f, b, c;
+
+	if (nb_cycles <= 0) nb_cycles = BENCH_CYCLES;
+	durations = malloc (nb_cycles * sizeof (uint32_t));
+	if (durations == NULL) return;
+
+	bench_song (nb_notes, 1);
+	note2bar_color ();
+	printf ("playback of %d notes, %d cycles per run (us; cycle: exact, read/out/ui: 25%% precision)\n", song_length, nb_cycles);
+	printf ("frames  bpm  bars |  cycle mean    p99    max  max%% |   read mean   p99   max |    out mean   p99   max |     ui mean   p99   max | notes/cycle avg  max | leds/cycle avg  max\n");
+
+	for (f = 0; f < sizeof (bench_nframes) / sizeof (int); f++) {
+		for (b = 0; b < sizeof (bench_bpm) / sizeof (int); b++) {
+
+			// play from first bar, at the tempo of the run
+			bench_flush ();
+			time_beats_per_minute = bench_bpm [b];
+			time_bpm_multiplier = 1.0;
+			ui_current_page = 0;
+			ui_current_bar = 0;
+			is_play = TRUE;
+			start_playing ();
+			stats_reset ();
+
+			sum = 0;
+			notes = 0;
+			notes_max = 0;
+			leds = 0;
+			leds_max = 0;
+			for (c = 0; c < nb_cycles; c++) {
+				start = stats_now ();
+				jackstub_cycle (bench_nframes [f]);
+				durations [c] = stats_now () - start;
+				sum += durations [c];
+
+				// traffic of the cycle
+				n = jack_midi_get_event_count (jack_port_get_buffer (midi_out, bench_nframes [f]));
+				notes += n;
+				if (n > notes_max) notes_max = n;
+				n = jack_midi_get_event_count (jack_port_get_buffer (midi_UI_out, bench_nframes [f]));
+				leds += n;
+				if (n > leds_max) leds_max = n;
+			}
+
+			qsort (durations, nb_cycles, sizeof (uint32_t), compare_durations);
+			mean = sum / nb_cycles;
+			p99 = durations [(nb_cycles * 99) / 100];
+			max = durations [nb_cycles - 1];
+			period = (bench_nframes [f] * 1e9) / jack_get_sample_rate (client);
+			stats_summary (STATS_READ, &r_mean, &r_p99, &r_max);
+			stats_summary (STATS_OUT, &o_mean, &o_p99, &o_max);
+			stats_summary (STATS_UI_OUT, &u_mean, &u_p99, &u_max);
+
+			printf ("%6d %4d %5d | %11.1f %6.1f %6.1f %5.1f | %11.1f %5.1f %5.1f | %11.1f %5.1f %5.1f | %11.1f %5.1f %5.1f | %15.2f %4u | %14.2f %4u\n",
+				bench_nframes [f], bench_bpm [b], time_position.bar,
+				mean / 1000.0, p99 / 1000.0, max / 1000.0, (max * 100.0) / period,
+				r_mean / 1000.0, r_p99 / 1000.0, r_max / 1000.0,
+				o_mean / 1000.0, o_p99 / 1000.0, o_max / 1000.0,
+				u_mean / 1000.0, u_p99 / 1000.0, u_max / 1000.0,
+				(double) notes / nb_cycles, notes_max, (double) leds / nb_cycles, leds_max);
+
+			is_play = FALSE;
+			stop_playing ();
+			jackstub_cycle (bench_nframes [f]);
+		}
+	}
+
+	free (durations);
+}
+
+
+// event k of a burst of nb events, for pattern p (index in bench_patterns)
+// n is the number of notes sent since the start of the run, so that notes go on and off the same way whatever the burst size
+// returns TRUE if the event is a note
+static int bench_flood_event (int p, int k, int nb, int n, uint8_t * event) {
+
+	int size;
+
+	// mixed: drum roll for the first half of the burst, then sustain pedal and knobs
+	if (p == 4) {
+		if (k < nb / 2) p = 0;
+		else p = (k % 2) ? 2 : 3;
+	}
+
+	switch (p) {
+		case 0:
+			// drum roll: note-on, note-off, next drum
+			event [0] = (n % 2) ? MIDI_NOTEOFF : MIDI_NOTEON;
+			event [1] = bench_drums [(n / 2) % 4];
+			event [2] = (n % 2) ? 0 : 100;
+			return TRUE;
+		case 1:
+			// chords of half the burst: note-ons of all the keys, then note-offs
+			size = (nb > 1) ? nb / 2 : 1;
+			n = n % (2 * size);
+			event [0] = (n < size) ? MIDI_NOTEON : MIDI_NOTEOFF;
+			event [1] = 36 + ((n % size) % 72);
+			event [2] = (n < size) ? 80 : 0;
+			return TRUE;
+		case 2:
+			// sustain pedal, down and up
+			event [0] = MIDI_CC;
+			event [1] = 64;
+			event [2] = (k % 2) ? 0 : 127;
+			return FALSE;
+		default:
+			// volume knobs 1 to 8, turned
+			event [0] = MIDI_CC;
+			event [1] = 1 + (k % 8);
+			event [2] = (k * 7) % 128;
+			return FALSE;
+	}
+}
+
+
+// count notes of the song that are out of order: song not sorted, or note-on of a key which is already on (or note-off of a key which is off)
+static int bench_misordered () {
+
+	uint8_t on [8][128];
+	int i, nb;
+
+	memset (on, 0, sizeof (on));
+	nb = 0;
+	for (i = 0; i < song_length; i++) {
+		if ((i > 0) && ((song [i].qbar < song [i - 1].qbar) || ((song [i].qbar == song [i - 1].qbar) && (song [i].qtick < song [i - 1].qtick)))) nb++;
+		if ((song [i].status == MIDI_NOTEON) == on [song [i].instrument][song [i].key]) nb++;
+		on [song [i].instrument][song [i].key] = (song [i].status == MIDI_NOTEON);
+	}
+	return nb;
+}
+
+
+// flood benchmark: while recording, send bursts of 1 to max_burst events per cycle to the keyboard input, for nb_cycles cycles
+// of 256 frames at 120 bpm, for each pattern; free timing, so that recorded notes keep the order they have been played in
+// process () shall not be called by anything else (ie. client is not activated)
+void bench_flood (int max_burst, int nb_cycles) {
+
+	uint32_t *durations;
+	uint64_t start, sum, k_mean, k_p99, k_max;
+	uint32_t n, expected, sent_notes, played_notes, volumes, dropped_rec, dropped_out;
+	jack_port_t *kbd_in;
+	uint8_t event [3];
+	double period;
+	int p, burst, c, k, late, length;
+	const int nframes = 256;
+
+	if (nb_cycles <= 0) nb_cycles = BENCH_FLOOD_CYCLES;
+	if ((max_burst <= 0) || (max_burst > STUB_EVENTS)) max_burst = STUB_EVENTS;
+	durations = malloc (nb_cycles * sizeof (uint32_t));
+	kbd_in = jackstub_port ("midi_KBD_in");
+	if ((durations == NULL) || (kbd_in == NULL)) return;
+
+	period = (nframes * 1e9) / jack_get_sample_rate (client);
+	printf ("flood of keyboard input while recording: %d cycles of %d frames per run, 120 bpm, free timing (us)\n", nb_cycles, nframes);
+	printf ("pattern   events |  cycle mean    p99    max  late | kbd in mean   p99    max | events/ms | notes recorded  dropped | out dropped | misordered\n");
+
+	for (p = 0; p < sizeof (bench_patterns) / sizeof (char *); p++) {
+		for (burst = 1; burst <= max_burst; burst *= 2) {
+
+			// record an empty song from first bar
+			bench_flush ();
+			memset (song, 0, SONG_SIZE * sizeof (note_t));
+			song_length = 0;
+			quantizer = FREE_TIMING;
+			quantizer_off = FREE_TIMING;
+			time_beats_per_minute = 120;
+			time_bpm_multiplier = 1.0;
+			ui_current_page = 0;
+			ui_current_bar = 0;
+			is_record = TRUE;
+			is_play = TRUE;
+			start_playing ();
+			stats_reset ();
+
+			sum = 0;
+			late = 0;
+			sent_notes = 0;
+			dropped_rec = 0;
+			dropped_out = 0;
+			for (c = 0; c < nb_cycles; c++) {
+
+				// burst of events, spread over the cycle
+				played_notes = 0;
+				volumes = 0;
+				for (k = 0; k < burst; k++) {
+					if (bench_flood_event (p, k, burst, sent_notes + played_notes, event)) played_notes++;
+					else if ((event [1] >= 1) && (event [1] <= 8)) volumes++;
+					jackstub_send (kbd_in, jackstub_frame () + ((k * nframes) / burst), event, 3);
+				}
+				sent_notes += played_notes;
+
+				length = song_length;
+				start = stats_now ();
+				jackstub_cycle (nframes);
+				durations [c] = stats_now () - start;
+				sum += durations [c];
+				if (durations [c] > period * STATS_BUDGET / 100) late++;
+
+				// notes not recorded (full song)
+				dropped_rec += played_notes - (song_length - length);
+
+				// music output: at least the notes played live and the volumes (recorded notes may also be played back)
+				expected = played_notes + volumes;
+				n = jack_midi_get_event_count (jack_port_get_buffer (midi_out, nframes));
+				if (n < expected) dropped_out += expected - n;
+			}
+
+			qsort (durations, nb_cycles, sizeof (uint32_t), compare_durations);
+			stats_summary (STATS_KBD_IN, &k_mean, &k_p99, &k_max);
+			printf ("%-9s %6d | %11.1f %6.1f %6.1f %5d | %11.1f %5.1f %6.1f | %9.0f | %14u %8u | %11u | %10d\n",
+				bench_patterns [p], burst,
+				(sum / nb_cycles) / 1000.0, durations [(nb_cycles * 99) / 100] / 1000.0, durations [nb_cycles - 1] / 1000.0, late,
+				k_mean / 1000.0, k_p99 / 1000.0, k_max / 1000.0,
+				k_mean ? (burst * 1e6) / k_mean : 0.0,
+				sent_notes - dropped_rec, dropped_rec, dropped_out, bench_misordered ());
+
+			is_record = FALSE;
+			is_play = FALSE;
+			stop_playing ();
+			jackstub_cycle (nframes);
+		}
+	}
+
+	quantizer = EIGHTH;
+	quantizer_off = SIXTEENTH;
+	free (durations);
+}
+
+
+// requantize each track of a song of nb_notes notes, nb_runs times, for each quantizer (same for notes on and off)
+void bench_requant (int nb_notes, int nb_runs) {
+
+	note_t *dst;
+	uint64_t start, d, sum, max;
+	int q, instr, r;
+
+	if (nb_runs <= 0) nb_runs = BENCH_REQUANT_RUNS;
+	dst = malloc (SONG_SIZE * sizeof (note_t));
+	if (dst == NULL) return;
+
+	bench_song (nb_notes, 1);
+	printf ("requantization of 1 track of a song of %d notes, %d runs per track (us)\n", song_length, nb_runs);
+	printf ("quantizer |   mean    max | notes/ms\n");
+
+	for (q = 0; q < sizeof (bench_quantizers) / sizeof (int); q++) {
+		sum = 0;
+		max = 0;
+		for (instr = 0; instr < 8; instr++) {
+			for (r = 0; r < nb_runs; r++) {
+				start = stats_now ();
+				requantize (song, song_length, dst, instr, bench_quantizers [q], bench_quantizers [q]);
+				d = stats_now () - start;
+				sum += d;
+				if (d > max) max = d;
+			}
+		}
+		sum /= 8 * nb_runs;
+		printf ("%9d | %6.1f %6.1f | %8.0f\n", bench_quantizers [q], sum / 1000.0, max / 1000.0, sum ? (song_length * 1e6) / sum : 0.0);
+	}
+
+	free (dst);
+}
+
+
+// former quantize (), with double arithmetic and divisions (reference of the quantization benchmark)
+// references are neither inlined nor specialized, so that they are compared call for call with the functions of utils.c
+static __attribute__ ((noipa)) uint32_t bench_quantize_double (uint32_t tick, int quant) {
+
+	int step;
+	uint32_t div, rem;
+
+	if (quant == FREE_TIMING) return tick;
+	step = (int) (time_ticks_per_beat / quant);
+	div = tick / step;
+	rem = tick % step;
+	if (rem < (int) (step / 2)) rem = 0;
+	else rem = step;
+	return ((div * step) + rem);
+}
+
+
+// former tick2note () (quantized values), with double arithmetic and divisions
+static __attribute__ ((noipa)) void bench_tick2note_double (uint32_t tick, note_t *note) {
+
+	int ticks_per_bar;
+
+	ticks_per_bar = (int) (time_ticks_per_beat * time_beats_per_bar);
+	note->qbar = tick / ticks_per_bar;
+	note->qtick = tick % ticks_per_bar;
+	note->qbeat = note->qtick / (int) (time_ticks_per_beat);
+}
+
+
+// former note2tick () (quantized values)
+static __attribute__ ((noipa)) void bench_note2tick_double (note_t note, uint32_t *tick) {
+
+	*tick = ((note.qbar * (int) (time_ticks_per_beat * time_beats_per_bar)) + note.qtick);
+}
+
+
+// compare quantize (), tick2note () and note2tick () with the former double versions, over all the ticks of a song of 512 bars,
+// nb_runs times, for several time signatures; results shall be the same
+void bench_quantize (int nb_runs) {
+
+	note_t note, ref;
+	uint64_t start, t_int, t_double, n2t_int, n2t_double, t2n_int, t2n_double;
+	uint32_t tick, song_ticks, qtick, sum, sum_ref, errors;
+	double saved_ticks, saved_beats;
+	int m, q, r;
+
+	if (nb_runs <= 0) nb_runs = BENCH_QUANTIZE_RUNS;
+	saved_ticks = time_ticks_per_beat;
+	saved_beats = time_beats_per_bar;
+	memset (&note, 0, sizeof (note_t));
+	memset (&ref, 0, sizeof (note_t));
+
+	printf ("quantization of all the ticks of 512 bars, %d runs (ns per call; integer / double)\n", nb_runs);
+	printf ("ticks/beat beats | quantizer  quantize          | tick2note         | note2tick         | errors\n");
+
+	for (m = 0; m < sizeof (bench_meters) / sizeof (bench_meters [0]); m++) {
+		time_ticks_per_beat = bench_meters [m][0];
+		time_beats_per_bar = bench_meters [m][1];
+		timebase_update ();
+		song_ticks = 512 * (int) (time_ticks_per_beat * time_beats_per_bar);
+
+		for (q = 0; q < sizeof (bench_quantizers) / sizeof (int); q++) {
+			errors = 0;
+
+			// quantize: sums are printed, so that the loops are not optimized away
+			sum = 0;
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) sum += quantize (tick, bench_quantizers [q]);
+			t_int = stats_now () - start;
+			sum_ref = 0;
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) sum_ref += bench_quantize_double (tick, bench_quantizers [q]);
+			t_double = stats_now () - start;
+			if (sum != sum_ref) errors++;
+
+			// tick2note and note2tick, on quantized ticks
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) {
+				tick2note (tick, &note, TRUE);
+				sum += note.qbar + note.qbeat + note.qtick;
+			}
+			t2n_int = stats_now () - start;
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) {
+				bench_tick2note_double (tick, &ref);
+				sum_ref += ref.qbar + ref.qbeat + ref.qtick;
+			}
+			t2n_double = stats_now () - start;
+			if (sum != sum_ref) errors++;
+
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) {
+				note.qbar = tick >> 12;
+				note.qtick = tick & 0x3FF;
+				note2tick (note, &qtick, TRUE);
+				sum += qtick;
+			}
+			n2t_int = stats_now () - start;
+			start = stats_now ();
+			for (r = 0; r < nb_runs; r++) for (tick = 0; tick < song_ticks; tick++) {
+				ref.qbar = tick >> 12;
+				ref.qtick = tick & 0x3FF;
+				bench_note2tick_double (ref, &qtick);
+				sum_ref += qtick;
+			}
+			n2t_double = stats_now () - start;
+			if (sum != sum_ref) errors++;
+
+			// all the ticks are also checked one by one
+			for (tick = 0; tick < song_ticks; tick++) {
+				tick2note (tick, &note, TRUE);
+				bench_tick2note_double (tick, &ref);
+				if ((quantize (tick, bench_quantizers [q]) != bench_quantize_double (tick, bench_quantizers [q])) ||
+					(note.qbar != ref.qbar) || (note.qbeat != ref.qbeat) || (note.qtick != ref.qtick)) errors++;
+			}
+
+			printf ("%10.0f %5.0f | %9d %7.2f / %7.2f | %7.2f / %7.2f | %7.2f / %7.2f | %u (%u)\n",
+				time_ticks_per_beat, time_beats_per_bar, bench_quantizers [q],
+				(double) t_int / ((double) nb_runs * song_ticks), (double) t_double / ((double) nb_runs * song_ticks),
+				(double) t2n_int / ((double) nb_runs * song_ticks), (double) t2n_double / ((double) nb_runs * song_ticks),
+				(double) n2t_int / ((double) nb_runs * song_ticks), (double) n2t_double / ((double) nb_runs * song_ticks),
+				errors, sum & 0xFF);
+		}
+	}
+
+	time_ticks_per_beat = saved_ticks;
+	time_beats_per_bar = saved_beats;
+	timebase_update ();
+}
+
+
+// time nb_runs of each whole-song pass (colors of bars, colors of notes, transposition); returns the mean durations in ns
+static void bench_passes (int nb_runs, uint64_t * durations) {
+
+	uint64_t start;
+	int r;
+
+	start = stats_now ();
+	for (r = 0; r < nb_runs; r++) note2bar_color ();
+	durations [0] = (stats_now () - start) / nb_runs;
+
+	start = stats_now ();
+	for (r = 0; r < nb_runs; r++) {
+		ui_bars [r % 8][0][0] = (r & 1) ? LO_RED : LO_GREEN;		// so that notes of a bar change color
+		bar2note_color ();
+	}
+	durations [1] = (stats_now () - start) / nb_runs;
+
+	start = stats_now ();
+	for (r = 0; r < nb_runs; r++) transpo_song (r % 8, (r & 8) ? MINUS : PLUS);
+	durations [2] = (stats_now () - start) / nb_runs;
+}
+
+
+// whole-song passes on a song of nb_notes notes, nb_runs times, on the calling thread, then with the worker pool
+// results shall be the same
+void bench_pool (int nb_notes, int nb_runs) {
+
+	static const char *passes [] = {"note2bar_color", "bar2note_color", "transpo_song"};
+	static note_t serial_song [SONG_SIZE];
+	static uint8_t serial_bars [8][8][64];
+	uint64_t serial [3], parallel [3];
+	int p;
+
+	if (nb_runs <= 0) nb_runs = BENCH_POOL_RUNS;
+
+	bench_song (nb_notes, 1);
+	bench_passes (nb_runs, serial);
+	memcpy (serial_song, song, song_length * sizeof (note_t));
+	memcpy (serial_bars, ui_bars, sizeof (serial_bars));
+
+	bench_song (nb_notes, 1);
+	pool_open ();
+	bench_passes (nb_runs, parallel);
+
+	printf ("whole-song passes on %d notes, %d runs, %d parts (us)\n", song_length, nb_runs, pool_size (song_length));
+	printf ("pass           | serial   pool | speedup\n");
+	for (p = 0; p < 3; p++) {
+		printf ("%-14s | %6.1f %6.1f | %7.2f\n", passes [p], serial [p] / 1000.0, parallel [p] / 1000.0, parallel [p] ? (double) serial [p] / parallel [p] : 0.0);
+	}
+	printf ("results: %s\n", ((memcmp (serial_song, song, song_length * sizeof (note_t)) == 0) && (memcmp (serial_bars, ui_bars, sizeof (serial_bars)) == 0)) ? "same" : "DIFFERENT");
+}
+
+
+// create an empty temporary directory for the files written by a benchmark; returns FALSE if it cannot be created
+static int bench_directory (char * directory) {
+
+	strcpy (directory, BENCH_DIR);
+	if (mkdtemp (directory) == NULL) {
+		fprintf (stderr, "Cannot create %s\n", directory);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// remove the temporary directory of a benchmark, and the files left in it
+static void bench_directory_remove (char * directory) {
+
+	DIR *dir;
+	struct dirent *entry;
+	char filename [512];
+
+	dir = opendir (directory);
+	if (dir != NULL) {
+		while ((entry = readdir (dir)) != NULL) {
+			if (entry->d_name [0] == '.') continue;
+			sprintf (filename, "%s/%s", directory, entry->d_name);
+			unlink (filename);
+		}
+		closedir (dir);
+	}
+	rmdir (directory);
+}
+
+
+// midi export of a generated song of nb_notes notes, in a temporary directory ("bench.a midi [notes]")
+void bench_midi (int nb_notes) {
+
+	char directory [64];
+
+	if (!bench_directory (directory)) return;
+	test_save_to_midi (nb_notes, directory);
+	bench_directory_remove (directory);
+}
+
+
+// size and speed of json, midi and compact files over nb_songs generated songs, in a temporary directory ("bench.a pak [songs]")
+void bench_pak (int nb_songs) {
+
+	char directory [64];
+
+	if (nb_songs <= 0) nb_songs = BENCH_PAK_SONGS;
+	if (!bench_directory (directory)) return;
+	test_compact (nb_songs, directory);
+	bench_directory_remove (directory);
+}
+
+
+// replay the input events of in (capture format of jackstub, see jackstub_replay) through process () for nb_cycles cycles of
+// STUB_NFRAMES frames, and capture the output events to out; returns the number of input events, -1 if in cannot be read
+static int bench_replay_files (FILE * in, FILE * out, int nb_cycles) {
+
+	int nb, c;
+
+	bench_flush ();
+	nb = jackstub_replay (in);
+	if (nb < 0) return -1;
+	jackstub_capture (out);
+	for (c = 0; c < nb_cycles; c++) jackstub_cycle (STUB_NFRAMES);
+	jackstub_capture (NULL);
+	return nb;
+}
+
+
+// replay the input events recorded in file in, and capture the output events to file out ("bench.a replay in out [cycles]")
+void bench_replay (char * in, char * out, int nb_cycles) {
+
+	FILE *fin, *fout;
+	int nb;
+
+	if (nb_cycles <= 0) nb_cycles = BENCH_REPLAY_CYCLES;
+	fin = fopen (in, "rt");
+	if (fin == NULL) {
+		fprintf (stderr, "Cannot open %s\n", in);
+		return;
+	}
+	fout = fopen (out, "wt");
+	if (fout == NULL) {
+		fprintf (stderr, "Cannot create %s\n", out);
+		fclose (fin);
+		return;
+	}
+	nb = bench_replay_files (fin, fout, nb_cycles);
+	fclose (fin);
+	fclose (fout);
+	if (nb < 0) printf ("%s: bad input line\n", in);
+	else printf ("replayed %d events over %d cycles of %d frames, output captured to %s\n", nb, nb_cycles, STUB_NFRAMES, out);
+}
+
+
+// replay of a recorded input through process (), with the captured music output compared to the expected one (make test)
+// a note played on the keyboard while stopped is sent to the synth at the start of the cycle it is received in
+// returns the number of failed checks
+int test_replay () {
+
+	static const char *input = "# note on and off on the keyboard, while stopped\n1000 midi_KBD_in 90 3C 64\n6000 midi_KBD_in 80 3C 00\n";
+	static const char *expected = "768 midi_out 98 3C 64\n5888 midi_out 88 3C 00\n";
+	FILE *in, *out;
+	char line [256], music [1024];
+	int nb, failures;
+
+	in = tmpfile ();
+	out = tmpfile ();
+	if ((in == NULL) || (out == NULL)) {
+		printf ("FAIL: replay: cannot create temporary files\n");
+		return 1;
+	}
+	fputs (input, in);
+	rewind (in);
+	nb = bench_replay_files (in, out, 40);
+	fclose (in);
+
+	// music output only: clock pulses depend on the tempo
+	music [0] = 0;
+	rewind (out);
+	while (fgets (line, sizeof (line), out) != NULL) {
+		if ((strstr (line, " midi_out ") != NULL) && (strlen (music) + strlen (line) < sizeof (music))) strcat (music, line);
+	}
+	fclose (out);
+
+	failures = 0;
+	if (nb != 2) {
+		printf ("FAIL: replay: %d input events instead of 2\n", nb);
+		failures++;
+	}
+	if (strcmp (music, expected) != 0) {
+		printf ("FAIL: replay: music output is\n%s", music);
+		failures++;
+	}
+	printf ("replay tests: %s (%d failed checks)\n", failures ? "FAILED" : "passed", failures);
+	return failures;
+}
@@ -0,0 +1,15 @@
+/** @file bench.h
+ *
+ * @brief This file defines prototypes of functions inside bench.c
+ *
+ */
+
+void bench_playback (int, int);
+void bench_flood (int, int);
+void bench_requant (int, int);
+void bench_quantize (int);
+void bench_pool (int, int);
+void bench_midi (int);
+void bench_pak (int);
+void bench_replay (char *, char *, int);
+int test_replay ();
@@ -0,0 +1,270 @@
+/** @file cache.c
+ *
+ * @brief Song cache. Save slots next to the current song are decoded in the background by a non-realtime thread,
+ * so that switching to one of them is only a swap of the song pointer, done by process between 2 bars.
+ * The former song buffer may still be used by a pass of the main loop (colors, save, midi export): it is given back to
+ * the cache thread only when the main loop starts its next iteration (cache_release).
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static song_cache_t song_cache [SONG_CACHE_SIZE];
+static char cache_directory [255];			// save directory
+static pthread_t cache_thread;
+static volatile int cache_request = FALSE;	// set when the songs to be cached shall be checked again
+static volatile int cache_current = -1;		// slot of the current song, -1 if none; songs around it are cached
+static volatile int cache_version [64];		// incremented each time a slot changes on disk
+static song_cache_t * volatile cache_selected = NULL;	// song selected by the user, to be switched to by process
+
+
+// compute colors of the bars of a decoded song (same as note2bar_color, on a song of the cache)
+static void cache_bars (song_cache_t * sg) {
+
+	int i;
+
+	memset (sg->bars, BLACK, 8 * 8 * 64);
+	for (i = 0; i < sg->length; i++) {
+		sg->bars [sg->notes [i].instrument][sg->notes [i].qbar / 64][sg->notes [i].qbar % 64] = sg->notes [i].color;
+	}
+}
+
+
+// returns TRUE if slot is in the list of slots to be cached
+static int cache_wanted (int slot, int * wanted, int nb) {
+
+	int i;
+
+	for (i = 0; i < nb; i++) if (wanted [i] == slot) return TRUE;
+	return FALSE;
+}
+
+
+// returns the entry of the cache holding an up-to-date version of slot, NULL if there is none
+static song_cache_t * cache_find (int slot) {
+
+	int i;
+
+	for (i = 0; i < SONG_CACHE_SIZE; i++) {
+		if ((song_cache [i].state == CACHE_EMPTY) || (song_cache [i].state == CACHE_LOADING) || (song_cache [i].state == CACHE_RETIRED)) continue;
+		if ((song_cache [i].slot == slot) && (song_cache [i].version == cache_version [slot])) return &song_cache [i];
+	}
+	return NULL;
+}
+
+
+// decode the songs next to the current song: next slots first, as songs of a live set are usually saved in order
+static void cache_fill () {
+
+	int wanted [SONG_CACHE_SIZE];
+	int nb, d, slot, i, center;
+	song_cache_t *sg;
+
+	// list the slots to be cached
+	nb = 0;
+	center = cache_current;
+	for (d = 1; (d < 64) && (nb < SONG_CACHE_SIZE); d++) {
+		slot = center + d;
+		if ((slot < 64) && save_slots [slot].exists) wanted [nb++] = slot;
+		slot = center - d;
+		if ((slot >= 0) && (nb < SONG_CACHE_SIZE) && save_slots [slot].exists) wanted [nb++] = slot;
+	}
+
+	for (i = 0; i < nb; i++) {
+		if (cache_request) return;			// request has changed in the meantime: start again
+		if (cache_find (wanted [i]) != NULL) continue;
+
+		// get an entry: an empty one, or one holding a slot which is not wanted anymore
+		for (sg = song_cache; sg < song_cache + SONG_CACHE_SIZE; sg++) {
+			if (__sync_bool_compare_and_swap (&sg->state, CACHE_EMPTY, CACHE_LOADING)) break;
+			if (cache_wanted (sg->slot, wanted, nb) && (sg->version == cache_version [sg->slot])) continue;
+			if (__sync_bool_compare_and_swap (&sg->state, CACHE_READY, CACHE_LOADING)) break;
+			if (__sync_bool_compare_and_swap (&sg->state, CACHE_FAILED, CACHE_LOADING)) break;
+		}
+		if (sg == song_cache + SONG_CACHE_SIZE) return;		// all entries are in use
+
+		sg->slot = wanted [i];
+		sg->version = cache_version [sg->slot];
+		if (load_song (sg->slot, cache_directory, sg) == 0) {
+			cache_bars (sg);
+			sg->state = CACHE_READY;
+			slots_changed = TRUE;			// load screen shows cached songs
+		}
+		else sg->state = CACHE_FAILED;		// eg. imported midi file: loaded from the main loop instead
+	}
+}
+
+
+// cache thread: decode songs when requested
+static void * cache_loop (void *arg) {
+
+	while (1) {
+		if (cache_request) {
+			cache_request = FALSE;
+			cache_fill ();
+		}
+		usleep (10000);		// 10 ms
+	}
+
+	return NULL;
+}
+
+
+// request songs next to slot to be decoded in the background; slot is the current song, -1 to keep current one
+void cache_preload (int slot) {
+
+	if (slot != -1) cache_current = slot;
+	cache_request = TRUE;
+}
+
+
+// slot has changed on disk: cached version of the slot is not valid anymore
+void cache_invalidate (int slot) {
+
+	__sync_fetch_and_add (&cache_version [slot], 1);
+	cache_request = TRUE;
+}
+
+
+// returns TRUE if the song of slot is decoded and may be switched to straight
+int cache_is_ready (int slot) {
+
+	return (cache_find (slot) != NULL);
+}
+
+
+// user has selected a slot in load mode; called from process
+// returns TRUE if the song is cached: process will switch to it (at next bar if playing), FALSE if it shall be loaded from disk
+int cache_select (int slot) {
+
+	song_cache_t *sg;
+
+	sg = cache_find (slot);
+	if ((sg == NULL) || (!__sync_bool_compare_and_swap (&sg->state, CACHE_READY, CACHE_IN_USE))) return FALSE;
+
+	// a previous selection is waiting for the next bar: release it
+	if (cache_selected != NULL) cache_selected->state = CACHE_READY;
+	cache_selected = sg;
+
+	// BBT cannot change while playing: stop playing if the new song does not have the same bar length
+	if ((is_play) && ((sg->beats_per_bar != time_beats_per_bar) || (sg->ticks_per_beat != time_ticks_per_beat))) {
+		is_play = FALSE;
+		stop_playing ();
+	}
+	return TRUE;
+}
+
+
+// user has left load mode before the selected song could be switched to
+void cache_cancel () {
+
+	song_cache_t *sg;
+
+	sg = cache_selected;
+	cache_selected = NULL;
+	if (sg != NULL) sg->state = CACHE_READY;
+}
+
+
+// returns TRUE if a song is waiting to be switched to
+int cache_pending () {
+
+	return (cache_selected != NULL);
+}
+
+
+// switch to the song selected by the user; called from process, either when stopped or at a change of bar
+// the former song goes to the cache entry, which is free for another slot once released by the main loop
+void cache_swap () {
+
+	song_cache_t *sg;
+	note_t *notes;
+
+	sg = cache_selected;
+	if (sg == NULL) return;
+	cache_selected = NULL;
+
+	// swap notes, then take settings and colors of the new song
+	notes = song;
+	song = sg->notes;
+	sg->notes = notes;
+	set_song (sg);
+	memcpy (ui_bars, sg->bars, 8 * 8 * 64);
+	time_position.beats_per_minute = (int) (time_beats_per_minute * time_bpm_multiplier);
+	create_metronome ();
+	set_instruments ();
+	set_volumes ();
+
+	journal_reset (sg->slot, journal_position ());	// journal restarts from loaded song, with the changes to come
+	cache_current = sg->slot;
+	sg->state = CACHE_RETIRED;			// main loop may be using the former song
+	cache_request = TRUE;				// cache the songs next to the new one
+
+	// leave load mode and light leds on the UI
+	is_load = FALSE;
+	file_selected = 0xFF;
+	led_ui_instruments (ON);
+	led_ui_pages (ON);
+	led_ui_bars (ui_current_instrument, ui_current_page);
+	// display between limit 1 and 2
+	ui_current_bar = led_ui_select (ui_limit1, ui_limit2);
+}
+
+
+// give the buffers of the songs switched from back to the cache thread
+// called from the main loop, between 2 passes: a song switched from before this call is not used by the main loop any more
+void cache_release () {
+
+	int i, released;
+
+	released = FALSE;
+	for (i = 0; i < SONG_CACHE_SIZE; i++) {
+		if (__sync_bool_compare_and_swap (&song_cache [i].state, CACHE_RETIRED, CACHE_EMPTY)) released = TRUE;
+	}
+	if (released) cache_request = TRUE;		// entries may have been missing to cache songs
+}
+
+
+// allocate the song cache and start the cache thread
+int cache_open (char * directory) {
+
+	int i;
+
+	strncpy (cache_directory, directory, sizeof (cache_directory) - 1);
+	for (i = 0; i < SONG_CACHE_SIZE; i++) {
+		song_cache [i].state = CACHE_EMPTY;
+		song_cache [i].notes = malloc (SONG_SIZE * sizeof (note_t));
+		if (song_cache [i].notes == NULL) {
+			fprintf ( stderr, "Cannot allocate song cache\n" );
+			return FALSE;
+		}
+	}
+
+	if (pthread_create (&cache_thread, NULL, cache_loop, NULL) != 0) {
+		fprintf ( stderr, "Cannot start song cache thread\n" );
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,15 @@
+/** @file cache.h
+ *
+ * @brief This file defines prototypes of functions inside cache.c
+ *
+ */
+
+void cache_preload (int);
+void cache_invalidate (int);
+int cache_is_ready (int);
+int cache_select (int);
+void cache_cancel ();
+int cache_pending ();
+void cache_swap ();
+void cache_release ();
+int cache_open (char *);
@@ -13,58 +13,102 @@
 #include "disk.h"
 #include "midiwriter.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+// open a temporary file in the given directory, which will later replace filename through commit_file ()
+// temp file name starts with a dot, so it is never taken for a save slot by get_files_in_directory ()
+static FILE * open_temp_file (char * directory, char * filename, char * tempname, const char * mode) {
+
+	sprintf (tempname, "%s/.%s.tmp", directory, filename + strlen (directory) + 1);
+	return (fopen (tempname, mode));
+}
 
 
-// in the given directory, look for all the files named between 0x00 and 0x40
-// fill a table containing TRUE or FALSE, depending whether the file is there or not
-int get_files_in_directory (char * directory, uint8_t * table) {
+// flush temp file to the SD card, then rename it over the target file
+// rename is atomic: after a power cut, we have either the previous version of the file or the new one, never a half-written file
+// returns 0 if everything went well
+static int commit_file (FILE * fp, char * directory, char * tempname, char * filename) {
 
-	DIR *dir;
-	struct dirent *ent;
-	char st1[64][3];
-	int i;
+	int fd;
 
-	// empty recipient table
-	memset (table, FALSE, 64);
+	// make sure data is on the disk before renaming
+	if ((fflush (fp) != 0) || (fsync (fileno (fp)) != 0)) {
+		fclose (fp);
+		unlink (tempname);
+		return 1;
+	}
+	fclose (fp);
 
-	// build temp table for storing file names first
-	for (i = 0; i < 64; i++) {
-		// convert i into string (in lowercases and uppercases)
-		sprintf (st1 [i], "%02X", i);
+	if (rename (tempname, filename) != 0) {
+		unlink (tempname);
+		return 1;
 	}
 
-	if ((dir = opendir (directory)) != NULL) {
-		/* print all the files and directories within directory */
-		while ((ent = readdir (dir)) != NULL) {
-			// check if file starts with number; allow mixing lower and upper cases
-			for (i = 0; i < 64; i++) {
-				if ((st1[i][0] == ent->d_name [0])  && (st1[i][1] == ent->d_name [1])) {
-					table [i] = TRUE;
-				}
-			}
-		}
-		// processing done, close dir
-		closedir (dir);
-		return TRUE;
+	// make the rename itself persistent by syncing the directory entry
+	fd = open (directory, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync (fd);
+		close (fd);
 	}
+	return 0;
+}
 
-	else {
-		// could not open directory
-		fprintf ( stderr, "Directory not found.\n" );
-		return FALSE;
+
+// decode a compact song file into sg
+// returns 0 if ok, 1 if song file is invalid, 2 if there is no song file
+static int load_compact (uint8_t name, char * directory, song_cache_t * sg) {
+
+	FILE *fp;
+	char filename [255];		// temp structure for file name
+	uint8_t *buffer;
+	int len, status;
+
+	sprintf (filename, "%s/%02X.pak", directory, name);
+	fp = fopen (filename, "rb");
+	if (fp == NULL) {
+		fprintf ( stderr, "Cannot read save file: %s\n", filename);
+		return 2;
+	}
+
+	buffer = malloc (PACK_SIZE);
+	if (buffer == NULL) {
+		fclose (fp);
+		return 1;
 	}
+	len = fread (buffer, 1, PACK_SIZE, fp);
+	fclose (fp);
+
+	sg->pak_size = unpack_song (buffer, len, sg);
+	status = (sg->pak_size == 0) ? 1 : 0;
+	if (status == 0) sg->slot = name;
+	free (buffer);
+	return status;
 }
 
 
-// function called in case user pressed the load pad
+// decode a song file into sg, without touching the current song (sg->notes shall point to SONG_SIZE notes)
 // name is a pad number (0-63) which corresponds to the number of the song
 // directory is the patch where songs are stored
-int load (uint8_t name, char * directory) {
+// returns 0 if ok, 1 if song file is invalid, 2 if there is no song file
+int load_song (uint8_t name, char * directory, song_cache_t * sg) {
 
 	FILE *fp;
 	int i;
 	char filename [255];		// temp structure for file name
-	char buffer [JSON_SIZE];	// buffer containing json data
+	char *buffer;				// buffer containing json data (on the heap: this also runs on the cache thread)
 	int len;
 	cJSON *json;				// used for CJSON writing
 	cJSON *instruments = NULL;
@@ -75,10 +119,17 @@ int load (uint8_t name, char * directory) {
 	char *json_str;				// string where json is stored
 	int status = 0;
 	const char *error_ptr;
+	struct stat json_st, pak_st;
 
 	// create file path
 	sprintf (filename, "%s/%02X.json", directory, name);
 
+	// slot may have been saved as a compact file: load the most recent of both files
+	if (stat (filename, &json_st) != 0) json_st.st_mtime = 0;
+	sprintf (filename, "%s/%02X.pak", directory, name);
+	if ((stat (filename, &pak_st) == 0) && (pak_st.st_mtime >= json_st.st_mtime)) return (load_compact (name, directory, sg));
+	sprintf (filename, "%s/%02X.json", directory, name);
+
 	// create file in write mode
 	fp = fopen (filename, "rt");
 	if (fp==NULL) {
@@ -87,12 +138,20 @@ int load (uint8_t name, char * directory) {
 	}
 
 	// read and close file
-	len = fread(buffer, 1, sizeof(buffer), fp); 
+	buffer = malloc (JSON_SIZE + 1);
+	if (buffer == NULL) {
+		fprintf ( stderr, "Cannot allocate memory for save file: %s\n", filename);
+		fclose (fp);
+		return 1;
+	}
+	len = fread(buffer, 1, JSON_SIZE, fp); 
 	fclose(fp); 
+	buffer [len] = 0;
   
 	// parse the JSON data 
 	status = 1;
 	json = cJSON_Parse(buffer); 
+	free (buffer);
 	if (json == NULL) { 
 		error_ptr = cJSON_GetErrorPtr(); 
 		if (error_ptr != NULL) { 
@@ -106,7 +165,7 @@ int load (uint8_t name, char * directory) {
 	for (i = 0; i < 8; i++) {
 		data = cJSON_GetArrayItem(instruments, i);
 		if (data == NULL) goto end;
-		instrument_list [i] = data->valueint;
+		sg->instruments [i] = data->valueint;
 	}
 
 	// volumes; first instrument does not count (drum channel)
@@ -114,39 +173,39 @@ int load (uint8_t name, char * directory) {
 	for (i = 0; i < 8; i++) {
 		data = cJSON_GetArrayItem(volumes, i);
 		if (data == NULL) goto end;
-		volume_list [i] = data->valueint;
+		sg->volumes [i] = data->valueint;
 	}
 
 	// tempo values
 	data = cJSON_GetObjectItemCaseSensitive (json, "beats_per_bar");
 	if (data == NULL) goto end;
-	time_beats_per_bar = data->valuedouble;
+	sg->beats_per_bar = data->valuedouble;
 
 	data = cJSON_GetObjectItemCaseSensitive (json, "beat_type");
 	if (data == NULL) goto end;
-	time_beat_type = data->valuedouble;
+	sg->beat_type = data->valuedouble;
 
 	data = cJSON_GetObjectItemCaseSensitive (json, "ticks_per_beat");
 	if (data == NULL) goto end;
-	time_ticks_per_beat = data->valuedouble;
+	sg->ticks_per_beat = data->valuedouble;
 
 	data = cJSON_GetObjectItemCaseSensitive (json, "ticks_beats_per_minute");
 	if (data == NULL) goto end;
-	time_beats_per_minute = data->valuedouble;
+	sg->beats_per_minute = data->valuedouble;
 
 	data = cJSON_GetObjectItemCaseSensitive (json, "time_bpm_multiplier");
 	if (data == NULL) goto end;
-	time_bpm_multiplier = data->valuedouble;
+	sg->bpm_multiplier = data->valuedouble;
 
 	// quantizer
 	data = cJSON_GetObjectItemCaseSensitive (json, "quantizer");
 	if (data == NULL) goto end;
-	quantizer = data->valueint;
+	sg->quantizer = data->valueint;
 
 	// song length
 	data = cJSON_GetObjectItemCaseSensitive (json, "song_length");
 	if (data == NULL) goto end;
-	song_length = data->valueint;
+	sg->length = data->valueint;
 
 	// notes of song
     notes = cJSON_GetObjectItemCaseSensitive(json, "notes");
@@ -155,65 +214,457 @@ int load (uint8_t name, char * directory) {
 	i = 0;
     cJSON_ArrayForEach(note, notes) {
 
+		if (i >= SONG_SIZE) goto end;		// song does not fit in memory
+
 		data = cJSON_GetObjectItemCaseSensitive (note, "instrument");
 		if (data == NULL) goto end;
-		song [i].instrument = data->valueint;
+		sg->notes [i].instrument = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "status");
 		if (data == NULL) goto end;
-		song [i].status = data->valueint;
+		sg->notes [i].status = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "key");
 		if (data == NULL) goto end;
-		song [i].key = data->valueint;
+		sg->notes [i].key = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "velocity");
 		if (data == NULL) goto end;
-		song [i].vel = data->valueint;
+		sg->notes [i].vel = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "color");
 		if (data == NULL) goto end;
-		song [i].color = data->valueint;
+		sg->notes [i].color = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "bar");
 		if (data == NULL) goto end;
-		song [i].bar = data->valueint;
+		sg->notes [i].bar = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "beat");
 		if (data == NULL) goto end;
-		song [i].beat = data->valueint;
+		sg->notes [i].beat = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "tick");
 		if (data == NULL) goto end;
-		song [i].tick = data->valueint;
+		sg->notes [i].tick = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "qbar");
 		if (data == NULL) goto end;
-		song [i].qbar = data->valueint;
+		sg->notes [i].qbar = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "qbeat");
 		if (data == NULL) goto end;
-		song [i].qbeat = data->valueint;
+		sg->notes [i].qbeat = data->valueint;
 
 		data = cJSON_GetObjectItemCaseSensitive (note, "qtick");
 		if (data == NULL) goto end;
-		song [i].qtick = data->valueint;
+		sg->notes [i].qtick = data->valueint;
 
 		i++;
 	}
 
 	// make sure we have as many notes as defined in song_length
-	if (i != song_length) goto end;	
+	if (i != sg->length) goto end;	
 
 	// everything went well
+	sg->slot = name;
+	sg->pak_size = 0;
 	status = 0;
 
 end:
     cJSON_Delete(json);
     return status;
 }
+
+
+// get the settings of the current song (notes are not copied)
+void get_song (song_cache_t * sg) {
+
+	sg->notes = song;
+	sg->length = song_length;
+	memcpy (sg->instruments, instrument_list, 8 * sizeof (int));
+	memcpy (sg->volumes, volume_list, 8 * sizeof (int));
+	sg->beats_per_bar = time_beats_per_bar;
+	sg->beat_type = time_beat_type;
+	sg->ticks_per_beat = time_ticks_per_beat;
+	sg->beats_per_minute = time_beats_per_minute;
+	sg->bpm_multiplier = time_bpm_multiplier;
+	sg->quantizer = quantizer;
+}
+
+
+// apply the settings of a decoded song to the current song (notes are not copied)
+void set_song (song_cache_t * sg) {
+
+	memcpy (instrument_list, sg->instruments, 8 * sizeof (int));
+	memcpy (volume_list, sg->volumes, 8 * sizeof (int));
+	time_beats_per_bar = sg->beats_per_bar;
+	time_beat_type = sg->beat_type;
+	time_ticks_per_beat = sg->ticks_per_beat;
+	timebase_update ();
+	time_beats_per_minute = sg->beats_per_minute;
+	time_bpm_multiplier = sg->bpm_multiplier;
+	quantizer = sg->quantizer;
+	song_length = sg->length;
+
+	// next compact save of the slot only appends what changes from now on
+	if (sg->pak_size) {
+		pack_slot = sg->slot;
+		pack_size = sg->pak_size;
+		dirty_segments = 0;
+	}
+	else {
+		pack_slot = -1;
+		dirty_segments = PACK_ALL;
+	}
+}
+
+
+// function called in case user pressed the load pad
+// name is a pad number (0-63) which corresponds to the number of the song
+// directory is the patch where songs are stored
+int load (uint8_t name, char * directory) {
+
+	song_cache_t sg;
+	int status;
+
+	sg.notes = song;			// notes are decoded straight into the current song
+	status = load_song (name, directory, &sg);
+	if (status == 0) set_song (&sg);
+	else pack_slot = -1;		// song may have been partly overwritten
+	return status;
+}
 	
 
+// midi import: a midi event read from the file, before conversion to song notes
+typedef struct {
+	uint32_t tick;				// absolute time, in ticks of the midi file
+	uint8_t chan;
+	uint8_t status;				// MIDI_NOTEON or MIDI_NOTEOFF
+	uint8_t key;
+	uint8_t vel;
+} midi_event_t;
+
+// midi import: a tempo change read from the file
+typedef struct {
+	uint32_t tick;				// absolute time, in ticks of the midi file
+	uint32_t tempo;				// microseconds per quarter note
+} midi_tempo_t;
+
+
+// sort midi events by time
+static int compare_midi_events (const void *a, const void *b) {
+
+	const midi_event_t *ea = a, *eb = b;
+
+	if (ea->tick != eb->tick) return (ea->tick < eb->tick) ? -1 : 1;
+	return 0;
+}
+
+
+// sort tempo changes by time
+static int compare_midi_tempos (const void *a, const void *b) {
+
+	const midi_tempo_t *ta = a, *tb = b;
+
+	if (ta->tick != tb->tick) return (ta->tick < tb->tick) ? -1 : 1;
+	return 0;
+}
+
+
+// sort notes the same way as write_to_song () does: by qbar, qtick, then note-on before note-off
+int compare_notes (const void *a, const void *b) {
+
+	const note_t *na = a, *nb = b;
+
+	if (na->qbar != nb->qbar) return (na->qbar < nb->qbar) ? -1 : 1;
+	if (na->qtick != nb->qtick) return (na->qtick < nb->qtick) ? -1 : 1;
+	if (na->status != nb->status) return (na->status > nb->status) ? -1 : 1;
+	if (na->instrument != nb->instrument) return (na->instrument < nb->instrument) ? -1 : 1;
+	return (na->key - nb->key);
+}
+
+
+// read a variable length quantity from midi data; p is moved after the value
+static uint32_t read_varlen (uint8_t **p, uint8_t *end) {
+
+	uint32_t value = 0;
+
+	while (*p < end) {
+		value = (value << 7) | (**p & 0x7F);
+		if ((*((*p)++) & 0x80) == 0) break;
+	}
+	return value;
+}
+
+
+// read a big endian number of len bytes from midi data
+static uint32_t read_bytes (uint8_t *p, int len) {
+
+	uint32_t value = 0;
+
+	while (len--) value = (value << 8) | *p++;
+	return value;
+}
+
+
+// import a standard midi file (type 0 or 1) into the song
+// name is a pad number (0-63) which corresponds to the number of the song, file is XX.mid in directory
+// channel 10 goes to instrument 0 (drums); other channels go to instruments 1-7, most used channels first
+// channels using the same midi instrument are merged when there are more than 7 of them; remaining ones are dropped
+// returns 0 if everything went well, 1 if the file is not a valid midi file, 2 if the file cannot be read
+int load_midi (uint8_t name, char * directory) {
+
+	FILE *fp;
+	char filename [255];
+	struct stat st;
+	uint8_t *data = NULL, *p, *end, *track_end;
+	uint32_t ppqn, nb_tracks, track, len, tick, tempo, last_tick;
+	uint8_t status, type;
+	midi_event_t *events = NULL, *more_events;
+	midi_tempo_t tempos [256];
+	int nb_events, max_events, nb_tempos, t;
+	int program [16], volume [16], nb_notes [16], chan2instr [16];
+	int order [16], nb_instr, i, j, chan;
+	double usec, usec_per_tick, total_usec, song_ticks_per_usec;
+	uint32_t ticks_per_bar, song_tick;
+	int beats_per_bar = 0, beat_type = 0;
+	int result = 1;
+
+	// read the whole file in memory
+	sprintf (filename, "%s/%02X.mid", directory, name);
+	fp = fopen (filename, "rb");
+	if (fp == NULL) {
+		fprintf ( stderr, "Cannot read midi file: %s\n", filename);
+		return 2;
+	}
+	if ((fstat (fileno (fp), &st) != 0) || ((data = malloc (st.st_size)) == NULL) || (fread (data, 1, st.st_size, fp) != st.st_size)) {
+		fprintf ( stderr, "Cannot read midi file: %s\n", filename);
+		fclose (fp);
+		free (data);
+		return 2;
+	}
+	fclose (fp);
+	end = data + st.st_size;
+
+	// header: type 0 or 1, number of tracks, ticks per quarter note (SMPTE timing is not supported)
+	if ((st.st_size < 14) || (memcmp (data, "MThd", 4) != 0)) goto end;
+	type = read_bytes (data + 8, 2);
+	nb_tracks = read_bytes (data + 10, 2);
+	ppqn = read_bytes (data + 12, 2);
+	if ((type > 1) || (ppqn == 0) || (ppqn & 0x8000)) goto end;
+	p = data + 8 + read_bytes (data + 4, 4);
+
+	for (i = 0; i < 16; i++) {
+		program [i] = 0;
+		volume [i] = DEFAULT_VOLUME;
+		nb_notes [i] = 0;
+	}
+	nb_events = 0;
+	max_events = 4096;
+	events = malloc (max_events * sizeof (midi_event_t));
+	if (events == NULL) goto end;
+	nb_tempos = 0;
+
+	// read all the tracks; events of all tracks are merged, and sorted afterwards
+	for (track = 0; (track < nb_tracks) && (p + 8 <= end); track++) {
+		len = read_bytes (p + 4, 4);
+		if (memcmp (p, "MTrk", 4) != 0) {		// unknown chunk: skip it
+			p += 8 + len;
+			track--;
+			continue;
+		}
+		p += 8;
+		track_end = ((p + len) > end) ? end : (p + len);
+		tick = 0;
+		status = 0;
+
+		while (p < track_end) {
+			tick += read_varlen (&p, track_end);
+			if (p >= track_end) break;
+
+			// meta event
+			if (*p == 0xFF) {
+				if (p + 2 > track_end) break;
+				type = p [1];
+				p += 2;
+				len = read_varlen (&p, track_end);
+				if (p + len > track_end) break;
+				if ((type == 0x51) && (len == 3) && (nb_tempos < 256) && (read_bytes (p, 3) != 0)) {		// tempo (0 is invalid: ignored)
+					tempos [nb_tempos].tick = tick;
+					tempos [nb_tempos].tempo = read_bytes (p, 3);
+					nb_tempos++;
+				}
+				// time signature: we keep the first valid one only (numerator > 0, denominator from 1 to 32)
+				if ((type == 0x58) && (len >= 2) && (beats_per_bar == 0) && (p [0] > 0) && (p [1] <= 5)) {
+					beats_per_bar = p [0];
+					beat_type = 1 << p [1];
+				}
+				p += len;
+				status = 0;			// meta events cancel running status
+				continue;
+			}
+
+			// sysex: skip it
+			if ((*p == 0xF0) || (*p == 0xF7)) {
+				p++;
+				len = read_varlen (&p, track_end);
+				p += len;
+				status = 0;
+				continue;
+			}
+
+			// channel event, with or without running status
+			if (*p & 0x80) status = *p++;
+			if (status == 0) goto end;			// data byte without status: file is corrupted
+			chan = status & 0x0F;
+			len = (((status & 0xF0) == MIDI_PC) || ((status & 0xF0) == 0xD0)) ? 1 : 2;
+			if (p + len > track_end) break;
+
+			switch (status & 0xF0) {
+				case MIDI_NOTEON:
+				case MIDI_NOTEOFF:
+					if (nb_events == max_events) {
+						max_events *= 2;
+						more_events = realloc (events, max_events * sizeof (midi_event_t));
+						if (more_events == NULL) goto end;		// events is freed at the end
+						events = more_events;
+					}
+					events [nb_events].tick = tick;
+					events [nb_events].chan = chan;
+					events [nb_events].key = p [0] & 0x7F;
+					events [nb_events].vel = p [1] & 0x7F;
+					// note-on with velocity 0 is a note-off
+					events [nb_events].status = (((status & 0xF0) == MIDI_NOTEON) && (p [1] != 0)) ? MIDI_NOTEON : MIDI_NOTEOFF;
+					if (events [nb_events].status == MIDI_NOTEON) nb_notes [chan]++;
+					nb_events++;
+					break;
+				case MIDI_CC:
+					if (p [0] == 0x07) volume [chan] = p [1] & 0x7F;		// volume
+					break;
+				case MIDI_PC:
+					program [chan] = p [0] & 0x7F;
+					break;
+				default:
+					break;
+			}
+			p += len;
+		}
+		p = track_end;
+	}
+
+	// the bar shall fit in the song (and in the groove tables): other time signatures are replaced by 4/4
+	if (beats_per_bar) {
+		ticks_per_bar = (int) ((time_ticks_per_beat * beats_per_bar * 4.0) / beat_type);
+		if ((ticks_per_bar == 0) || (ticks_per_bar > GROOVE_TICKS)) {
+			fprintf ( stderr, "midi import: time signature %d/%d not supported, 4/4 is used\n", beats_per_bar, beat_type);
+			beats_per_bar = 4;
+			beat_type = 4;
+		}
+	}
+
+	// channel to instrument mapping: drum channel first, then melodic channels sorted by number of notes
+	for (i = 0; i < 16; i++) chan2instr [i] = -1;
+	chan2instr [9] = 0;
+	nb_instr = 0;
+	for (i = 0; i < 16; i++) {
+		if ((i == 9) || (nb_notes [i] == 0)) continue;
+		// insertion sort is fine here: 15 channels at most
+		for (j = nb_instr; (j > 0) && (nb_notes [order [j - 1]] < nb_notes [i]); j--) order [j] = order [j - 1];
+		order [j] = i;
+		nb_instr++;
+	}
+	for (i = 0, j = 1; i < nb_instr; i++) {
+		chan = order [i];
+		if (j < 8) chan2instr [chan] = j++;
+		else {
+			// no instrument left: merge with a channel using the same midi instrument, if any
+			for (t = 0; t < i; t++) {
+				if ((chan2instr [order [t]] != -1) && (program [order [t]] == program [chan])) {
+					chan2instr [chan] = chan2instr [order [t]];
+					break;
+				}
+			}
+			if (chan2instr [chan] == -1) fprintf ( stderr, "midi import: channel %d dropped (%d notes)\n", chan + 1, nb_notes [chan]);
+		}
+	}
+	for (i = 0; i < 16; i++) {
+		if (chan2instr [i] != -1) {
+			instrument_list [chan2instr [i]] = program [i];
+			volume_list [chan2instr [i]] = volume [i];
+		}
+	}
+
+	// song timing: tempo at start of the file, time signature from the file (quarter notes per bar)
+	qsort (tempos, nb_tempos, sizeof (midi_tempo_t), compare_midi_tempos);
+	tempo = ((nb_tempos > 0) && (tempos [0].tick == 0)) ? tempos [0].tempo : 500000;		// default is 120 bpm
+	time_beats_per_minute = 60000000.0 / tempo;
+	time_bpm_multiplier = 1.0;
+	if (beats_per_bar) {
+		time_beats_per_bar = (beats_per_bar * 4.0) / beat_type;
+		time_beat_type = beat_type;
+		timebase_update ();
+	}
+	ticks_per_bar = (int) (time_ticks_per_beat * time_beats_per_bar);
+	if ((ticks_per_bar == 0) || (ticks_per_bar > GROOVE_TICKS)) goto end;
+	song_ticks_per_usec = time_ticks_per_beat / tempo;
+
+	// convert events to notes: midi ticks -> microseconds (following tempo changes) -> song ticks at song tempo
+	qsort (events, nb_events, sizeof (midi_event_t), compare_midi_events);
+	song_length = 0;
+	dirty_segments = PACK_ALL;		// song does not come from a compact file
+	pack_slot = -1;
+	t = 0;
+	last_tick = 0;
+	total_usec = 0.0;
+	usec_per_tick = (double) tempo / ppqn;
+	for (i = 0; i < nb_events; i++) {
+		if (chan2instr [events [i].chan] == -1) continue;
+
+		// apply tempo changes up to this event
+		while ((t < nb_tempos) && (tempos [t].tick <= events [i].tick)) {
+			total_usec += (tempos [t].tick - last_tick) * usec_per_tick;
+			last_tick = tempos [t].tick;
+			usec_per_tick = (double) tempos [t].tempo / ppqn;
+			t++;
+		}
+		usec = total_usec + ((events [i].tick - last_tick) * usec_per_tick);
+		song_tick = (uint32_t) ((usec * song_ticks_per_usec) + 0.5);
+
+		// note-off is moved 1 tick earlier, so it is not mixed up with a note-on starting at the same time (same as quantize_note)
+		if ((events [i].status == MIDI_NOTEOFF) && (song_tick > 0)) song_tick--;
+
+		if (song_tick / ticks_per_bar >= 512) break;		// song is limited to 512 bars (64 bars * 8 pages)
+		if (song_length >= SONG_SIZE) {
+			fprintf ( stderr, "midi import: song is too large, truncated to %d notes\n", SONG_SIZE);
+			break;
+		}
+
+		memset (&song [song_length], 0, sizeof (note_t));
+		tick2note (song_tick, &song [song_length], FALSE);
+		tick2note (song_tick, &song [song_length], TRUE);
+		song [song_length].instrument = chan2instr [events [i].chan];
+		song [song_length].status = events [i].status;
+		song [song_length].key = events [i].key;
+		song [song_length].vel = events [i].vel;
+		song [song_length].color = LO_YELLOW;
+		song_length++;
+	}
+
+	// sort the song the way write_to_song () would have
+	qsort (song, song_length, sizeof (note_t), compare_notes);
+
+	// everything went well
+	result = 0;
+
+end:
+	if (result) fprintf ( stderr, "Invalid midi file: %s\n", filename);
+	free (events);
+	free (data);
+	return result;
+}
+
+
 // function called in case user pressed the save pad
 // name is a pad number (0-63) which corresponds to the number of the song
 // directory is the patch where songs are stored
@@ -222,6 +673,7 @@ int save (uint8_t name, char * directory) {
 	FILE *fp;
 	int i;
 	char filename [255];		// temp structure for file name
+	char tempname [255];		// temp file, renamed to filename once fully written
 	cJSON *json;				// used for CJSON writing
 	cJSON *instruments = NULL;
 	cJSON *volumes = NULL;
@@ -283,17 +735,21 @@ int save (uint8_t name, char * directory) {
 	// create file path
 	sprintf (filename, "%s/%02X.json", directory, name);
 
-	// create file in write mode
-	fp = fopen (filename, "wt");
+	// create temp file in write mode
+	fp = open_temp_file (directory, filename, tempname, "wt");
 	if (fp==NULL) {
 		fprintf ( stderr, "Cannot write save file: %s\n", filename);
 		status = 2;
 		goto end;
 	}
  
-	// write and close file
+	// write file, and replace previous version of the file
 	fputs(json_str, fp); 
-	fclose (fp);
+	if (commit_file (fp, directory, tempname, filename)) {
+		fprintf ( stderr, "Cannot write save file: %s\n", filename);
+		status = 2;
+		goto end;
+	}
 
 	// everything went well
 	status = 0;
@@ -305,104 +761,477 @@ end:
 	return status;
 }
 
+// general midi instrument names, used to name the tracks of the midi export
+static const char *gm_instruments [128] = {
+	"Acoustic Grand Piano", "Bright Acoustic Piano", "Electric Grand Piano", "Honky-tonk Piano",
+	"Electric Piano 1", "Electric Piano 2", "Harpsichord", "Clavinet", "Celesta", "Glockenspiel", "Music Box",
+	"Vibraphone", "Marimba", "Xylophone", "Tubular Bells", "Dulcimer", "Drawbar Organ", "Percussive Organ",
+	"Rock Organ", "Church Organ", "Reed Organ", "Accordion", "Harmonica", "Tango Accordion",
+	"Acoustic Guitar (nylon)", "Acoustic Guitar (steel)", "Electric Guitar (jazz)", "Electric Guitar (clean)",
+	"Electric Guitar (muted)", "Overdriven Guitar", "Distortion Guitar", "Guitar Harmonics", "Acoustic Bass",
+	"Electric Bass (finger)", "Electric Bass (pick)", "Fretless Bass", "Slap Bass 1", "Slap Bass 2",
+	"Synth Bass 1", "Synth Bass 2", "Violin", "Viola", "Cello", "Contrabass", "Tremolo Strings",
+	"Pizzicato Strings", "Orchestral Harp", "Timpani", "String Ensemble 1", "String Ensemble 2",
+	"SynthStrings 1", "SynthStrings 2", "Choir Aahs", "Voice Oohs", "Synth Voice", "Orchestra Hit", "Trumpet",
+	"Trombone", "Tuba", "Muted Trumpet", "French Horn", "Brass Section", "SynthBrass 1", "SynthBrass 2",
+	"Soprano Sax", "Alto Sax", "Tenor Sax", "Baritone Sax", "Oboe", "English Horn", "Bassoon", "Clarinet",
+	"Piccolo", "Flute", "Recorder", "Pan Flute", "Blown Bottle", "Shakuhachi", "Whistle", "Ocarina",
+	"Lead 1 (square)", "Lead 2 (sawtooth)", "Lead 3 (calliope)", "Lead 4 (chiff)", "Lead 5 (charang)",
+	"Lead 6 (voice)", "Lead 7 (fifths)", "Lead 8 (bass + lead)", "Pad 1 (new age)", "Pad 2 (warm)",
+	"Pad 3 (polysynth)", "Pad 4 (choir)", "Pad 5 (bowed)", "Pad 6 (metallic)", "Pad 7 (halo)", "Pad 8 (sweep)",
+	"FX 1 (rain)", "FX 2 (soundtrack)", "FX 3 (crystal)", "FX 4 (atmosphere)", "FX 5 (brightness)",
+	"FX 6 (goblins)", "FX 7 (echoes)", "FX 8 (sci-fi)", "Sitar", "Banjo", "Shamisen", "Koto", "Kalimba",
+	"Bagpipe", "Fiddle", "Shanai", "Tinkle Bell", "Agogo", "Steel Drums", "Woodblock", "Taiko Drum",
+	"Melodic Tom", "Synth Drum", "Reverse Cymbal", "Guitar Fret Noise", "Breath Noise", "Seashore",
+	"Bird Tweet", "Telephone Ring", "Helicopter", "Applause", "Gunshot"
+};
+
+
+// midi export: a track of the midi file, encoded by its own thread
+typedef struct {
+	int instr;					// instrument of the track
+	MidiBuffer buf;				// track data
+	int status;					// 0 if encoding went well
+} midi_track_t;
+
+
+// encode the notes of one instrument into a midi track (track header, name, program, volume, notes)
+static void encode_midi_track (midi_track_t *track) {
+
+	int32_t start;				// position of track in buffer
+	int	chan, vel;
+	int i;
+	uint32_t previous_tick, tick, delta, ticks_per_bar;
+	char name [32];
+
+	// status stays 2 until the whole track is written: a Write* function returning -1 means memory could not be allocated
+	track->status = 2;
+	if (!InitMidiBuffer (&track->buf, 256 + ((song_length / 8) * 4))) return;
+
+	start = WriteTrackHeader (&track->buf);
+	if (start < 0) return;
+	chan = instr2chan (track->instr, MIDI_EXPORT);
+
+	// name the track from its instrument, and set instrument and volume for the channel
+	if (is_drum (track->instr, MIDI_EXPORT)) {
+		if (WriteTrackName ("Drums", &track->buf) < 0) return;
+	}
+	else {
+		snprintf (name, sizeof (name), "%s", gm_instruments [instrument_list [track->instr] & 0x7F]);
+		if (WriteTrackName (name, &track->buf) < 0) return;
+		if (WriteProgramChange (0, chan, instrument_list [track->instr], &track->buf) < 0) return;			// instrument change
+	}
+	if (WriteControlChange (0, chan, 0x07, volume_list [track->instr], &track->buf) < 0) return;		// volume change
+
+	// write notes of the instrument
+	ticks_per_bar = (int) (time_ticks_per_beat * time_beats_per_bar);
+	previous_tick = 0;	// first event happens at timing 0
+	for (i = 0; i < song_length; i++) {
+
+		if (song [i].instrument != track->instr) continue;
+
+		// determine velocity depending on note-on or note-off
+		if (song [i].status == MIDI_NOTEON) vel = song [i].vel;
+		else vel = 0;			// note-off can be defined as note-on with 0 velocity
+
+		// determine delta time between midi event and previous midi event
+		tick = (song [i].qbar * ticks_per_bar) + song [i].qtick;		// number of ticks from BBT (0,0,0); we only read "quantized" values (which can be equal to actual BBT values in some cases
+		if (previous_tick > tick) {
+			fprintf ( stderr, "Error in generating MIDI file : negative delta time\n");		// error message in case delta time is negative
+			tick = previous_tick;															// set delta time to 0 in this case
+		}
+		delta = tick - previous_tick;				// compute delta time between 2 events; in theory, delta should always be > 0 as note events are sorted by time
+		previous_tick = tick;
+
+		// write note
+		if (WriteNote (delta, chan, song [i].key, vel, &track->buf) < 0) return;
+	}
+
+	// write track end, and final track size
+	if (WriteTrackEnd (start, &track->buf) < 0) return;
+	track->status = 0;
+}
+
+
+// thread encoding several tracks; tracks are given as a table ended by a track with instr = -1
+static void * encode_midi_tracks (void *arg) {
+
+	midi_track_t *track;
+
+	for (track = (midi_track_t *) arg; track->instr != -1; track += MIDI_EXPORT_THREADS) encode_midi_track (track);
+	return NULL;
+}
+
+
 // export to midi
+// type 1 midi file: a conductor track (tempo, time signature), then one track per instrument
+// instrument tracks are encoded in parallel, then the whole file is written to disk in a single write
 int save_to_midi (uint8_t name, char * directory) {
 	
 	FILE *out;
 	char filename [255];		// temp structure for file name
-	int32_t trackSize = 0;
-	uint8_t trackByte[4] = {0};
-	int	chan, vel;
-	int i;
-	uint32_t previous_tick, tick, delta;
+	char tempname [255];		// temp file, renamed to filename once fully written
+	MidiBuffer buf;				// midi file in memory
+	int32_t start;				// position of conductor track in buffer
+	midi_track_t tracks [8 + MIDI_EXPORT_THREADS];		// 8 instrument tracks, followed by end markers for each thread
+	pthread_t threads [MIDI_EXPORT_THREADS];
+	int started [MIDI_EXPORT_THREADS];
+	int i, status;
+
+	// encode instrument tracks: thread i encodes tracks i, i + MIDI_EXPORT_THREADS, etc
+	for (i = 0; i < 8 + MIDI_EXPORT_THREADS; i++) tracks [i].instr = (i < 8) ? i : -1;
+	for (i = 0; i < MIDI_EXPORT_THREADS; i++) {
+		started [i] = (pthread_create (&threads [i], NULL, encode_midi_tracks, &tracks [i]) == 0);
+		if (!started [i]) encode_midi_tracks (&tracks [i]);		// no thread available: encode in current thread
+	}
+
+	// meanwhile, encode header and conductor track
+	status = 0;
+	if (InitMidiBuffer (&buf, 256 + (song_length * 4))) {
+		if ((WriteMidiHeader (1, 9, (int) time_ticks_per_beat, &buf) < 0)		// type 1, conductor + 8 instruments, PPQN
+			|| ((start = WriteTrackHeader (&buf)) < 0)
+			|| (WriteTrackName ("compo", &buf) < 0)
+			|| (WriteTimeSignature (0, (int) time_beats_per_bar, (int) time_beat_type, &buf) < 0)
+			|| (WriteTempo (0, (int) time_beats_per_minute, &buf) < 0)
+			|| (WriteTrackEnd (start, &buf) < 0)) status = 2;
+	}
+	else status = 2;
+
+	// wait for instrument tracks, and append them to the file
+	for (i = 0; i < MIDI_EXPORT_THREADS; i++) {
+		if (started [i]) pthread_join (threads [i], NULL);
+	}
+	for (i = 0; i < 8; i++) {
+		if (tracks [i].status) status = 2;
+		else if ((status == 0) && (!PutBytes (&buf, tracks [i].buf.data, tracks [i].buf.len))) status = 2;
+		FreeMidiBuffer (&tracks [i].buf);		// also frees what was allocated before a failure
+	}
+	if (status) {
+		fprintf ( stderr, "Cannot allocate memory for midi file\n");
+		FreeMidiBuffer (&buf);
+		return status;
+	}
 
 	// create file path
 	sprintf (filename, "%s/%02X.mid", directory, name);
 
-	// create file in write mode
-	out = fopen (filename, "wb");
+	// create temp file in write mode
+	out = open_temp_file (directory, filename, tempname, "wb");
 	if (out==NULL) {
 		fprintf ( stderr, "Cannot write midi file: %s\n", filename);
+		FreeMidiBuffer (&buf);
 		return 2;
 	}
 
-	// write header
-	WriteMidiHeader((int) time_ticks_per_beat, out);				// PPQN
-	WriteTrackHeader(out);
-	for(int i=0; i<4; i++) {
-		fwrite(trackByte+i, sizeof(uint8_t), 1, out);		// write dummy track size (all 0) for now
+	// write the whole file at once, and replace previous version of the file; the temp file is removed on failure
+	if (write (fileno (out), buf.data, buf.len) != buf.len) {
+		fclose (out);
+		unlink (tempname);
+		fprintf ( stderr, "Cannot write midi file: %s\n", filename);
+		FreeMidiBuffer (&buf);
+		return 2;
+	}
+	if (commit_file (out, directory, tempname, filename)) {
+		fprintf ( stderr, "Cannot write midi file: %s\n", filename);
+		FreeMidiBuffer (&buf);
+		return 2;
 	}
 
-	trackSize += WriteTrackName(out);
-	// trackSize += WriteSysEx_GS_Reset(out);						// use instruments above 127 (above GM)
-	// trackSize += WriteControlChange(0, 9, 0, 0, out);			// MSB - LSB of instrument
-	// trackSize += WriteControlChange(0, 9, 32, 0, out);
+	FreeMidiBuffer (&buf);
+	return 0;
+}
 
-	// set tempo
-	trackSize += WriteTempo(0, (int) time_beats_per_minute, out);
 
-	//set instruments for each channel
-	for (i = 0; i < 8; i++) {
-		chan = instr2chan (i, MIDI_EXPORT);
-		if (is_drum (i, MIDI_EXPORT) == FALSE) {
-			// non-drum instruments will get program change
-			trackSize += WriteProgramChange(0, chan, instrument_list [i], out);			// instrument change
+// save current song as a compact file (see pack.c); this is much smaller than the json file
+// if the song comes from the compact file of this slot, only the segments changed since are appended to the file;
+// the file is fully written again when it is not the one we know, or when appended data would make it too large
+// returns 0 if ok
+int save_compact (uint8_t name, char * directory) {
+
+	FILE *fp;
+	char filename [255];		// temp structure for file name
+	char tempname [255];		// temp file, renamed to filename once fully written
+	song_cache_t sg;
+	struct stat st;
+	uint8_t *buffer;
+	int len, fd;
+
+	buffer = malloc (PACK_SIZE);
+	if (buffer == NULL) return 1;
+	get_song (&sg);
+
+	// create file path
+	sprintf (filename, "%s/%02X.pak", directory, name);
+
+	// incremental save: append a block with the changed segments
+	// appended blocks shall not exceed twice the size of a full file (8 bytes per note is above the average)
+	if ((pack_slot == name) && (stat (filename, &st) == 0) && (st.st_size == pack_size)) {
+		len = pack_song (&sg, buffer, dirty_segments);
+		if ((pack_size + len <= PACK_SIZE) && (pack_size + len <= 2 * (PACK_HEADER + 8 + (PACK_SEGMENTS * 8) + (song_length * 8)))) {
+			fd = open (filename, O_WRONLY | O_APPEND);
+			if (fd < 0) {
+				fprintf ( stderr, "Cannot write save file: %s\n", filename);
+				free (buffer);
+				return 2;
+			}
+			// a block which is not fully written is ignored when loading, so the file stays valid after a power cut
+			if ((write (fd, buffer, len) != len) || (fdatasync (fd) != 0)) {
+				fprintf ( stderr, "Cannot write save file: %s\n", filename);
+				close (fd);
+				pack_slot = -1;		// file end is unknown: write a full file next time
+				free (buffer);
+				return 2;
+			}
+			close (fd);
+			pack_size += len;
+			dirty_segments = 0;
+			free (buffer);
+			return 0;
 		}
 	}
 
-	//set volumes for each channel
-	for (i = 0; i < 8; i++) {
-		chan = instr2chan (i, MIDI_EXPORT);
-		trackSize += WriteControlChange(0, chan, 0x07, volume_list [i], out);			// instrument change
+	// full save
+	len = pack_song (&sg, buffer, PACK_ALL);
+
+	// create temp file in write mode
+	fp = open_temp_file (directory, filename, tempname, "wb");
+	if (fp == NULL) {
+		fprintf ( stderr, "Cannot write save file: %s\n", filename);
+		free (buffer);
+		return 2;
 	}
 
-	// write notes of the song
-	previous_tick = 0;	// first event happens at timing 0
-	for (i = 0; i < song_length; i++) {
-	
-		// determine velocity depending on note-on or note-off
-		if (song [i].status == MIDI_NOTEON) vel = song [i].vel;
-		else vel = 0;			// note-off can be defined as note-on with 0 velocity
+	// write the whole file at once, and replace previous version of the file; the temp file is removed on failure
+	if (write (fileno (fp), buffer, len) != len) {
+		fclose (fp);
+		unlink (tempname);
+		fprintf ( stderr, "Cannot write save file: %s\n", filename);
+		free (buffer);
+		return 2;
+	}
+	if (commit_file (fp, directory, tempname, filename)) {
+		fprintf ( stderr, "Cannot write save file: %s\n", filename);
+		free (buffer);
+		return 2;
+	}
 
-		// determine channel
-		chan = instr2chan (song [i].instrument, MIDI_EXPORT);
+	pack_slot = name;
+	pack_size = len;
+	dirty_segments = 0;
+	free (buffer);
+	return 0;
+}
 
-		// determine delta time between midi event and previous midi event
-		note2tick (song [i], &tick, TRUE);			// number of ticks from BBT (0,0,0); we only read "quantized" values (which can be equal to actual BBT values in some cases
-		if (previous_tick > tick) {
-			fprintf ( stderr, "Error in generating MIDI file : negative delta time\n");		// error message in case delta time is negative
-			tick = previous_tick;															// set delta time to 0 in this case
-		}
-		delta = tick - previous_tick;				// compute delta time between 2 events; in theory, delta should always be > 0 as note events are sorted by time
-		previous_tick = tick;
 
-		// write note
-		trackSize += WriteNote(delta, chan, song [i].key, vel, out);
+// measure time needed to export a song of nb_notes notes to midi; current song is replaced by a generated song
+// run by "bench.a midi", with a temporary directory (file FF.mid is written there)
+void test_save_to_midi (int nb_notes, char * directory) {
+
+	struct timespec start, end;
+	struct stat st;
+	char filename [255];
+	double elapsed;
+	int i;
+
+	// generate a song: chords of 4 notes on 8 instruments, note-on on the beat, note-off half a beat later
+	if (nb_notes > SONG_SIZE) nb_notes = SONG_SIZE;
+	memset (song, 0, SONG_SIZE * sizeof (note_t));
+	for (i = 0; i < nb_notes; i++) {
+		tick2note ((i / 64) * (int) time_ticks_per_beat + (((i / 32) % 2) * (int) (time_ticks_per_beat / 2)), &song [i], TRUE);
+		song [i].bar = song [i].qbar;
+		song [i].beat = song [i].qbeat;
+		song [i].tick = song [i].qtick;
+		song [i].instrument = (i / 4) % 8;
+		song [i].status = ((i / 32) % 2) ? MIDI_NOTEOFF : MIDI_NOTEON;
+		song [i].key = 48 + (i % 4) * 4;
+		song [i].vel = DEFAULT_VELOCITY;
 	}
+	song_length = nb_notes;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	save_to_midi (0xFF, directory);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+
+	sprintf (filename, "%s/FF.mid", directory);
+	if (stat (filename, &st) != 0) st.st_size = 0;
+	printf ("midi export: %d notes, %ld bytes, %.3f ms, %.0f notes/s\n", nb_notes, (long) st.st_size, elapsed * 1000.0, nb_notes / elapsed);
+	unlink (filename);
+}
 
-	// write track end
-	trackSize += WriteTrackEnd(out);
 
-	// write final track size
-	GetBytes(trackByte, trackSize, 4);
-	fseek(out, 18, SEEK_SET);
-	for(int i=0; i<4; i++) {
-		fwrite(trackByte+i, sizeof(uint8_t), 1, out);
+// for debug use only
+// replace current song by a random song of nb_notes notes (nb_notes / 2 notes on, each followed by its note off)
+// notes are played slightly off the quantized time, as when recorded live
+static void generate_song (int nb_notes, unsigned int seed) {
+
+	int i, qtime, time, length;
+
+	srand (seed);
+	if (nb_notes > SONG_SIZE) nb_notes = SONG_SIZE;
+	memset (song, 0, SONG_SIZE * sizeof (note_t));
+	qtime = 0;
+	for (i = 0; i + 1 < nb_notes; i += 2) {
+		qtime += (rand () % 3) * (int) (time_ticks_per_beat / SIXTEENTH);
+		time = qtime + (rand () % 21) - 10;
+		if (time < 0) time = 0;
+		length = (1 + (rand () % 8)) * (int) (time_ticks_per_beat / EIGHTH);
+		if (qtime + length + 10 >= 512 * (int) (time_ticks_per_beat * time_beats_per_bar)) break;		// song is 512 bars max
+
+		song [i].instrument = rand () % 8;
+		song [i].status = MIDI_NOTEON;
+		song [i].key = 36 + (rand () % 60);
+		song [i].vel = 40 + (rand () % 80);
+		song [i].color = LO_YELLOW;
+		tick2note (qtime, &song [i], TRUE);
+		tick2note (time, &song [i], FALSE);
+
+		memcpy (&song [i + 1], &song [i], sizeof (note_t));
+		song [i + 1].status = MIDI_NOTEOFF;
+		song [i + 1].vel = 0;
+		tick2note (qtime + length - 1, &song [i + 1], TRUE);
+		tick2note (time + length - 1, &song [i + 1], FALSE);
 	}
-	fclose(out);
-	
-	return 0;
+	song_length = i;
+	qsort (song, song_length, sizeof (note_t), compare_notes);
 }
 
 
-// go through the color of bar in the ui, and set the same color to each note of the song
-void get_colors_from_ui () {
+// for debug use only
+// time elapsed since start, in ms
+static double elapsed_ms (struct timespec *start) {
+
+	struct timespec end;
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1000.0) + ((end.tv_nsec - start->tv_nsec) / 1e6);
+}
+
+
+// for debug use only
+// size of a save file of slot 0xFE
+static long test_file_size (char * directory, const char * extension) {
+
+	char filename [255];
+	struct stat st;
+
+	sprintf (filename, "%s/FE.%s", directory, extension);
+	if (stat (filename, &st) != 0) return 0;
+	return st.st_size;
+}
+
+
+// compare size and encode/decode speed of json, midi and compact files, over a corpus of nb_songs generated songs
+// run by "bench.a pak", with a temporary directory
+// songs grow from 500 notes to SONG_SIZE / 2 notes (larger json files do not fit in JSON_SIZE); slot 0xFE is used for the files, and the current song is replaced
+void test_compact (int nb_songs, char * directory) {
+
+	struct timespec start;
+	char filename [255];
+	song_cache_t sg, sg2;
+	note_t *decoded;
+	uint8_t *buffer;
+	note_t note;
+	double t_json [2], t_midi [2], t_pak [2], t_mem [2], t_edit;
+	long s_json, s_midi, s_pak, s_edit;
+	int n, nb_notes, len, ok;
+
+	decoded = malloc (SONG_SIZE * sizeof (note_t));
+	buffer = malloc (PACK_SIZE);
+	if ((decoded == NULL) || (buffer == NULL)) {
+		free (decoded);
+		free (buffer);
+		return;
+	}
+
+	printf ("notes   | json bytes  save ms  load ms | midi bytes  save ms  load ms | pak bytes  save ms  load ms | 1 bar edit: bytes  save ms | pak in memory: enc ms  dec ms | round trip\n");
+	for (n = 0; n < nb_songs; n++) {
+		nb_notes = 500 + (n * ((SONG_SIZE / 2) - 500) / ((nb_songs > 1) ? (nb_songs - 1) : 1));
+		generate_song (nb_notes, n + 1);
+		sg2.notes = decoded;
+
+		// json: encode, then decode (no compact file yet, so json file is the one that is read)
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		save (0xFE, directory);
+		t_json [0] = elapsed_ms (&start);
+		s_json = test_file_size (directory, "json");
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		load_song (0xFE, directory, &sg2);
+		t_json [1] = elapsed_ms (&start);
+		sprintf (filename, "%s/FE.json", directory);
+		unlink (filename);
+
+		// compact: encode, then decode
+		pack_slot = -1;
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		save_compact (0xFE, directory);
+		t_pak [0] = elapsed_ms (&start);
+		s_pak = test_file_size (directory, "pak");
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		ok = (load_song (0xFE, directory, &sg2) == 0);
+		t_pak [1] = elapsed_ms (&start);
+
+		// incremental save: a single note added to a single bar only appends the segment of this bar
+		memcpy (&note, &song [0], sizeof (note_t));
+		note.bar = note.qbar = 100;
+		write_to_song (note);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		save_compact (0xFE, directory);
+		t_edit = elapsed_ms (&start);
+		s_edit = test_file_size (directory, "pak") - s_pak;
+		ok = ok && (load_song (0xFE, directory, &sg2) == 0);
+		sprintf (filename, "%s/FE.pak", directory);
+		unlink (filename);
+
+		// decoded song shall be the same as the song (order of simultaneous notes of different instruments may change)
+		qsort (decoded, sg2.length, sizeof (note_t), compare_notes);
+		ok = ok && (sg2.length == song_length) && (memcmp (decoded, song, song_length * sizeof (note_t)) == 0);
+
+		// compact, in memory only: this is the cost of the encoding itself, without the SD card
+		get_song (&sg);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		len = pack_song (&sg, buffer, PACK_ALL);
+		t_mem [0] = elapsed_ms (&start);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		ok = ok && (unpack_song (buffer, len, &sg2) == len);
+		t_mem [1] = elapsed_ms (&start);
+
+		// midi: encode, then decode (midi import replaces the current song, so this is done last)
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		save_to_midi (0xFE, directory);
+		t_midi [0] = elapsed_ms (&start);
+		s_midi = test_file_size (directory, "mid");
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		load_midi (0xFE, directory);
+		t_midi [1] = elapsed_ms (&start);
+		sprintf (filename, "%s/FE.mid", directory);
+		unlink (filename);
+
+		printf ("%7d | %10ld %8.2f %8.2f | %10ld %8.2f %8.2f | %9ld %8.2f %8.2f | %17ld %8.2f | %21.3f %7.3f | %s\n", nb_notes,
+			s_json, t_json [0], t_json [1], s_midi, t_midi [0], t_midi [1], s_pak, t_pak [0], t_pak [1], s_edit, t_edit, t_mem [0], t_mem [1], ok ? "ok" : "MISMATCH");
+	}
+
+	free (decoded);
+	free (buffer);
+}
+
+
+// set the color of the notes of a part of the song from the ui
+static uint64_t get_colors_part (int part, int from, int to, void *arg) {
 
 	int i;
 
-	for (i = 0; i < song_length; i++) {
+	for (i = from; i < to; i++) {
 		song [i].color = ui_bars [song[i].instrument][(song[i].qbar / 64)][(song[i].qbar % 64)];
 	}
+	return 0;
+}
+
+
+// go through the color of bar in the ui, and set the same color to each note of the song (parts of the song in parallel)
+void get_colors_from_ui () {
+
+	pool_run (get_colors_part, NULL, song_length);
 }
 
 
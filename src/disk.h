@@ -4,9 +4,16 @@
  *
  */
 
-int get_files_in_directory (char *, uint8_t *);
+int load_song (uint8_t, char *, song_cache_t *);
+void get_song (song_cache_t *);
+void set_song (song_cache_t *);
 int load (uint8_t, char *);
+int load_midi (uint8_t, char *);
 int save (uint8_t, char *);
 int save_to_midi (uint8_t, char *);
+int save_compact (uint8_t, char *);
+int compare_notes (const void *, const void *);
+void test_save_to_midi (int, char *);
+void test_compact (int, char *);
 void get_colors_from_ui ();
 void set_colors_to_ui ();
@@ -62,8 +62,12 @@ extern uint8_t ui_select [64];				// buffer to store pads during selection proce
 extern uint8_t ui_select_previous [64];		// buffer to store pads during selection process (previous selection)
 
 // song structure
-extern note_t song [SONG_SIZE];			// assume song will have less than 10000 notes in it
+extern note_t *song;					// current song (SONG_SIZE notes); may be switched to a song of the song cache
 extern int song_length;					// highest index in song []
+extern uint64_t dirty_segments;			// segments of the song (see PACK_SEGMENT) changed since the compact file of pack_slot was written
+extern volatile uint32_t song_changes;	// incremented at each change of the song, so that a copy of the song can be checked
+extern int pack_slot;					// slot of the compact file the song comes from, -1 if none; it is appended to by the next save
+extern int pack_size;					// size of this compact file
 extern note_t copy_buffer [COPY_SIZE];	// copy-paste buffer
 extern int copy_length;					// highest index in copy_buffer []
 extern uint8_t led_copy_buffer [512];	// 64 bytes * 8 pages to store led status of bars of copy buffer
@@ -102,7 +106,8 @@ extern int volume_list [8];
 extern int send_clock_tick;					// determine if midi clock shall be sent or not
 
 // tables for load/save
-extern uint8_t save_files [64];		// each save file is identified as a number; the table contains true or false depending file exists or not
+extern slot_t save_slots [64];		// each save file is identified as a number; the table contains metadata of the files of the slot
+extern volatile int slots_changed;	// set to TRUE when slot index has changed, so the UI can be refreshed
 extern uint8_t file_selected;		// file number selected on the pad
 
 // change of instrument
@@ -0,0 +1,306 @@
+/** @file groove.c
+ *
+ * @brief Grooves: quantization of notes on to a per-bar table of targets (straight grid, swing, triplets, or a template
+ * extracted from a recorded bar). Each target has a strength (how far notes are moved to it, in %). The targets are turned
+ * into 2 lookup tables with one entry per tick of a bar: one for recording (offset to the nearest target), one for playback
+ * (offset of the time warp from the straight grid to the targets), so that a groove can be applied at playback without
+ * changing the song. Tables are built from process (key press, change of quantizer), outside of the note path.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static groove_t groove;							// current groove, and its lookup tables
+static int groove_type = GROOVE_OFF;			// GROOVE_xxx
+static int groove_swing = 0;					// swing of GROOVE_SWING: position of every other step, in % of 2 steps
+static int groove_playing = FALSE;				// TRUE if the groove is applied at playback
+static const int groove_swings [] = {55, 60, 66, 75};	// swings selected by groove_next
+
+static int groove_user_steps = 0;				// user template (0 steps if none): targets in ticks of a bar of groove_user_ticks
+static int groove_user_ticks;
+static int groove_user_target [GROOVE_STEPS];
+
+static note_t groove_notes [SONG_SIZE];			// notes read at playback, in the order they are played
+
+
+// number of ticks per bar of the current song
+static int groove_bar () {
+
+	return ticks_per_bar ();
+}
+
+
+// number of steps per beat of the grid of the current quantizer (sixteenths in free timing)
+static int groove_quantizer () {
+
+	return (quantizer == FREE_TIMING) ? SIXTEENTH : quantizer;
+}
+
+
+// set the steps of the groove: straight grid of nb_steps per bar
+static void groove_grid (int nb_steps) {
+
+	int k;
+
+	if (nb_steps > GROOVE_STEPS) nb_steps = GROOVE_STEPS;
+	groove.nb_steps = nb_steps;
+	for (k = 0; k < nb_steps; k++) {
+		groove.grid [k] = (k * groove.ticks_per_bar) / nb_steps;
+		groove.target [k] = groove.grid [k];
+		groove.strength [k] = GROOVE_STRENGTH;
+	}
+}
+
+
+// compute the lookup tables from the targets; targets shall be increasing
+static void groove_tables () {
+
+	int t, k, nb, tpb;
+	int tgt [GROOVE_STEPS + 1];		// targets moved by their strength, plus the first target of next bar
+	int grid [GROOVE_STEPS + 1];
+	int target [GROOVE_STEPS + 2];	// targets, with the last one of previous bar and the first one of next bar
+
+	nb = groove.nb_steps;
+	tpb = groove.ticks_per_bar;
+	for (k = 0; k < nb; k++) {
+		grid [k] = groove.grid [k];
+		tgt [k] = grid [k] + (((int) groove.target [k] - grid [k]) * groove.strength [k]) / 100;
+		target [k + 1] = groove.target [k];
+	}
+	grid [nb] = tpb;
+	tgt [nb] = tpb + tgt [0];
+	target [0] = (int) groove.target [nb - 1] - tpb;
+	target [nb + 1] = tpb + groove.target [0];
+
+	// record: each tick goes to the nearest target (limits are half-way between targets), moved by the strength of the target
+	for (t = 0, k = 1; t < tpb; t++) {
+		while ((k <= nb) && (2 * t >= target [k] + target [k + 1])) k++;
+		if ((k > 0) && (2 * t < target [k - 1] + target [k])) k--;		// first ticks may be nearer the last target of previous bar
+		groove.record [t] = ((target [k] - t) * groove.strength [(k + nb - 1) % nb]) / 100;
+	}
+
+	// playback: linear time warp between the grid and the targets; it is increasing, so notes are played in the same order
+	groove.play_min = 0;
+	groove.play_max = 0;
+	for (k = 0; k < nb; k++) {
+		for (t = grid [k]; t < grid [k + 1]; t++) {
+			groove.play [t] = tgt [k] + ((t - grid [k]) * (tgt [k + 1] - tgt [k])) / (grid [k + 1] - grid [k]) - t;
+			if (groove.play [t] < groove.play_min) groove.play_min = groove.play [t];
+			if (groove.play [t] > groove.play_max) groove.play_max = groove.play [t];
+		}
+	}
+}
+
+
+// build the groove of the current type, for the current quantizer and bar length
+void groove_build () {
+
+	int k, q;
+
+	groove.ticks_per_bar = groove_bar ();
+	if ((groove_type == GROOVE_OFF) || (groove.ticks_per_bar <= 0) || (groove.ticks_per_bar > GROOVE_TICKS)) {
+		groove.nb_steps = 0;
+		return;
+	}
+
+	q = groove_quantizer ();
+	switch (groove_type) {
+		case GROOVE_SWING:
+			// every other step is delayed, to groove_swing % of the pair of steps
+			groove_grid ((int) time_beats_per_bar * q);
+			for (k = 1; k < groove.nb_steps; k += 2) {
+				groove.target [k] = groove.grid [k - 1] + (2 * (groove.grid [k] - groove.grid [k - 1]) * groove_swing) / 100;
+			}
+			break;
+		case GROOVE_TRIPLET:
+			// 3 steps per beat for quarters and eighths, 6 for sixteenths, 12 for thirty-seconds
+			groove_grid ((int) time_beats_per_bar * ((q < EIGHTH) ? 3 : (q * 3) / 2));
+			break;
+		case GROOVE_USER:
+			// template is scaled to the bar length
+			groove_grid (groove_user_steps);
+			for (k = 0; k < groove.nb_steps; k++) groove.target [k] = (groove_user_target [k] * groove.ticks_per_bar) / groove_user_ticks;
+			break;
+		default:
+			groove_grid ((int) time_beats_per_bar * q);
+			break;
+	}
+	groove_tables ();
+}
+
+
+// select a groove: type is GROOVE_xxx, swing is used by GROOVE_SWING (in %, from 50 to 99)
+void groove_select (int type, int swing) {
+
+	if ((type == GROOVE_USER) && (groove_user_steps == 0)) type = GROOVE_OFF;
+	groove_type = type;
+	groove_swing = (swing < 50) ? 50 : ((swing > 99) ? 99 : swing);
+	groove_build ();
+}
+
+
+// select the next groove: off, straight, swings, triplets, user template (if any), then off again
+void groove_next () {
+
+	int i;
+
+	if (groove_type == GROOVE_SWING) {
+		for (i = 0; (i < sizeof (groove_swings) / sizeof (int)) && (groove_swings [i] <= groove_swing); i++);
+		if (i < sizeof (groove_swings) / sizeof (int)) {
+			groove_select (GROOVE_SWING, groove_swings [i]);
+			return;
+		}
+	}
+	if ((groove_type + 1 == GROOVE_USER) && (groove_user_steps == 0)) groove_select (GROOVE_OFF, 0);
+	else if (groove_type == GROOVE_USER) groove_select (GROOVE_OFF, 0);
+	else groove_select (groove_type + 1, groove_swings [0]);
+}
+
+
+// apply the groove at playback, or stop applying it
+void groove_play (int on) {
+
+	groove_playing = on;
+}
+
+
+// TRUE if the groove is applied at playback
+int groove_is_playing () {
+
+	return groove_playing;
+}
+
+
+// extract a template from bar of instrument instr: for each step of the grid of the current quantizer, the average time
+// of the notes on played nearest to this step (or the step itself if none); the template becomes the current groove
+void groove_extract (int instr, int bar) {
+
+	int64_t sum [GROOVE_STEPS];
+	int count [GROOVE_STEPS];
+	int i, k, nb, tpb, t, low, high;
+	uint32_t tick;
+
+	tpb = groove_bar ();
+	nb = (int) time_beats_per_bar * groove_quantizer ();
+	if ((tpb <= 0) || (tpb > GROOVE_TICKS) || (nb > GROOVE_STEPS)) return;
+
+	memset (sum, 0, sizeof (sum));
+	memset (count, 0, sizeof (count));
+	for (i = 0; i < song_length; i++) {
+		if ((song [i].instrument != instr) || (song [i].status != MIDI_NOTEON) || (song [i].qbar != bar)) continue;
+		note2tick (song [i], &tick, FALSE);
+		t = (int) tick - (bar * tpb);					// raw time may be in previous or next bar
+		k = ((t * nb) + (tpb / 2)) / tpb;
+		if ((k < 0) || (k >= nb)) continue;
+		sum [k] += t;
+		count [k]++;
+	}
+
+	// targets shall be increasing and inside the bar: a target stays between the grid positions of its neighbours
+	for (k = 0; k < nb; k++) {
+		groove_user_target [k] = (k * tpb) / nb;
+		if (count [k] == 0) continue;
+		low = (k == 0) ? 0 : (((k - 1) * tpb) / nb) + 1;
+		if ((k > 0) && (low <= groove_user_target [k - 1])) low = groove_user_target [k - 1] + 1;
+		high = (((k + 1) * tpb) / nb) - 1;
+		t = sum [k] / count [k];
+		groove_user_target [k] = (t < low) ? low : ((t > high) ? high : t);
+	}
+	groove_user_steps = nb;
+	groove_user_ticks = tpb;
+
+	groove_select (GROOVE_USER, groove_swing);
+}
+
+
+// TRUE if notes on are quantized by the groove instead of the quantizer
+int groove_active () {
+
+	return (groove_type != GROOVE_OFF);
+}
+
+
+// quantize the time of a note on (number of ticks from BBT (0,0,0)) with the groove: 1 lookup in the table of the bar
+uint32_t groove_quantize (uint32_t tick) {
+
+	int32_t q;
+
+	// bar length has changed (eg. song loaded): tables are built again
+	if (groove.ticks_per_bar != groove_bar ()) groove_build ();
+	if (groove.nb_steps == 0) return tick;
+
+	q = (int32_t) tick + groove.record [tick % groove.ticks_per_bar];
+	if (q < 0) q = 0;
+	if (q >= 512 * groove.ticks_per_bar) q = (512 * groove.ticks_per_bar) - 1;
+	return q;
+}
+
+
+// time a note quantized at tick (number of ticks from BBT (0,0,0)) is played at, as groove_read plays it: moved by the
+// time warp of the groove when the groove is applied at playback, unchanged otherwise
+uint32_t groove_play_tick (uint32_t tick) {
+
+	int32_t t;
+
+	if ((!groove_playing) || (groove_type == GROOVE_OFF)) return tick;
+	if (groove.ticks_per_bar != groove_bar ()) groove_build ();
+	if (groove.nb_steps == 0) return tick;
+
+	t = (int32_t) tick + groove.play [tick % groove.ticks_per_bar];
+	return (t < 0) ? 0 : t;
+}
+
+
+// read notes from song to be played between bar, tick_limit1 (inclusive) and bar, tick_limit2 (exclusive), as read_from_song
+// when the groove is applied at playback, notes are moved by the time warp of the groove: notes read are the ones whose moved
+// time falls in the window, so the song is read in a wider window; notes are copied, in the order they are played
+note_t * groove_read (u_int16_t b_limit1, u_int16_t t_limit1, u_int16_t b_limit2, u_int16_t t_limit2, int *length) {
+
+	note_t *notes;
+	int32_t start, end, from, to, t;
+	int i, lg, nb, tpb;
+
+	if ((!groove_playing) || (groove_type == GROOVE_OFF)) return read_from_song (b_limit1, t_limit1, b_limit2, t_limit2, length);
+	if (groove.ticks_per_bar != groove_bar ()) groove_build ();
+	tpb = groove.ticks_per_bar;
+	start = (b_limit1 * tpb) + t_limit1;
+	end = (b_limit2 * tpb) + t_limit2;
+	if ((groove.nb_steps == 0) || (end <= start)) return read_from_song (b_limit1, t_limit1, b_limit2, t_limit2, length);
+
+	from = start - groove.play_max;
+	to = end - groove.play_min;
+	if (from < 0) from = 0;
+	if (to > 512 * tpb) to = 512 * tpb;
+	notes = read_from_song (from / tpb, from % tpb, to / tpb, to % tpb, &lg);
+
+	nb = 0;
+	for (i = 0; i < lg; i++) {
+		t = (notes [i].qbar * tpb) + notes [i].qtick + groove.play [notes [i].qtick];
+		if ((t < start) || (t >= end)) continue;
+		memcpy (&groove_notes [nb++], &notes [i], sizeof (note_t));
+		notes [i].played = FALSE;		// the copy carries the mark (see play_notes)
+	}
+	*length = nb;
+	return nb ? groove_notes : NULL;
+}
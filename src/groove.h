@@ -0,0 +1,16 @@
+/** @file groove.h
+ *
+ * @brief This file defines prototypes of functions inside groove.c
+ *
+ */
+
+void groove_build ();
+void groove_select (int, int);
+void groove_next ();
+void groove_play (int);
+int groove_is_playing ();
+void groove_extract (int, int);
+int groove_active ();
+uint32_t groove_quantize (uint32_t);
+uint32_t groove_play_tick (uint32_t);
+note_t * groove_read (u_int16_t, u_int16_t, u_int16_t, u_int16_t, int *);
@@ -0,0 +1,512 @@
+/** @file jackstub.c
+ *
+ * @brief Stub of the JACK API used by compo, built instead of libjack with "make JACK=stub". Ports are buffers in memory
+ * and there is no server: a test harness drives process () cycle by cycle with jackstub_cycle (), injects recorded input
+ * events and reads or captures what process () has written to the output ports.
+ * Once jack_activate () is called (ie. by main), a thread runs the cycles in real time, so compo also runs headless.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+// midi event in a port buffer, or waiting for its cycle
+typedef struct {
+	jack_nframes_t time;		// frame offset in the cycle (port buffer) or absolute frame (pending input)
+	size_t size;
+	jack_midi_data_t data [STUB_EVENT_SIZE];
+	jack_port_t *port;			// destination port (pending input only)
+} stub_event_t;
+
+struct _jack_port {
+	char name [64];
+	unsigned long flags;		// JackPortIsInput or JackPortIsOutput
+	uint32_t count;				// number of events in the buffer
+	stub_event_t events [STUB_EVENTS];
+};
+
+struct _jack_client {
+	char name [64];
+	JackProcessCallback process;
+	void *process_arg;
+	JackXRunCallback xrun;
+	void *xrun_arg;
+	JackShutdownCallback shutdown;
+	void *shutdown_arg;
+	jack_port_t *ports [STUB_PORTS];
+	int nb_ports;
+	jack_nframes_t rate;		// sample rate
+	jack_nframes_t frame;		// frame time at the start of the current cycle
+	jack_nframes_t nframes;		// size of the current cycle
+	float load;					// duration of last cycle, in % of the period
+	FILE *capture;				// output events are written to this file, if not NULL
+	volatile int running;		// TRUE while the clock thread runs the cycles
+	pthread_t thread;
+};
+
+static struct _jack_client stub_client;
+static stub_event_t *stub_pending = NULL;	// input events waiting for their cycle, sorted by frame
+static int stub_first = 0;					// first pending event
+static int stub_last = 0;					// after last pending event
+
+
+/*************/
+/* JACK stub */
+/*************/
+
+jack_client_t * jack_client_open (const char *client_name, jack_options_t options, jack_status_t *status, ...) {
+
+	memset (&stub_client, 0, sizeof (stub_client));
+	strncpy (stub_client.name, client_name, sizeof (stub_client.name) - 1);
+	stub_client.rate = STUB_RATE;
+
+	stub_pending = malloc (STUB_PENDING * sizeof (stub_event_t));
+	if (stub_pending == NULL) {
+		if (status != NULL) *status = JackFailure;
+		return NULL;
+	}
+	stub_first = 0;
+	stub_last = 0;
+
+	if (status != NULL) *status = 0;
+	return &stub_client;
+}
+
+
+int jack_client_close (jack_client_t *client) {
+
+	int i;
+
+	if (client->running) {
+		client->running = FALSE;
+		pthread_join (client->thread, NULL);
+	}
+	for (i = 0; i < client->nb_ports; i++) free (client->ports [i]);
+	client->nb_ports = 0;
+	free (stub_pending);
+	stub_pending = NULL;
+	return 0;
+}
+
+
+char * jack_get_client_name (jack_client_t *client) {
+
+	return client->name;
+}
+
+
+int jack_set_process_callback (jack_client_t *client, JackProcessCallback callback, void *arg) {
+
+	client->process = callback;
+	client->process_arg = arg;
+	return 0;
+}
+
+
+int jack_set_xrun_callback (jack_client_t *client, JackXRunCallback callback, void *arg) {
+
+	client->xrun = callback;
+	client->xrun_arg = arg;
+	return 0;
+}
+
+
+void jack_on_shutdown (jack_client_t *client, JackShutdownCallback callback, void *arg) {
+
+	client->shutdown = callback;
+	client->shutdown_arg = arg;
+}
+
+
+jack_port_t * jack_port_register (jack_client_t *client, const char *port_name, const char *port_type, unsigned long flags, unsigned long buffer_size) {
+
+	jack_port_t *port;
+
+	if (client->nb_ports == STUB_PORTS) return NULL;
+	port = calloc (1, sizeof (jack_port_t));
+	if (port == NULL) return NULL;
+	strncpy (port->name, port_name, sizeof (port->name) - 1);
+	port->flags = flags;
+	client->ports [client->nb_ports++] = port;
+	return port;
+}
+
+
+// there is no other client: connections always succeed
+int jack_connect (jack_client_t *client, const char *source_port, const char *destination_port) {
+
+	return 0;
+}
+
+
+void * jack_port_get_buffer (jack_port_t *port, jack_nframes_t nframes) {
+
+	return port;
+}
+
+
+jack_nframes_t jack_last_frame_time (const jack_client_t *client) {
+
+	return client->frame;
+}
+
+
+jack_nframes_t jack_get_sample_rate (jack_client_t *client) {
+
+	return client->rate;
+}
+
+
+float jack_cpu_load (jack_client_t *client) {
+
+	return client->load;
+}
+
+
+uint32_t jack_midi_get_event_count (void *port_buffer) {
+
+	return ((jack_port_t *) port_buffer)->count;
+}
+
+
+int jack_midi_event_get (jack_midi_event_t *event, void *port_buffer, uint32_t event_index) {
+
+	jack_port_t *port;
+
+	port = port_buffer;
+	if (event_index >= port->count) return ENODATA;
+	event->time = port->events [event_index].time;
+	event->size = port->events [event_index].size;
+	event->buffer = port->events [event_index].data;
+	return 0;
+}
+
+
+void jack_midi_clear_buffer (void *port_buffer) {
+
+	((jack_port_t *) port_buffer)->count = 0;
+}
+
+
+// same checks as JACK: events shall be written in time order, inside the cycle
+int jack_midi_event_write (void *port_buffer, jack_nframes_t time, const jack_midi_data_t *data, size_t data_size) {
+
+	jack_port_t *port;
+
+	port = port_buffer;
+	if (time >= stub_client.nframes) return EINVAL;
+	if ((port->count) && (time < port->events [port->count - 1].time)) return EINVAL;
+	if ((port->count == STUB_EVENTS) || (data_size > STUB_EVENT_SIZE)) return ENOBUFS;
+
+	port->events [port->count].time = time;
+	port->events [port->count].size = data_size;
+	memcpy (port->events [port->count].data, data, data_size);
+	port->count++;
+	return 0;
+}
+
+
+/*************************************/
+/* ringbuffer (same layout as JACK) */
+/*************************************/
+
+jack_ringbuffer_t * jack_ringbuffer_create (size_t sz) {
+
+	jack_ringbuffer_t *rb;
+	size_t size;
+
+	rb = malloc (sizeof (jack_ringbuffer_t));
+	if (rb == NULL) return NULL;
+	for (size = 2; size < sz; size <<= 1);
+	rb->buf = malloc (size);
+	if (rb->buf == NULL) {
+		free (rb);
+		return NULL;
+	}
+	rb->size = size;
+	rb->size_mask = size - 1;
+	rb->write_ptr = 0;
+	rb->read_ptr = 0;
+	rb->mlocked = FALSE;
+	return rb;
+}
+
+
+void jack_ringbuffer_free (jack_ringbuffer_t *rb) {
+
+	free (rb->buf);
+	free (rb);
+}
+
+
+// no realtime constraint without JACK: nothing to lock
+int jack_ringbuffer_mlock (jack_ringbuffer_t *rb) {
+
+	rb->mlocked = TRUE;
+	return 0;
+}
+
+
+size_t jack_ringbuffer_read_space (const jack_ringbuffer_t *rb) {
+
+	return (rb->write_ptr - rb->read_ptr) & rb->size_mask;
+}
+
+
+size_t jack_ringbuffer_write_space (const jack_ringbuffer_t *rb) {
+
+	return (rb->read_ptr - rb->write_ptr - 1) & rb->size_mask;
+}
+
+
+size_t jack_ringbuffer_read (jack_ringbuffer_t *rb, char *dest, size_t cnt) {
+
+	size_t n1;
+
+	if (cnt > jack_ringbuffer_read_space (rb)) cnt = jack_ringbuffer_read_space (rb);
+	__sync_synchronize ();				// read data after write_ptr
+	n1 = rb->size - rb->read_ptr;
+	if (n1 > cnt) n1 = cnt;
+	memcpy (dest, rb->buf + rb->read_ptr, n1);
+	memcpy (dest + n1, rb->buf, cnt - n1);
+	__sync_synchronize ();				// data is read before the space is given back
+	rb->read_ptr = (rb->read_ptr + cnt) & rb->size_mask;
+	return cnt;
+}
+
+
+size_t jack_ringbuffer_write (jack_ringbuffer_t *rb, const char *src, size_t cnt) {
+
+	size_t n1;
+
+	if (cnt > jack_ringbuffer_write_space (rb)) cnt = jack_ringbuffer_write_space (rb);
+	__sync_synchronize ();				// write data after read_ptr
+	n1 = rb->size - rb->write_ptr;
+	if (n1 > cnt) n1 = cnt;
+	memcpy (rb->buf + rb->write_ptr, src, n1);
+	memcpy (rb->buf, src + n1, cnt - n1);
+	__sync_synchronize ();				// data is written before it is made visible
+	rb->write_ptr = (rb->write_ptr + cnt) & rb->size_mask;
+	return cnt;
+}
+
+
+/***************/
+/* stub clock */
+/***************/
+
+// clock thread: run a cycle of STUB_NFRAMES every period, like the JACK server
+static void * stub_loop (void *arg) {
+
+	struct timespec next;
+	uint64_t period;
+
+	period = ((uint64_t) STUB_NFRAMES * 1000000000ULL) / stub_client.rate;
+	clock_gettime (CLOCK_MONOTONIC, &next);
+	while (stub_client.running) {
+		jackstub_cycle (STUB_NFRAMES);
+
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+
+// start the clock thread; a test harness does not call it, and runs the cycles itself
+int jack_activate (jack_client_t *client) {
+
+	client->running = TRUE;
+	if (pthread_create (&client->thread, NULL, stub_loop, NULL) != 0) {
+		client->running = FALSE;
+		return 1;
+	}
+	return 0;
+}
+
+
+/***************************/
+/* test harness interface */
+/***************************/
+
+// write size bytes of data in hex, and end the line: format of capture and replay files
+static void stub_write_bytes (FILE *fp, jack_midi_data_t *data, size_t size) {
+
+	int i;
+
+	for (i = 0; i < size; i++) fprintf (fp, " %02X", data [i]);
+	fprintf (fp, "\n");
+}
+
+
+// run 1 cycle of nframes: fill input ports with the events of the cycle, call process, capture output ports
+// returns the value returned by process
+int jackstub_cycle (jack_nframes_t nframes) {
+
+	jack_port_t *port;
+	stub_event_t *ev;
+	struct timespec start, end;
+	uint64_t duration;
+	int i, j, ret;
+
+	stub_client.nframes = nframes;
+
+	// input ports get the pending events of this cycle (late ones at the beginning of the cycle); output ports are emptied
+	for (i = 0; i < stub_client.nb_ports; i++) stub_client.ports [i]->count = 0;
+	while ((stub_first < stub_last) && (stub_pending [stub_first].time < stub_client.frame + nframes)) {
+		ev = &stub_pending [stub_first++];
+		port = ev->port;
+		if (port->count == STUB_EVENTS) continue;		// dropped, as JACK would do
+		memcpy (&port->events [port->count], ev, sizeof (stub_event_t));
+		port->events [port->count].time = (ev->time > stub_client.frame) ? ev->time - stub_client.frame : 0;
+		port->count++;
+	}
+	if (stub_first == stub_last) {
+		stub_first = 0;
+		stub_last = 0;
+	}
+
+	ret = 0;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	if (stub_client.process != NULL) ret = stub_client.process (nframes, stub_client.process_arg);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	// load, and xrun if the cycle took longer than its period
+	duration = ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+	stub_client.load = (duration * 100.0 * stub_client.rate) / (nframes * 1000000000.0);
+	if ((stub_client.load > 100.0) && (stub_client.xrun != NULL)) stub_client.xrun (stub_client.xrun_arg);
+
+	// capture output ports
+	if (stub_client.capture != NULL) {
+		for (i = 0; i < stub_client.nb_ports; i++) {
+			port = stub_client.ports [i];
+			if (!(port->flags & JackPortIsOutput)) continue;
+			for (j = 0; j < port->count; j++) {
+				fprintf (stub_client.capture, "%u %s", stub_client.frame + port->events [j].time, port->name);
+				stub_write_bytes (stub_client.capture, port->events [j].data, port->events [j].size);
+			}
+		}
+	}
+
+	stub_client.frame += nframes;
+	return ret;
+}
+
+
+// returns the port registered with name (eg. "midi_KBD_in"), NULL if there is none
+jack_port_t * jackstub_port (char * name) {
+
+	int i;
+
+	for (i = 0; i < stub_client.nb_ports; i++) {
+		if (strcmp (stub_client.ports [i]->name, name) == 0) return stub_client.ports [i];
+	}
+	return NULL;
+}
+
+
+// frame time of the next cycle
+jack_nframes_t jackstub_frame () {
+
+	return stub_client.frame;
+}
+
+
+// set the sample rate; to be called before the first cycle
+void jackstub_rate (jack_nframes_t rate) {
+
+	stub_client.rate = rate;
+}
+
+
+// queue an input event for port at absolute frame time; it is given to process in the cycle containing frame
+// returns FALSE if the queue is full or the event too long
+int jackstub_send (jack_port_t *port, jack_nframes_t frame, jack_midi_data_t *data, size_t size) {
+
+	int i;
+
+	if ((port == NULL) || (size > STUB_EVENT_SIZE)) return FALSE;
+
+	// make room at the end of the queue
+	if (stub_last == STUB_PENDING) {
+		if (stub_first == 0) return FALSE;
+		memmove (stub_pending, stub_pending + stub_first, (stub_last - stub_first) * sizeof (stub_event_t));
+		stub_last -= stub_first;
+		stub_first = 0;
+	}
+
+	// keep the queue sorted by frame (events are usually sent in order): insert after the events of the same frame
+	for (i = stub_last; (i > stub_first) && (stub_pending [i - 1].time > frame); i--);
+	memmove (stub_pending + i + 1, stub_pending + i, (stub_last - i) * sizeof (stub_event_t));
+	stub_last++;
+
+	stub_pending [i].time = frame;
+	stub_pending [i].size = size;
+	stub_pending [i].port = port;
+	memcpy (stub_pending [i].data, data, size);
+	return TRUE;
+}
+
+
+// write the events of the output ports to fp after each cycle, one per line: "frame port byte byte ..." (bytes in hex)
+// fp NULL stops capture
+void jackstub_capture (FILE *fp) {
+
+	stub_client.capture = fp;
+}
+
+
+// queue the input events recorded in fp, in the capture format; lines starting with # are comments
+// returns the number of events queued, -1 if a line cannot be read
+int jackstub_replay (FILE *fp) {
+
+	char line [256], name [64];
+	jack_midi_data_t data [STUB_EVENT_SIZE];
+	unsigned int frame;
+	char *p, *end;
+	int nb, size, offset;
+
+	nb = 0;
+	while (fgets (line, sizeof (line), fp) != NULL) {
+		if ((line [0] == '#') || (line [0] == '\n')) continue;
+		if (sscanf (line, "%u %63s%n", &frame, name, &offset) != 2) return -1;
+
+		// bytes
+		size = 0;
+		p = line + offset;
+		while (size < STUB_EVENT_SIZE) {
+			data [size] = strtoul (p, &end, 16);
+			if (end == p) break;
+			p = end;
+			size++;
+		}
+		if ((size == 0) || (!jackstub_send (jackstub_port (name), frame, data, size))) return -1;
+		nb++;
+	}
+	return nb;
+}
@@ -0,0 +1,13 @@
+/** @file jackstub.h
+ *
+ * @brief This file defines prototypes of functions inside jackstub.c
+ *
+ */
+
+int jackstub_cycle (jack_nframes_t);
+jack_port_t * jackstub_port (char *);
+jack_nframes_t jackstub_frame ();
+void jackstub_rate (jack_nframes_t);
+int jackstub_send (jack_port_t *, jack_nframes_t, jack_midi_data_t *, size_t);
+void jackstub_capture (FILE *);
+int jackstub_replay (FILE *);
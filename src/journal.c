@@ -0,0 +1,373 @@
+/** @file journal.c
+ *
+ * @brief Append-only journal of song changes. The realtime thread pushes records to a lock-free ringbuffer,
+ * a non-realtime thread writes them to disk. After a crash, the journal is replayed at startup.
+ * Records are numbered; a save reads the song after record n, and the journal restarts from the saved song with the records
+ * after n only, so that notes recorded while saving are kept. The reset goes through the ringbuffer, as any other record.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static jack_ringbuffer_t *journal_rb = NULL;	// records waiting to be written; single producer (process) and single consumer (journal thread)
+static int journal_fd = -1;						// journal file
+static char journal_name [255];					// and its name
+static pthread_t journal_thread;
+static volatile int journal_running = FALSE;
+static volatile uint32_t journal_seq = 0;		// number of records pushed (process only)
+static volatile int journal_reset_slot = -1;	// set by journal_reset (), pushed by process; -1 if nothing to do
+static volatile uint32_t journal_reset_seq;		// last record of the song the journal restarts from
+static int journal_count = 0;					// records written to the file since the last reset (journal thread only)
+
+
+// push a record to the journal ringbuffer; called from the realtime thread, never blocks
+// if the ringbuffer is full, record is lost (it will be in the next save anyway)
+static void journal_push (uint8_t type, uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, note_t *note) {
+
+	journal_t rec;
+
+	if (journal_rb == NULL) return;			// journal is not running (eg. during recovery)
+	if (jack_ringbuffer_write_space (journal_rb) < sizeof (journal_t)) return;
+
+	memset (&rec, 0, sizeof (journal_t));
+	rec.type = type;
+	rec.arg [0] = a0;
+	rec.arg [1] = a1;
+	rec.arg [2] = a2;
+	rec.arg [3] = a3;
+	rec.arg [4] = a4;
+	if (note != NULL) memcpy (&rec.note, note, sizeof (note_t));
+	rec.seq = journal_seq + 1;
+
+	jack_ringbuffer_write (journal_rb, (char *) &rec, sizeof (journal_t));
+	journal_seq++;
+}
+
+
+// journal a note written to the song
+void journal_note (note_t *note) {
+
+	journal_push (JOURNAL_NOTE, 0, 0, 0, 0, 0, note);
+}
+
+
+// journal a bar operation (copy, cut, paste, etc), with the selection it applies to
+void journal_edit (int mode) {
+
+	journal_push (JOURNAL_EDIT, mode, ui_limit1, ui_limit2, ui_current_page, ui_current_instrument, NULL);
+}
+
+
+// journal a transposition of an instrument
+void journal_transpo (int instr, int mode) {
+
+	journal_push (JOURNAL_TRANSPO, instr, mode, 0, 0, 0, NULL);
+}
+
+
+// journal a change of volume for an instrument
+void journal_volume (int instr, int vol) {
+
+	journal_push (JOURNAL_VOLUME, instr, vol, 0, 0, 0, NULL);
+}
+
+
+// journal a change of midi instrument for an instrument
+void journal_program (int instr, int prog) {
+
+	journal_push (JOURNAL_PROGRAM, instr, prog, 0, 0, 0, NULL);
+}
+
+
+// journal a requantization of an instrument
+void journal_requant (int instr, int quant_on, int quant_off) {
+
+	journal_push (JOURNAL_REQUANT, instr, quant_on, quant_off, 0, 0, NULL);
+}
+
+
+// number of the last record pushed: a song read (eg. saved) now contains the changes up to this record
+// called from the main loop, before reading the song
+uint32_t journal_position () {
+
+	__sync_synchronize ();			// the song is read after the position
+	return journal_seq;
+}
+
+
+// song has been loaded from or saved to a save slot: this is the new starting point of the journal
+// slot is 0xFF for an empty song; seq is the journal_position () of the song in the slot (records after it are kept)
+// called from the main loop; the record is pushed by process, then the journal thread starts a new journal file
+// note: copy buffer is not journaled; a paste replayed after a reset uses the copy buffer built from the replayed records only
+void journal_reset (uint8_t slot, uint32_t seq) {
+
+	journal_reset_seq = seq;
+	__sync_synchronize ();			// seq is visible before the request
+	journal_reset_slot = slot;
+}
+
+
+// TRUE if process shall push a reset record (see journal_reset)
+int journal_reset_pending () {
+
+	return (journal_reset_slot != -1);
+}
+
+
+// push the reset record requested by journal_reset; called from the realtime thread, at the start of the cycle
+void journal_reset_push () {
+
+	journal_t rec;
+
+	if (journal_rb == NULL) return;			// journal is not running yet: request is kept
+	if (jack_ringbuffer_write_space (journal_rb) < sizeof (journal_t)) return;		// ringbuffer is full: next cycle
+
+	memset (&rec, 0, sizeof (journal_t));
+	rec.type = JOURNAL_RESET;
+	rec.arg [0] = journal_reset_slot;
+	__sync_synchronize ();
+	rec.seq = journal_reset_seq;
+	jack_ringbuffer_write (journal_rb, (char *) &rec, sizeof (journal_t));
+	journal_reset_slot = -1;
+}
+
+
+// write records to the journal file, and make sure they are on disk
+static void journal_write (journal_t *rec, int nb) {
+
+	if (journal_fd < 0) return;				// journal could not be opened again after a reset
+	if ((write (journal_fd, rec, nb * sizeof (journal_t)) != (nb * sizeof (journal_t))) || (fdatasync (journal_fd) != 0)) {
+		fprintf ( stderr, "Cannot write to journal\n" );
+		return;
+	}
+	journal_count += nb;
+}
+
+
+// start a new journal file from reset record rec: the records already written after the song of the reset are kept
+// the new file replaces the journal once on disk; if it cannot be written, the journal goes on (it still leads to the song)
+static void journal_restart (journal_t *rec) {
+
+	char tempname [sizeof (journal_name) + 4];		// journal name and ".tmp"
+	journal_t *tail;
+	journal_t last;
+	off_t size;
+	int nb, fd, ok;
+
+	// records at the end of the file which come after the song of the reset
+	size = lseek (journal_fd, 0, SEEK_END);
+	for (nb = 0; nb < journal_count; nb++) {
+		if (pread (journal_fd, &last, sizeof (journal_t), size - ((nb + 1) * sizeof (journal_t))) != sizeof (journal_t)) break;
+		if ((int32_t) (last.seq - rec->seq) <= 0) break;
+	}
+	tail = malloc ((nb + 1) * sizeof (journal_t));
+	if (tail == NULL) {
+		fprintf ( stderr, "Cannot reset journal\n" );
+		return;
+	}
+	memcpy (&tail [0], rec, sizeof (journal_t));
+	ok = (pread (journal_fd, &tail [1], nb * sizeof (journal_t), size - (nb * sizeof (journal_t))) == nb * sizeof (journal_t));
+
+	// write the new journal, then replace the current one
+	sprintf (tempname, "%s.tmp", journal_name);
+	fd = ok ? open (tempname, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	if (fd >= 0) {
+		ok = (write (fd, tail, (nb + 1) * sizeof (journal_t)) == (nb + 1) * sizeof (journal_t)) && (fdatasync (fd) == 0);
+		close (fd);
+		if (ok) ok = (rename (tempname, journal_name) == 0);
+		if (!ok) unlink (tempname);
+	}
+	else ok = FALSE;
+	free (tail);
+
+	if (!ok) {
+		fprintf ( stderr, "Cannot reset journal\n" );
+		return;
+	}
+	close (journal_fd);
+	journal_fd = open (journal_name, O_RDWR | O_APPEND);
+	if (journal_fd < 0) fprintf ( stderr, "Cannot open journal: %s\n", journal_name);
+	journal_count = nb;
+}
+
+
+// journal thread: drain the ringbuffer to the journal file
+static void * journal_loop (void *arg) {
+
+	journal_t rec [64];
+	int nb, i, start;
+
+	while (journal_running) {
+
+		// write all pending records; a reset record starts a new journal at its position
+		while ((nb = jack_ringbuffer_read_space (journal_rb) / sizeof (journal_t)) > 0) {
+			if (nb > 64) nb = 64;
+			jack_ringbuffer_read (journal_rb, (char *) rec, nb * sizeof (journal_t));
+			for (start = 0, i = 0; i < nb; i++) {
+				if (rec [i].type != JOURNAL_RESET) continue;
+				if (i > start) journal_write (&rec [start], i - start);
+				if (journal_fd >= 0) journal_restart (&rec [i]);
+				start = i + 1;
+			}
+			if (nb > start) journal_write (&rec [start], nb - start);
+		}
+
+		usleep (10000);		// 10 ms
+	}
+
+	return NULL;
+}
+
+
+// open journal file and start journal thread
+// if keep is FALSE, the journal is restarted from an empty song; otherwise new records are appended to the existing journal
+int journal_open (char * directory, int keep) {
+
+	sprintf (journal_name, "%s/%s", directory, JOURNAL_FILE);
+	journal_fd = open (journal_name, O_RDWR | O_CREAT | O_APPEND, 0644);		// records are read back by journal_restart
+	if (journal_fd < 0) {
+		fprintf ( stderr, "Cannot open journal: %s\n", journal_name);
+		return FALSE;
+	}
+	journal_count = 0;			// records of a previous session are not numbered as the ones of this session
+
+	journal_rb = jack_ringbuffer_create (JOURNAL_ELT * sizeof (journal_t));
+	if (journal_rb == NULL) {
+		close (journal_fd);
+		journal_fd = -1;
+		return FALSE;
+	}
+	jack_ringbuffer_mlock (journal_rb);
+
+	if (!keep) journal_reset (0xFF, journal_position ());
+
+	journal_running = TRUE;
+	if (pthread_create (&journal_thread, NULL, journal_loop, NULL) != 0) {
+		fprintf ( stderr, "Cannot start journal thread\n" );
+		journal_running = FALSE;
+		jack_ringbuffer_free (journal_rb);
+		journal_rb = NULL;
+		close (journal_fd);
+		journal_fd = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+// stop journal thread, write remaining records and close journal file
+void journal_close () {
+
+	if (!journal_running) return;
+
+	journal_running = FALSE;
+	pthread_join (journal_thread, NULL);
+	jack_ringbuffer_free (journal_rb);
+	journal_rb = NULL;
+	if (journal_fd >= 0) close (journal_fd);
+	journal_fd = -1;
+}
+
+
+// replay the journal found in directory, to recover the song as it was before a crash
+// must be called before journal_open (), once globals are initialized
+// returns the number of records replayed, a save slot loaded counting as 1 (0 if there was nothing to recover: empty song)
+int journal_recover (char * directory) {
+
+	FILE *fp;
+	char filename [255];
+	journal_t rec;
+	int nb, status;
+	int limit1, limit2, page, instr;		// to restore UI state after replay
+
+	sprintf (filename, "%s/%s", directory, JOURNAL_FILE);
+	fp = fopen (filename, "rb");
+	if (fp == NULL) return 0;
+
+	// save UI state, as replaying edits moves selection
+	limit1 = ui_limit1;
+	limit2 = ui_limit2;
+	page = ui_current_page;
+	instr = ui_current_instrument;
+
+	nb = 0;
+	// a partially written record at the end of the file is dropped by fread
+	while (fread (&rec, sizeof (journal_t), 1, fp) == 1) {
+		switch (rec.type) {
+			case JOURNAL_RESET:
+				// starting point of the journal: load corresponding save slot (if any)
+				if (rec.arg [0] != 0xFF) {
+					status = load (rec.arg [0], directory);
+					if (status == 2) status = load_midi (rec.arg [0], directory);	// slot may come from an imported midi file
+					if (status) set_defaults ();
+					else nb++;					// song of the slot is recovered, even if no change follows
+					note2bar_color ();			// set colors to bars
+				}
+				break;
+			case JOURNAL_NOTE:
+				write_to_song (rec.note);
+				if (ui_bars [rec.note.instrument][rec.note.qbar / 64][rec.note.qbar % 64] == BLACK) {
+					ui_bars [rec.note.instrument][rec.note.qbar / 64][rec.note.qbar % 64] = LO_YELLOW;
+				}
+				nb++;
+				break;
+			case JOURNAL_EDIT:
+				ui_limit1 = rec.arg [1];
+				ui_limit2 = rec.arg [2];
+				ui_current_page = rec.arg [3];
+				ui_current_instrument = rec.arg [4];
+				bar_process (rec.arg [0]);
+				nb++;
+				break;
+			case JOURNAL_TRANSPO:
+				transpo_song (rec.arg [0], rec.arg [1]);
+				nb++;
+				break;
+			case JOURNAL_VOLUME:
+				volume_list [rec.arg [0]] = rec.arg [1];
+				nb++;
+				break;
+			case JOURNAL_PROGRAM:
+				instrument_list [rec.arg [0]] = rec.arg [1];
+				nb++;
+				break;
+			case JOURNAL_REQUANT:
+				requant_song (rec.arg [0], rec.arg [1], rec.arg [2]);
+				nb++;
+				break;
+			default:
+				break;
+		}
+	}
+	fclose (fp);
+
+	// restore UI state
+	ui_limit1 = limit1;
+	ui_limit2 = limit2;
+	ui_current_page = page;
+	ui_current_instrument = instr;
+
+	return nb;
+}
@@ -0,0 +1,19 @@
+/** @file journal.h
+ *
+ * @brief This file defines prototypes of functions inside journal.c
+ *
+ */
+
+void journal_note (note_t *);
+void journal_edit (int);
+void journal_transpo (int, int);
+void journal_volume (int, int);
+void journal_program (int, int);
+void journal_requant (int, int, int);
+uint32_t journal_position ();
+void journal_reset (uint8_t, uint32_t);
+int journal_reset_pending ();
+void journal_reset_push ();
+int journal_open (char *, int);
+void journal_close ();
+int journal_recover (char *);
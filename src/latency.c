@@ -0,0 +1,160 @@
+/** @file latency.c
+ *
+ * @brief Calibration of the round-trip latency (midi out -> synth/keyboard -> midi KBD in). Probes are sent on midi_out by
+ * process, and their arrival on midi_KBD_in is timed (midi out has to be looped back to KBD in during calibration).
+ * The median latency is saved in the save directory, and subtracted from the time of the notes recorded from the keyboard.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static volatile int latency_frames = 0;			// record offset, in frames
+static volatile int latency_state = LATENCY_IDLE;
+static int latency_probe;						// number of the probe being sent, and of the probes received
+static jack_nframes_t latency_sent;				// frame time at which the probe has been sent
+static int latency_measures [LATENCY_PROBES];	// latency of each probe, in frames
+static char latency_filename [255];				// per-setup latency file
+
+
+// record offset, in frames: notes recorded from the keyboard are moved back by this offset
+int latency_offset () {
+
+	return latency_frames;
+}
+
+
+// start a calibration; the result is used once all probes have come back
+void latency_start () {
+
+	__sync_bool_compare_and_swap (&latency_state, LATENCY_IDLE, LATENCY_SEND);
+}
+
+
+// called from process once per cycle, at frame time frame, before music output: send the next probe, or give up if it has not come back
+void latency_cycle (jack_nframes_t frame) {
+
+	uint8_t buffer [3];
+
+	switch (latency_state) {
+		case LATENCY_SEND:
+			buffer [0] = MIDI_CC | LATENCY_CHANNEL;
+			buffer [1] = LATENCY_CC;
+			buffer [2] = latency_probe;
+			push_to_list (OUT, buffer);			// music output is written at the start of the cycle
+			latency_sent = frame;
+			latency_state = LATENCY_WAIT;
+			break;
+		case LATENCY_WAIT:
+			if (frame - latency_sent > jack_get_sample_rate (client) * LATENCY_TIMEOUT) {
+				latency_state = LATENCY_FAILED;
+				pool_post ();
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+// called from process for each midi in (KBD) event, received at frame time frame
+// returns TRUE if the event is a probe, which shall not be processed any further
+int latency_event (jack_midi_event_t *event, jack_nframes_t frame) {
+
+	if ((event->size < 3) || (event->buffer [0] != (MIDI_CC | LATENCY_CHANNEL)) || (event->buffer [1] != LATENCY_CC)) return FALSE;
+
+	// probes coming back late (eg. after a timeout) are dropped
+	if ((latency_state == LATENCY_WAIT) && (event->buffer [2] == latency_probe)) {
+		latency_measures [latency_probe] = frame - latency_sent;
+		latency_probe++;
+		latency_state = (latency_probe < LATENCY_PROBES) ? LATENCY_SEND : LATENCY_DONE;
+		if (latency_state == LATENCY_DONE) pool_post ();
+	}
+	return TRUE;
+}
+
+
+static int compare_measures (const void *a, const void *b) {
+
+	return *(int *) a - *(int *) b;
+}
+
+
+// read the record offset of this setup
+static void latency_load () {
+
+	FILE *fp;
+	unsigned int frames, rate;
+
+	fp = fopen (latency_filename, "rt");
+	if (fp == NULL) return;
+	// latency has been measured at a given sample rate: convert it to the current one
+	if ((fscanf (fp, "%u %u", &frames, &rate) == 2) && (rate != 0)) {
+		latency_frames = ((uint64_t) frames * jack_get_sample_rate (client)) / rate;
+	}
+	fclose (fp);
+}
+
+
+// save the record offset of this setup
+static void latency_save () {
+
+	FILE *fp;
+
+	fp = fopen (latency_filename, "wt");
+	if (fp == NULL) {
+		fprintf ( stderr, "Cannot save latency\n" );
+		return;
+	}
+	fprintf (fp, "%d %u\n", latency_frames, jack_get_sample_rate (client));
+	fclose (fp);
+}
+
+
+// once all probes have come back, use the median latency as record offset; called from the background thread (see pool.c)
+void latency_work () {
+
+	if (latency_state == LATENCY_DONE) {
+		qsort (latency_measures, LATENCY_PROBES, sizeof (int), compare_measures);
+		latency_frames = latency_measures [LATENCY_PROBES / 2];
+		latency_save ();
+		fprintf ( stderr, "latency: %d frames (%.1f ms), from %d to %d\r\n", latency_frames, latency_frames * 1000.0 / jack_get_sample_rate (client),
+			latency_measures [0], latency_measures [LATENCY_PROBES - 1]);
+		latency_probe = 0;
+		latency_state = LATENCY_IDLE;
+	}
+	else if (latency_state == LATENCY_FAILED) {
+		fprintf ( stderr, "latency: probe %d has not come back; midi_out shall be connected to midi_KBD_in\r\n", latency_probe);
+		latency_probe = 0;
+		latency_state = LATENCY_IDLE;
+	}
+}
+
+
+// read the record offset saved in directory; results of calibrations are handled by the background thread (see pool.c)
+int latency_open (char * directory) {
+
+	sprintf (latency_filename, "%s/%s", directory, LATENCY_FILE);
+	latency_load ();
+	return TRUE;
+}
@@ -0,0 +1,12 @@
+/** @file latency.h
+ *
+ * @brief This file defines prototypes of functions inside latency.c
+ *
+ */
+
+int latency_offset ();
+void latency_start ();
+void latency_cycle (jack_nframes_t);
+int latency_event (jack_midi_event_t *, jack_nframes_t);
+void latency_work ();
+int latency_open (char *);
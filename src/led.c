@@ -1,6 +1,13 @@
 /** @file led.c
  *
  * @brief led module allows switching LEDs on/off on the midi control surface.
+ * Pads are not written straight to the control surface: led functions set the color wanted for each pad (frame), and
+ * led_flush, called by process once per cycle, only sends the pads whose color differs from the one last sent (shadow).
+ * A pad set several times during a cycle is sent once, with its last color.
+ * On the Launchpad, pads are written to the hidden buffer and shown at once by a flip of buffers; large redraws use the rapid
+ * LED update, which sends 2 pads per message.
+ * The number of messages per cycle is limited (LED_BUDGET), so that a large redraw is spread over several cycles instead
+ * of holding the UI output of a single cycle; the cursor goes first, then the bars of the current page.
  *
  */
 
@@ -12,6 +19,197 @@
 #include "song.h"
 #include "disk.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static uint8_t led_frame [LED_PADS];			// color wanted for each pad (see LED_PAD_xxx)
+static uint8_t led_shadow [LED_PADS];			// color last sent to each pad, LED_UNKNOWN if none
+static volatile uint8_t led_dirty [LED_PADS];	// TRUE if the pad has been set since last flush
+static uint8_t led_next [LED_PADS];				// color to be sent, for pads waiting to be sent (owned by process)
+static uint8_t led_pending [LED_PADS];			// TRUE if the pad is waiting to be sent
+static int led_init = FALSE;
+static int led_mode = LED_OUTPUT;				// LED_OUTPUT_xxx
+static int led_displayed = -1;					// buffer displayed by the Launchpad, -1 if double buffering is not set up
+static int led_flip = FALSE;					// TRUE if the hidden buffer has been written since last flip
+static int led_sweep = -1;						// next pad of the rapid LED update in progress, -1 if none
+static int led_budget = LED_BUDGET;				// max number of messages per cycle, 0 if no limit
+
+
+// set the color of a pad; it is sent by next led_flush, if the pad has not got this color already
+// led functions are called by process and by the main loop; led_flush is called by process only
+static void led_set (int pad, uint8_t color) {
+
+	led_frame [pad] = color;
+	__sync_synchronize ();
+	led_dirty [pad] = TRUE;
+}
+
+
+// send the color of a single pad
+static void led_send (int pad, uint8_t color) {
+
+	uint8_t buffer [4];
+
+	// grid pads and scene pads (pages) are notes, top pads (instruments) are controllers
+	if (pad < LED_PAD_PAGES) {
+		buffer [0] = MIDI_NOTEON;
+		buffer [1] = bar2midi (pad);
+	}
+	else if (pad < LED_PAD_INSTRUMENTS) {
+		buffer [0] = MIDI_NOTEON;
+		buffer [1] = ((pad - LED_PAD_PAGES) << 4) + 0x08;
+	}
+	else {
+		buffer [0] = MIDI_CC;
+		buffer [1] = (pad - LED_PAD_INSTRUMENTS) + 0x68;
+	}
+	buffer [2] = color;
+	push_to_list (UI, buffer);			// put in midisend buffer
+}
+
+
+// display buffer displayed of the Launchpad, and update the other one, which gets a copy of the displayed one
+static void led_buffers (int displayed) {
+
+	uint8_t buffer [4];
+
+	buffer [0] = MIDI_CC;
+	buffer [1] = LED_BUFFER_CC;
+	buffer [2] = 0x20 + 0x10 + ((1 - displayed) << 2) + displayed;
+	push_to_list (UI, buffer);
+	led_displayed = displayed;
+}
+
+
+// priority of a pad: 0 for the cursor (selected bars), 1 for the other bars and the page pad of the current page, 2 for the rest
+static int led_priority (int pad) {
+
+	if (pad < LED_PAD_PAGES) return (ui_select [pad] != BLACK) ? 0 : 1;
+	if (pad == LED_PAD_PAGES + ui_current_page) return 1;
+	return 2;
+}
+
+
+// color of a pad to be sent; the pad is then considered as sent
+static uint8_t led_take (int pad) {
+
+	if (led_pending [pad]) led_shadow [pad] = led_next [pad];
+	else if (led_shadow [pad] == LED_UNKNOWN) led_shadow [pad] = BLACK;
+	led_pending [pad] = FALSE;
+	return led_shadow [pad];
+}
+
+
+// select the led output (LED_OUTPUT_xxx); double buffering is set up again by next flush
+void led_output (int mode) {
+
+	led_mode = mode;
+	led_displayed = -1;
+	led_flip = FALSE;
+	led_sweep = -1;
+}
+
+
+// set the max number of led messages sent per cycle (0: no limit, else 2 at least, for a pad and a flip of buffers)
+void led_pace (int budget) {
+
+	led_budget = ((budget > 0) && (budget < 2)) ? 2 : budget;
+}
+
+
+// send the pads whose color has changed since last flush; called by process once per cycle, before the UI output
+// at most led_budget messages are sent per cycle, by priority (see led_priority): pads left are sent by the next cycles
+// with LED_OUTPUT_LAUNCHPAD, pads are written to the buffer which is not displayed, without the copy and clear flags, then
+// buffers are flipped once no pad is left, so that a redraw appears at once; when more than half of the pads have changed,
+// all the pads are sent by rapid LED update (2 pads per message, in pad order), which goes on over the next cycles if needed;
+// no other message is sent until it is over, as any other message returns the rapid update to the first pad
+// returns the number of midi messages sent
+int led_flush () {
+
+	uint8_t buffer [4];
+	int pad, count, nb, max, priority;
+
+	if (!led_init) {
+		memset (led_shadow, LED_UNKNOWN, LED_PADS);		// state of the control surface is not known at startup
+		led_init = TRUE;
+	}
+
+	count = 0;
+	for (pad = 0; pad < LED_PADS; pad++) {
+		if (led_dirty [pad]) {
+			led_dirty [pad] = FALSE;
+			__sync_synchronize ();				// a pad set meanwhile stays dirty for next flush
+			led_next [pad] = led_frame [pad];
+			led_pending [pad] = (led_next [pad] != led_shadow [pad]);		// pad set and reset before being sent is dropped
+		}
+		if (led_pending [pad]) count++;
+	}
+	if ((count == 0) && (led_sweep < 0) && (!led_flip)) {
+		stats_leds (0, 0);
+		return 0;
+	}
+
+	nb = 0;
+	max = (led_budget > 0) ? led_budget : LIST_ELT - 1;
+	if (led_mode == LED_OUTPUT_LAUNCHPAD) {
+		max--;								// room for the flip of buffers
+		if ((count > 0) && (led_displayed < 0)) {
+			led_buffers (0);
+			nb++;
+		}
+		if ((count > LED_PADS / 2) && (led_sweep < 0)) led_sweep = 0;
+		buffer [0] = LED_RAPID;
+		while ((led_sweep >= 0) && (nb < max)) {
+			buffer [1] = led_take (led_sweep) & LED_COLOR_MASK;
+			buffer [2] = led_take (led_sweep + 1) & LED_COLOR_MASK;
+			push_to_list (UI, buffer);
+			nb++;
+			led_flip = TRUE;
+			led_sweep += 2;
+			if (led_sweep >= LED_PADS) led_sweep = -1;
+		}
+	}
+
+	// pads left, by priority
+	if (led_sweep < 0) {
+		for (priority = 0; priority < LED_PRIORITIES; priority++) {
+			for (pad = 0; (pad < LED_PADS) && (nb < max); pad++) {
+				if ((!led_pending [pad]) || (led_priority (pad) != priority)) continue;
+				if (led_mode == LED_OUTPUT_LAUNCHPAD) {
+					led_send (pad, led_take (pad) & LED_COLOR_MASK);
+					led_flip = TRUE;
+				}
+				else led_send (pad, led_take (pad));
+				nb++;
+			}
+		}
+	}
+
+	// pads left for the next cycles
+	count = 0;
+	for (pad = 0; pad < LED_PADS; pad++) {
+		if ((led_pending [pad]) || ((led_sweep >= 0) && (pad >= led_sweep))) count++;
+	}
+	if ((led_flip) && (count == 0)) {
+		led_buffers (1 - led_displayed);
+		led_flip = FALSE;
+		nb++;
+	}
+	stats_leds (nb, count);
+	return nb;
+}
 
 
 // returns the color of the "bar" cursor
@@ -38,20 +236,18 @@ int color_ui_bar (int col) {
 // mode OFF turns all the leds to black
 void led_ui_instruments (int mode) {
 	int i;
-	uint8_t buffer [4];
+	uint8_t color;
 
-	buffer [0] = MIDI_CC;
 	for (i=0; i<8; i++) {
-		buffer [1] = i + 0x68;
 		if (mode) {
 			// manage case of LO_BLACK
-			if (ui_instruments [i] == LO_BLACK) buffer [2] = BLACK;
-			else buffer [2] = ui_instruments [i];
+			if (ui_instruments [i] == LO_BLACK) color = BLACK;
+			else color = ui_instruments [i];
 		}
 		else {
-			buffer [2] = BLACK;
+			color = BLACK;
 		}
-		push_to_list (UI, buffer);			// put in midisend buffer
+		led_set (LED_PAD_INSTRUMENTS + i, color);
 	}
 }
 
@@ -59,14 +255,8 @@ void led_ui_instruments (int mode) {
 // mode OFF turns all the leds to black
 void led_ui_pages (int mode) {
 	int i;
-	uint8_t buffer [4];
-
-	buffer [0] = MIDI_NOTEON;
 	for (i=0; i<8; i++) {
-		buffer [1] = (i << 4) + 0x8;
-		if (mode) buffer [2] = ui_pages [i];
-		else buffer [2] = BLACK;
-		push_to_list (UI, buffer);			// put in midisend buffer
+		led_set (LED_PAD_PAGES + i, mode ? ui_pages [i] : BLACK);
 	}
 }
 
@@ -84,40 +274,27 @@ void led_ui_bars (int instr, int page) {
 // light a single bar led, according to its value in the table
 void led_ui_bar (int instr, int page, int bar) {
 
-	uint8_t buffer [4], color;
+	uint8_t color;
 
 	// determine color based on bar color + selection color (in case selection is on the bar)
 	if (ui_select [bar] == BLACK) color = ui_bars [instr][page][bar];
 	else color = ui_select [bar];
 
-	buffer [0] = MIDI_NOTEON;
-	buffer [1] = bar2midi (bar);
-	buffer [2] = color;
-	push_to_list (UI, buffer);		// put in midisend buffer
+	led_set (bar, color);
 }
 
 // light a single instrument
 void led_ui_instrument (int instr) {
 
-	uint8_t buffer [4];
-
-	buffer [0] = MIDI_CC;
-	buffer [1] = instr + 0x68;
 	// manage case of LO_BLACK
-	if (ui_instruments [instr] == LO_BLACK) buffer [2] = BLACK;
-	else buffer [2] = ui_instruments [instr];
-	push_to_list (UI, buffer);			// put in midisend buffer
+	if (ui_instruments [instr] == LO_BLACK) led_set (LED_PAD_INSTRUMENTS + instr, BLACK);
+	else led_set (LED_PAD_INSTRUMENTS + instr, ui_instruments [instr]);
 }
 
 // light a single page
 void led_ui_page (int page) {
 
-	uint8_t buffer [4];
-
-	buffer [0] = MIDI_NOTEON;
-	buffer [1] = (page << 4) + 0x08;
-	buffer [2] = ui_pages [page];
-	push_to_list (UI, buffer);			// put in midisend buffer
+	led_set (LED_PAD_PAGES + page, ui_pages [page]);
 }
 
 // light selection between limit1 and limit2 in high green/red; erase previous selection; processing is done so that number of midi messages is optimized
@@ -173,57 +350,90 @@ uint8_t led_ui_select (int lim1, int lim2) {
 	return (start);
 }
 
-// go through the whole song notes, and set the "bars" tables of leds according to notes color
-void note2bar_color () {
+// bars colors of each part of the song (see pool.c), and the bars holding notes in this part
+static uint8_t part_bars [POOL_PARTS][8][8][64];
+static uint8_t part_used [POOL_PARTS][8][8][64];
+
+
+// set the "bars" of a part of the song according to notes color
+static uint64_t note2bar_part (int part, int from, int to, void *arg) {
 
 	int i;
 	int instr, page, bar;
 
-	// fill UI structure with start values to set up leds
-	memset (ui_bars, BLACK, 8 * 8 * 64);
-
-	for (i = 0; i <song_length; i++) {
+	memset (part_used [part], FALSE, 8 * 8 * 64);
+	for (i = from; i < to; i++) {
 		// get bar number
 		instr = song [i].instrument;
 		page = song [i].qbar / 64;		// 64 bars per page
 		bar = song [i].qbar % 64;
 
-		ui_bars [instr][page][bar] = song [i].color;	// set to the right color
+		part_bars [part][instr][page][bar] = song [i].color;	// set to the right color
+		part_used [part][instr][page][bar] = TRUE;
 	}
+	return 0;
 }
 
 
-// go through the "bars" of the song, and set the notes color according to bars color
-void bar2note_color () {
+// go through the whole song notes, and set the "bars" tables of leds according to notes color
+// parts of the song are processed in parallel, then merged in song order: the last note of a bar gives its color
+void note2bar_color () {
+
+	int part, parts, i;
+
+	// fill UI structure with start values to set up leds
+	memset (ui_bars, BLACK, 8 * 8 * 64);
+
+	parts = pool_size (song_length);
+	pool_run (note2bar_part, NULL, song_length);
+	for (part = 0; part < parts; part++) {
+		for (i = 0; i < 8 * 8 * 64; i++) {
+			if (((uint8_t *) part_used [part]) [i]) ((uint8_t *) ui_bars) [i] = ((uint8_t *) part_bars [part]) [i];
+		}
+	}
+}
+
+
+// set the notes color of a part of the song according to bars color; returns the segments changed
+static uint64_t bar2note_part (int part, int from, int to, void *arg) {
 
 	int i;
 	int instr, page, bar;
+	uint64_t segments;
 
-	for (i = 0; i <song_length; i++) {
+	segments = 0;
+	for (i = from; i < to; i++) {
 		// get bar number
 		instr = song [i].instrument;
 		page = song [i].qbar / 64;		// 64 bars per page
 		bar = song [i].qbar % 64;
 
+		if (song [i].color == ui_bars [instr][page][bar]) continue;
 		song [i].color = ui_bars [instr][page][bar];	// set to the right color
+		segments |= PACK_SEGMENT (instr, page);
 	}
+	return segments;
+}
+
+
+// go through the "bars" of the song, and set the notes color according to bars color (parts of the song in parallel)
+void bar2note_color () {
+
+	set_dirty_segments (pool_run (bar2note_part, NULL, song_length));
 }
 
 
-// light the "files" table of leds
+// light the "files" table of leds, from the slot index (no disk access)
 void led_ui_files () {
 
 	int i;
-	uint8_t buffer [4];
 
-	for (i=0; i<64; i++) {
+	slots_changed = FALSE;
 
-		buffer [0] = MIDI_NOTEON;
-		buffer [1] = bar2midi (i);
+	for (i=0; i<64; i++) {
 		// set color according whether we load or save file
-		if (is_load) buffer [2] = (save_files) [i] ? LO_GREEN : BLACK;
-		if (is_save) buffer [2] = (save_files) [i] ? LO_RED : BLACK;
-		push_to_list (UI, buffer);		// put in midisend buffer
+		if (is_load) led_set (i, save_slots [i].exists ? (cache_is_ready (i) ? HI_GREEN : LO_GREEN) : BLACK);	// high green: song is cached, switch is instant
+		if (is_save) led_set (i, save_slots [i].exists ? LO_RED : BLACK);
 	}
 }
 
@@ -232,17 +442,12 @@ void led_ui_files () {
 void led_ui_instrument_bank (int bank) {
 
 	int i;
-	uint8_t buffer [4];
 
 	for (i=0; i<64; i++) {
-
-		buffer [0] = MIDI_NOTEON;
-		buffer [1] = bar2midi (i);
 		// set color according bank number
-		if (bank == 0) buffer [2] = BLACK;
-		if (bank == 1) buffer [2] = LO_AMBER;
-		if (bank >= 2) buffer [2] = LO_ORANGE;
-		push_to_list (UI, buffer);		// put in midisend buffer
+		if (bank == 0) led_set (i, BLACK);
+		if (bank == 1) led_set (i, LO_AMBER);
+		if (bank >= 2) led_set (i, LO_ORANGE);
 	}
 }
 
@@ -250,15 +455,10 @@ void led_ui_instrument_bank (int bank) {
 // light a single instrument (top row of leds of launchpad)
 void led_ui_single_instrument (int instr, int bank) {
 
-	uint8_t buffer [4];
-
-	buffer [0] = MIDI_CC;
-	buffer [1] = instr + 0x68;
 	// set color according bank number
-	if (bank == 0) buffer [2] = BLACK;
-	if (bank == 1) buffer [2] = LO_AMBER;
-	if (bank >= 2) buffer [2] = LO_ORANGE;
-	push_to_list (UI, buffer);			// put in midisend buffer
+	if (bank == 0) led_set (LED_PAD_INSTRUMENTS + instr, BLACK);
+	if (bank == 1) led_set (LED_PAD_INSTRUMENTS + instr, LO_AMBER);
+	if (bank >= 2) led_set (LED_PAD_INSTRUMENTS + instr, LO_ORANGE);
 }
 
 
@@ -267,25 +467,175 @@ void led_ui_single_instrument (int instr, int bank) {
 // onoff parameter allows to light/unlight the led 
 void led_ui_cursor_instrument (int instr_number, int bank, int onoff) {
 
-	uint8_t buffer [4];
+	uint8_t color;
 	int instr_pad;
 
 	instr_pad = instr_number % 64;		// pad number between 0 and 63
 
-	buffer [0] = MIDI_NOTEON;
-	buffer [1] = bar2midi (instr_pad);
 	// set color according bank number
 	if (onoff) {		// in case of ON
-		if (bank == 0) buffer [2] = BLACK;
-		if (bank == 1) buffer [2] = HI_AMBER;
-		if (bank >= 2) buffer [2] = HI_ORANGE;
+		if (bank == 0) color = BLACK;
+		if (bank == 1) color = HI_AMBER;
+		if (bank >= 2) color = HI_ORANGE;
 	}
 	else {				// in case of OFF
-		if (bank == 0) buffer [2] = BLACK;
-		if (bank == 1) buffer [2] = LO_AMBER;
-		if (bank >= 2) buffer [2] = LO_ORANGE;
+		if (bank == 0) color = BLACK;
+		if (bank == 1) color = LO_AMBER;
+		if (bank >= 2) color = LO_ORANGE;
 	}
 
 	// based on bank number, determine whether we should light pad or not (i. send midi data or not)
-	if (((instr_number / 64) + 1) == bank)	push_to_list (UI, buffer);			// put in midisend buffer
+	if (((instr_number / 64) + 1) == bank)	led_set (instr_pad, color);
+}
+
+
+/**************************/
+/* tests (debug use only) */
+/**************************/
+
+static int test_failures;					// number of failed checks of the test being run
+
+
+// record the result of a check
+static void test_check (int condition, char * st) {
+
+	if (condition) return;
+	printf ("FAIL: %s\n", st);
+	test_failures++;
+}
+
+
+// pull the messages sent to the control surface into bytes; returns the number of bytes
+static int test_led_stream (uint8_t * bytes) {
+
+	int lg;
+
+	lg = 0;
+	while (pull_from_list (UI, &bytes [lg])) lg += 3;
+	return lg;
+}
+
+
+// led output: byte streams sent to the Launchpad by led_flush, plain and with double buffering / rapid LED update, and paced
+// run by make test; returns the number of failed checks
+int test_led () {
+
+	uint8_t bytes [LIST_ELT * 3], expected [LIST_ELT * 3], saved [64];
+	int i, lg, nb;
+
+	test_failures = 0;
+
+	// all pads black, 1 message per pad
+	led_pace (0);
+	led_output (LED_OUTPUT_PLAIN);
+	led_ui_instrument_bank (0);
+	led_ui_pages (OFF);
+	for (i = 0; i < 8; i++) led_ui_single_instrument (i, 0);
+	led_flush ();
+	test_led_stream (bytes);
+	test_check (led_flush () == 0, "led: nothing to send");
+
+	// repeated writes to a pad within a cycle: a single message, with the last color
+	led_ui_cursor_instrument (5, 1, ON);
+	led_ui_cursor_instrument (5, 1, OFF);
+	led_ui_cursor_instrument (5, 1, ON);
+	nb = led_flush ();
+	lg = test_led_stream (bytes);
+	test_check ((nb == 1) && (lg == 3) && (bytes [0] == MIDI_NOTEON) && (bytes [1] == 0x05) && (bytes [2] == HI_AMBER), "led: writes to a pad are coalesced");
+
+	// writes ending on the color shown: nothing sent
+	led_ui_cursor_instrument (5, 1, OFF);
+	led_ui_cursor_instrument (5, 1, ON);
+	test_check ((led_flush () == 0) && (test_led_stream (bytes) == 0), "led: color shown is not sent again");
+	led_ui_cursor_instrument (5, 0, ON);
+	led_flush ();
+	test_led_stream (bytes);
+
+	// full redraw: buffers set up, 40 rapid updates in pad order without copy and clear flags, then buffers flipped
+	led_output (LED_OUTPUT_LAUNCHPAD);
+	led_ui_instrument_bank (1);
+	for (i = 0; i < 8; i++) led_ui_single_instrument (i, 1);
+	nb = led_flush ();
+	lg = test_led_stream (bytes);
+	expected [0] = MIDI_CC;
+	expected [1] = LED_BUFFER_CC;
+	expected [2] = 0x34;
+	for (i = 0; i < LED_PADS / 2; i++) {
+		expected [3 + (i * 3)] = LED_RAPID;
+		expected [4 + (i * 3)] = ((i < 32) || (i >= 36)) ? (LO_AMBER & LED_COLOR_MASK) : 0x00;
+		expected [5 + (i * 3)] = expected [4 + (i * 3)];
+	}
+	expected [123] = MIDI_CC;
+	expected [124] = LED_BUFFER_CC;
+	expected [125] = 0x31;
+	test_check ((nb == 42) && (lg == 126), "led: full redraw in 42 messages");
+	test_check (memcmp (bytes, expected, 126) == 0, "led: full redraw stream");
+
+	// single pad: written to the hidden buffer, then buffers flipped back
+	led_ui_cursor_instrument (5, 1, ON);
+	lg = test_led_stream (bytes);
+	test_check (lg == 0, "led: pads are sent by flush only");
+	led_flush ();
+	lg = test_led_stream (bytes);
+	expected [0] = MIDI_NOTEON;
+	expected [1] = 0x05;
+	expected [2] = HI_AMBER & LED_COLOR_MASK;
+	expected [3] = MIDI_CC;
+	expected [4] = LED_BUFFER_CC;
+	expected [5] = 0x34;
+	test_check ((lg == 6) && (memcmp (bytes, expected, 6) == 0), "led: single pad stream");
+
+	// pad set and reset within a cycle: nothing sent, not even a flip
+	led_ui_cursor_instrument (9, 1, ON);
+	led_ui_cursor_instrument (9, 1, OFF);
+	test_check ((led_flush () == 0) && (test_led_stream (bytes) == 0), "led: pad set and reset");
+
+	// plain output: note on with both flags, no flip
+	led_output (LED_OUTPUT_PLAIN);
+	led_ui_cursor_instrument (5, 1, OFF);
+	led_flush ();
+	lg = test_led_stream (bytes);
+	expected [0] = MIDI_NOTEON;
+	expected [1] = 0x05;
+	expected [2] = LO_AMBER;
+	test_check ((lg == 3) && (memcmp (bytes, expected, 3) == 0), "led: plain stream");
+
+	// paced: cursor first, then the bars, then the other pads; 2 messages per cycle
+	memcpy (saved, ui_select, 64);
+	memset (ui_select, BLACK, 64);
+	ui_select [30] = HI_GREEN;
+	led_pace (2);
+	led_ui_single_instrument (3, 2);
+	led_ui_cursor_instrument (64 + 20, 2, ON);
+	led_ui_cursor_instrument (64 + 30, 2, ON);
+	nb = led_flush ();
+	lg = test_led_stream (bytes);
+	test_check ((nb == 2) && (lg == 6) && (bytes [1] == bar2midi (30)) && (bytes [4] == bar2midi (20)), "led: paced, cursor first");
+	nb = led_flush ();
+	lg = test_led_stream (bytes);
+	test_check ((nb == 1) && (lg == 3) && (bytes [0] == MIDI_CC) && (bytes [1] == 0x6B), "led: paced, other pads next");
+	test_check (led_flush () == 0, "led: paced, nothing left");
+	memcpy (ui_select, saved, 64);
+
+	// paced full redraw: rapid update goes on over the next cycles, buffers are flipped at the end only
+	led_output (LED_OUTPUT_LAUNCHPAD);
+	led_pace (8);
+	led_ui_instrument_bank (1);
+	led_ui_pages (OFF);
+	for (i = 0; i < 8; i++) led_ui_single_instrument (i, 1);
+	led_flush ();
+	test_led_stream (bytes);
+	led_ui_instrument_bank (2);
+	lg = 0;
+	for (i = 0; (i < 10) && ((nb = led_flush ()) > 0); i++) {
+		test_check (nb <= 8, "led: paced redraw within budget");
+		lg += test_led_stream (&bytes [lg]);
+	}
+	test_check ((i == 6) && (lg == 41 * 3), "led: paced redraw in 6 cycles");
+	test_check ((bytes [0] == LED_RAPID) && (bytes [lg - 3] == MIDI_CC) && (bytes [lg - 6] == LED_RAPID), "led: paced redraw, flip at the end");
+
+	led_pace (LED_BUDGET);
+	led_output (LED_OUTPUT);
+	printf ("led tests: %s (%d failed checks)\n", test_failures ? "FAILED" : "passed", test_failures);
+	return test_failures;
 }
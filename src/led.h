@@ -20,3 +20,7 @@ void led_ui_instrument_bank (int);
 void led_ui_single_instrument (int, int);
 void led_ui_cursor_instrument (int, int, int);
 
+void led_output (int);
+void led_pace (int);
+int led_flush ();
+int test_led ();
@@ -0,0 +1,122 @@
+/** @file live.c
+ *
+ * @brief Notes played on the keyboard while recording, which are quantized in the future (quantize_note returns FALSE).
+ * They are kept in a priority queue (binary heap, ordered by absolute frame), and written to the music output by process
+ * at the frame offset of their quantized time, instead of waiting for the song to be read at cycle granularity.
+ * Notes written that way are marked in the song, so that the song does not play them a second time.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static live_t live_queue [LIVE_SIZE];	// binary heap: live_queue [0] is the next note to be played
+static int live_length = 0;				// number of notes in the queue
+static uint32_t live_seq = 0;			// order of scheduling, so that notes of the same frame keep their order
+static int live_marked = FALSE;			// TRUE if notes of the song may have been marked as played
+
+
+// TRUE if note a shall be played before note b
+static int live_before (live_t *a, live_t *b) {
+
+	// frames are compared with a difference, in case the frame counter wraps
+	if (a->frame != b->frame) return ((int32_t) (a->frame - b->frame) < 0);
+	return ((int32_t) (a->seq - b->seq) < 0);
+}
+
+
+// schedule a midi message at absolute frame time frame; called from process only
+// returns FALSE if the queue is full (note is then played back by the song, at cycle granularity)
+int live_schedule (jack_nframes_t frame, uint8_t * buffer) {
+
+	live_t note, tmp;
+	int i, parent;
+
+	if (live_length >= LIVE_SIZE) return FALSE;
+
+	note.frame = frame;
+	note.seq = live_seq++;
+	memcpy (note.data, buffer, 3);
+
+	// sift up
+	i = live_length++;
+	live_queue [i] = note;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!live_before (&live_queue [i], &live_queue [parent])) break;
+		tmp = live_queue [parent];
+		live_queue [parent] = live_queue [i];
+		live_queue [i] = tmp;
+		i = parent;
+	}
+	live_marked = TRUE;
+	return TRUE;
+}
+
+
+// remove the first note of the queue
+static void live_pop () {
+
+	live_t tmp;
+	int i, child;
+
+	live_queue [0] = live_queue [--live_length];
+
+	// sift down
+	i = 0;
+	while ((child = (2 * i) + 1) < live_length) {
+		if ((child + 1 < live_length) && (live_before (&live_queue [child + 1], &live_queue [child]))) child++;
+		if (!live_before (&live_queue [child], &live_queue [i])) break;
+		tmp = live_queue [child];
+		live_queue [child] = live_queue [i];
+		live_queue [i] = tmp;
+		i = child;
+	}
+}
+
+
+// write the notes due during the cycle starting at frame time frame to midiout, at their frame offset
+// to be called after the other music events of the cycle have been written (at offset 0), so that events stay in order
+void live_flush (void * midiout, jack_nframes_t frame, jack_nframes_t nframes) {
+
+	int32_t offset;
+
+	while (live_length > 0) {
+		offset = (int32_t) (live_queue [0].frame - frame);
+		if (offset >= (int32_t) nframes) break;
+		midi_write (midiout, (offset > 0) ? offset : 0, live_queue [0].data);
+		live_pop ();
+	}
+}
+
+
+// drop the notes waiting to be played, and clear the marks of the notes in the song (play is stopped, or song changes)
+void live_clear () {
+
+	int i;
+
+	live_length = 0;
+	if (!live_marked) return;
+	for (i = 0; i < song_length; i++) song [i].played = FALSE;
+	live_marked = FALSE;
+}
@@ -0,0 +1,9 @@
+/** @file live.h
+ *
+ * @brief This file defines prototypes of functions inside live.c
+ *
+ */
+
+int live_schedule (jack_nframes_t, uint8_t *);
+void live_flush (void *, jack_nframes_t, jack_nframes_t);
+void live_clear ();
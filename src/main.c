@@ -12,6 +12,22 @@
 #include "song.h"
 #include "disk.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static volatile sig_atomic_t quit_signal = 0;		// signal received: the main loop closes the program
 
 
 /*************/
@@ -40,6 +56,9 @@ static void init_globals (int clear_copy_buffer)
 	// empty song structure
 	memset (song, 0, SONG_SIZE * sizeof (note_t));
 	song_length = 0;		// indicates length of the song (highest index in song [])
+	dirty_segments = PACK_ALL;	// new song: next compact save is a full one
+	song_changes++;
+	pack_slot = -1;
 	// empty copy_buffer structure and corresponding led structure
 	if (clear_copy_buffer == TRUE) {
 		memset (copy_buffer, 0, COPY_SIZE * sizeof (note_t));
@@ -77,6 +96,7 @@ static void init_globals (int clear_copy_buffer)
 	time_beats_per_bar = 4.0;
 	time_beat_type = 4.0;
 	time_ticks_per_beat = 480.0;
+	timebase_update ();
 	time_beats_per_minute = 120.0;
 	time_bpm_multiplier = 1.0;
 
@@ -111,15 +131,10 @@ static void init_globals (int clear_copy_buffer)
 }
 
 
+// only async-signal-safe things here: the main loop is woken up (sleep is interrupted) and closes the program
 static void signal_handler ( int sig )
 {
-	// JACK client close
-	jack_client_close ( client );
-	echo ();
-	endwin ();				// end curses
-
-	fprintf ( stderr, "signal received, exiting ...\n" );
-	exit ( 0 );
+	quit_signal = sig;
 }
 
 
@@ -148,6 +163,12 @@ void jack_shutdown ( void *arg )
 int main ( int argc, char *argv[] )
 {
 	int i,j;
+	int recovered;			// number of changes recovered from journal
+	uint32_t position;		// journal position of a song loaded or saved
+	int load_status;		// result of song loading
+#ifdef TEST
+	int failures;			// number of failed checks
+#endif
 	
 	// JACK variables
 	const char *client_name;
@@ -206,6 +227,9 @@ int main ( int argc, char *argv[] )
 	*/
 	jack_on_shutdown ( client, jack_shutdown, 0 );
 
+	/* count xruns, for timing statistics */
+	jack_set_xrun_callback ( client, stats_xrun, 0 );
+
 	/* register midi-in port: this port will get the midi keys notification (from UI) */
 	midi_UI_in = jack_port_register (client, "midi_UI_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
 	if (midi_UI_in == NULL ) {
@@ -270,6 +294,36 @@ int main ( int argc, char *argv[] )
 		exit ( 1 );
 	}
 
+#ifdef TEST
+	// tests (make test): replay of a recorded input through process () from startup state, then song and led tests
+	// exit status is 1 if a check fails
+	init_globals (TRUE);
+	failures = test_replay ();
+	failures += test_song ();
+	failures += test_led ();
+	jack_client_close ( client );
+	exit ( failures ? 1 : 0 );
+#endif
+
+#ifdef BENCH
+	// offline playback benchmark (make bench.a): process () is driven by the benchmark instead of the JACK server
+	init_globals (TRUE);
+	// "bench.a flood [max events per cycle] [cycles]": flood of the keyboard input; "bench.a requant [notes] [runs]": requantization
+	// "bench.a quantize [runs]": integer tick math; "bench.a pool [notes] [runs]": worker pool; "bench.a [notes] [cycles]": playback
+	// "bench.a replay in out [cycles]": input events recorded in file in are replayed, output events are captured to file out
+	// "bench.a midi [notes]": midi export; "bench.a pak [songs]": json, midi and compact files; both in a temporary directory
+	if ((argc >= 2) && (strcmp (argv [1], "flood") == 0)) bench_flood ((argc >= 3) ? atoi (argv [2]) : BENCH_BURST, (argc >= 4) ? atoi (argv [3]) : BENCH_FLOOD_CYCLES);
+	else if ((argc >= 2) && (strcmp (argv [1], "requant") == 0)) bench_requant ((argc >= 3) ? atoi (argv [2]) : SONG_SIZE, (argc >= 4) ? atoi (argv [3]) : BENCH_REQUANT_RUNS);
+	else if ((argc >= 2) && (strcmp (argv [1], "quantize") == 0)) bench_quantize ((argc >= 3) ? atoi (argv [2]) : BENCH_QUANTIZE_RUNS);
+	else if ((argc >= 2) && (strcmp (argv [1], "pool") == 0)) bench_pool ((argc >= 3) ? atoi (argv [2]) : SONG_SIZE, (argc >= 4) ? atoi (argv [3]) : BENCH_POOL_RUNS);
+	else if ((argc >= 2) && (strcmp (argv [1], "midi") == 0)) bench_midi ((argc >= 3) ? atoi (argv [2]) : BENCH_MIDI_NOTES);
+	else if ((argc >= 2) && (strcmp (argv [1], "pak") == 0)) bench_pak ((argc >= 3) ? atoi (argv [2]) : BENCH_PAK_SONGS);
+	else if ((argc >= 4) && (strcmp (argv [1], "replay") == 0)) bench_replay (argv [2], argv [3], (argc >= 5) ? atoi (argv [4]) : BENCH_REPLAY_CYCLES);
+	else bench_playback ((argc >= 2) ? atoi (argv [1]) : SONG_SIZE, (argc >= 3) ? atoi (argv [2]) : BENCH_CYCLES);
+	jack_client_close ( client );
+	exit ( 0 );
+#endif
+
 	/* Tell the JACK server that we are ready to roll.  Our
 	 * process() callback will start running now. */
 
@@ -284,6 +338,28 @@ int main ( int argc, char *argv[] )
 	// init global variables
 	init_globals (TRUE);	// clear variables + empty copy buffer
 
+	// workers for whole-song passes (colors, transposition on recovery)
+	if (pool_open () == FALSE) {
+		fprintf ( stderr, "cannot start all worker threads.\n" );
+	}
+
+	// tracks may be requantized while playing (this is journaled as well)
+	if (requant_open () == FALSE) {
+		fprintf ( stderr, "cannot start requantization.\n" );
+	}
+
+	// recover song from the journal in case previous session has not been closed properly, then start journaling
+	recovered = journal_recover (DEFAULT_DIR);
+	if (recovered) fprintf ( stderr, "song recovered from journal: %d changes replayed.\n", recovered );
+	journal_open (DEFAULT_DIR, recovered ? TRUE : FALSE);
+
+	// report timing of process () periodically
+	stats_open (DEFAULT_DIR);
+	// record events of process (), to be dumped to a trace file on request (key or SIGUSR1)
+	trace_open (DEFAULT_DIR);
+	// record offset measured by the last latency calibration
+	latency_open (DEFAULT_DIR);
+
 	// init ncurses for non-blocking key capture
 	initscr();				// init curses, 
 	nodelay(stdscr, TRUE);	// no delaying, no blocking
@@ -291,10 +367,15 @@ int main ( int argc, char *argv[] )
 	cbreak ();				// no buffering
 	keypad (stdscr, TRUE);	// special keys can be captured
 
-	// read all the files that are in the save directory, and fill save_files table accordingly
-	if (get_files_in_directory (DEFAULT_DIR, save_files) == FALSE) {
+	// index all the files that are in the save directory, and keep the index up to date
+	if (slot_index_open (DEFAULT_DIR) == FALSE) {
 		fprintf ( stderr, "cannot open save directory.\n" );
 	}
+	// songs next to the current one are decoded in the background, to be switched without loading them
+	if (cache_open (DEFAULT_DIR) == FALSE) {
+		fprintf ( stderr, "cannot create song cache.\n" );
+	}
+	cache_preload (-1);
 
 
 	/**************/
@@ -334,8 +415,12 @@ int main ( int argc, char *argv[] )
 	}
 
 
-	// set default volumes and instruments
-	set_defaults ();
+	// set default volumes and instruments, unless these come from a recovered song
+	if (recovered) {
+		set_instruments ();
+		set_volumes ();
+	}
+	else set_defaults ();
 
 	// light leds on the UI
 	led_ui_instruments (ON);
@@ -359,20 +444,31 @@ int main ( int argc, char *argv[] )
 #endif
 
 
-	/* keep running until the transport stops */
-	while (1)
+	/* keep running until the transport stops, or a signal is received */
+	while (!quit_signal)
 	{
+		// no pass of the main loop is running: songs switched from by process may be reused by the cache
+		cache_release ();
+
 		// check if user has typed the LOAD button to load file and a file is selected
 		if ((is_load) && (file_selected != 0xFF))  {
 			init_globals (FALSE);			// empty song, etc; but keep copy buffer
+			position = journal_position ();	// records from now on apply to the loaded song
 
-			if (load (file_selected, DEFAULT_DIR)) set_defaults ();		// load song; if error, then set default volumes & instr
+			load_status = load (file_selected, DEFAULT_DIR);					// load song
+			if (load_status == 2) load_status = load_midi (file_selected, DEFAULT_DIR);	// no song file: import midi file, if any
+			if (load_status) {												// if error, then set default volumes & instr
+				set_defaults ();
+				journal_reset (0xFF, position);			// journal restarts from scratch
+			}
 			else {
 				// set volumes and instruments
 				// assign midi instrument to each channel
 				set_instruments ();
 				// set volume for each channel
 				set_volumes ();
+				journal_reset (file_selected, position);	// journal restarts from loaded song
+				cache_preload (file_selected);			// cache the songs next to loaded one
 			}
 			is_load = FALSE;
 
@@ -389,10 +485,14 @@ int main ( int argc, char *argv[] )
 		// check if user has typed the SAVE button to save file
 		if ((is_save) && (file_selected != 0xFF))  {
 			bar2note_color ();							// set colors to notes
-			save (file_selected, DEFAULT_DIR);			// save song
+			position = journal_position ();				// the file holds the changes up to this record, the journal keeps the next ones
+			if ((SAVE_COMPACT ? save_compact (file_selected, DEFAULT_DIR) : save (file_selected, DEFAULT_DIR)) == 0) {	// save song
+				journal_reset (file_selected, position);	// once on disk, journal restarts from saved song
+				cache_preload (file_selected);			// cache the songs next to saved one
+			}
 			save_to_midi (file_selected, DEFAULT_DIR);	// save midi
 			is_save = FALSE;
-			save_files [file_selected] = TRUE;		// add new file to file list
+			slot_refresh (file_selected);			// add new file to file list
 
 			// light leds on the UI
 			led_ui_instruments (ON);
@@ -411,5 +511,10 @@ int main ( int argc, char *argv[] )
 
 	// JACK client close
 	jack_client_close ( client );
+	journal_close ();
+	echo ();
+	endwin ();				// end curses
+
+	fprintf ( stderr, "signal received, exiting ...\n" );
 	exit ( 0 );
 }
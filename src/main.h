@@ -65,8 +65,13 @@ uint8_t ui_select [64];					// buffer to store pads during selection process
 uint8_t ui_select_previous [64];		// buffer to store pads during selection process (previous selection)
 
 // song structure
-note_t song [SONG_SIZE];			// assume song will have less than 10000 notes in it
+note_t song_buffer [SONG_SIZE];		// assume song will have less than 10000 notes in it
+note_t *song = song_buffer;			// current song; may be switched to a song of the song cache
 int song_length;					// highest index in song []
+uint64_t dirty_segments;			// segments of the song (see PACK_SEGMENT) changed since the compact file of pack_slot was written
+volatile uint32_t song_changes;		// incremented at each change of the song, so that a copy of the song can be checked
+int pack_slot;						// slot of the compact file the song comes from, -1 if none; it is appended to by the next save
+int pack_size;						// size of this compact file
 note_t copy_buffer [COPY_SIZE];		// copy-paste buffer
 int copy_length;					// highest index in copy_buffer []
 uint8_t led_copy_buffer [512];		// 64 bytes * 8 pages to store led status of bars of copy buffer
@@ -104,7 +109,8 @@ int volume_list [8];
 int send_clock_tick;			// determine if midi clock shall be sent or not
 
 // tables for load/save
-uint8_t save_files [64];		// each save file is identified as a number; the table contains true or false depending file exists or not
+slot_t save_slots [64];			// each save file is identified as a number; the table contains metadata of the files of the slot
+volatile int slots_changed;		// set to TRUE when slot index has changed, so the UI can be refreshed
 uint8_t file_selected;			// file number selected on the pad
 
 // change of instrument
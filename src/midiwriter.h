@@ -14,11 +14,28 @@
 #include <stdbool.h>
 #endif
 
-static inline void AssertDeltaTime(int delta) {
+#ifndef _STRING_H
+#include <string.h>
+#endif
+
+/* the whole midi file is built in memory, then written to disk at once
+ * data grows as required; status is the last status byte written (running status)
+ * Write* functions return the number of bytes written, or -1 if memory could not be allocated or the event is invalid
+ */
+typedef struct {
+    uint8_t *data;
+    int32_t len;
+    int32_t size;
+    uint8_t status;
+} MidiBuffer;
+
+// returns false if delta time does not fit in 4 bytes
+static inline bool CheckDeltaTime(int delta) {
     if(delta > 0xfffffff) {
         fprintf(stderr, "Given deltatime length too long: %d\n", delta);
-        exit(1);
+        return false;
     }
+    return true;
 }
 
 void GetBytes(uint8_t *bytes, int32_t num, int32_t byteLen) {
@@ -35,71 +52,118 @@ void GetBytesLong(uint8_t *bytes, int64_t num, int32_t byteLen) {
     }
 }
 
+// returns false if memory could not be allocated
+bool InitMidiBuffer(MidiBuffer *buf, int32_t size) {
+    buf->data = malloc(size);
+    buf->len = 0;
+    buf->size = (buf->data == NULL) ? 0 : size;
+    buf->status = 0;
+    return (buf->data != NULL);
+}
+
+void FreeMidiBuffer(MidiBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+// make sure there is room for len more bytes; buffer size is doubled as required
+// returns false if memory could not be allocated (buffer is left unchanged)
+static inline bool ReserveMidiBuffer(MidiBuffer *buf, int32_t len) {
+    uint8_t *data;
+    int32_t size = buf->size ? buf->size : 256;
+
+    if(buf->len + len <= buf->size) return true;
+    while(size < buf->len + len) size *= 2;
+    data = realloc(buf->data, size);
+    if(data == NULL) {
+        fprintf(stderr, "Cannot allocate midi buffer: %d bytes\n", size);
+        return false;
+    }
+    buf->data = data;
+    buf->size = size;
+    return true;
+}
+
+// returns false if memory could not be allocated
+static inline bool PutBytes(MidiBuffer *buf, const uint8_t *bytes, int32_t len) {
+    if(!ReserveMidiBuffer(buf, len)) return false;
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+    return true;
+}
+
 /* WARNING: Windows Media Player would crash
  *          when navigating through very long midi file!!
  * maximum delta time:      28-bit full integer(268435455)
  * maximum delta time byte: FF FF FF 7F
+ * 4-byte delta time bit: 1aaaaaaa 1bbbbbbb 1ccccccc 0ddddddd
  */
-int32_t ConvertToDeltaTime(uint8_t *deltaBytes, int32_t deltaTime) {
+static inline int32_t WriteDeltaTime(MidiBuffer *buf, int32_t deltaTime) {
+    uint8_t *p;
     int32_t deltaLen;
-    int32_t bytes[4];
-    bytes[0] = deltaTime & 0x7f;              // 00000000 00000000 00000000 0ddddddd
-    bytes[1] = (deltaTime & 0x3f80) >> 7;     // 00000000 00000000 00cccccc c0000000
-    bytes[2] = (deltaTime & 0x1fc000) >> 14;  // 00000000 000bbbbb bb000000 00000000
-    bytes[3] = (deltaTime & 0xfe00000) >> 21; // 0000aaaa aaa00000 00000000 00000000
-    
-    // 4-byte delta time bit: 1aaaaaaa 1bbbbbbb 1ccccccc 0ddddddd
-    if(bytes[3] > 0) {
-        deltaLen = 4;
-    }
-    
-    // 3-byte delta time bit: 1bbbbbbb 1ccccccc 0ddddddd
-    else if(bytes[2] > 0) {
-        deltaLen = 3;
-    }
-    
-    // 2-byte delta time bit: 1ccccccc 0ddddddd
-    else if(bytes[1] > 0) {
-        deltaLen = 2;
-    }
-    
-    // 1-byte delta time bit: 0ddddddd
-    else {
-        deltaLen = 1;
-    }
-    
-    for(int i=0; i<deltaLen; i++) {
-        if(i == deltaLen-1) {
-            deltaBytes[i] = bytes[deltaLen-i - 1];
-        }
-        
-        else {
-            deltaBytes[i] = 0x80 + bytes[deltaLen-i - 1];
-        }
+
+    if(!CheckDeltaTime(deltaTime)) return -1;
+    if(deltaTime < 0x80) deltaLen = 1;              // most common case: events close to each other
+    else if(deltaTime < 0x4000) deltaLen = 2;
+    else if(deltaTime < 0x200000) deltaLen = 3;
+    else deltaLen = 4;
+
+    if(!ReserveMidiBuffer(buf, deltaLen)) return -1;
+    p = buf->data + buf->len;
+    for(int i=deltaLen-1; i>=0; i--) {
+        p[deltaLen-1-i] = ((deltaTime >> (7*i)) & 0x7f) | (i ? 0x80 : 0x00);
     }
-    
+    buf->len += deltaLen;
+
     return deltaLen;
 }
 
+/* channel event: status byte is omitted if it is the same as the previous event (running status)
+ * len is the number of data bytes (1 or 2)
+ */
+static inline int32_t WriteChannelEvent(MidiBuffer *buf, int32_t delay, uint8_t status, uint8_t data1, uint8_t data2, int32_t len) {
+    int32_t deltaBytesLen = WriteDeltaTime(buf, delay);
+    uint8_t *p;
+
+    if((deltaBytesLen < 0) || !ReserveMidiBuffer(buf, 3)) return -1;
+    p = buf->data + buf->len;
+    if(status != buf->status) {
+        *p++ = status;
+        buf->status = status;
+    }
+    *p++ = data1;
+    if(len == 2) *p++ = data2;
+    len = p - (buf->data + buf->len);
+    buf->len += len;
+
+    return deltaBytesLen + len;
+}
+
 // header indicates that this midi file would be
-// midi file type 0(single track), [PPQN] pulses per quarter note
-void WriteMidiHeader(int32_t PPQN, FILE *fout) {
+// midi file type [format] (0: single track, 1: multiple tracks played together), [nbTracks] tracks, [PPQN] pulses per quarter note
+int32_t WriteMidiHeader(int32_t format, int32_t nbTracks, int32_t PPQN, MidiBuffer *buf) {
     uint8_t headerInfo[14] = {'M', 'T', 'h', 'd',
-                            0x00, 0x00, 0x00, 0x06,
-                            0x00, 0x00, 0x00, 0x01};
-    
+                            0x00, 0x00, 0x00, 0x06};
+
+    GetBytes(headerInfo+8, format, 2);
+    GetBytes(headerInfo+10, nbTracks, 2);
     GetBytes(headerInfo+12, PPQN, 2);
-    for(int i=0; i<14; i++) {
-        fwrite(headerInfo+i, sizeof(uint8_t), 1, fout);
-    }
+    if(!PutBytes(buf, headerInfo, 14)) return -1;
+
+    return 14;
 }
 
-void WriteTrackHeader(FILE *fout) {
-    uint8_t headerInfo[] = {'M', 'T', 'r', 'k'};
-    
-    for(int i=0; i<4; i++) {
-        fwrite(headerInfo+i, sizeof(uint8_t), 1, fout);
-    }
+// track size is unknown at this stage: it is written by WriteTrackEnd
+// returns position of the track in the buffer, to be given to WriteTrackEnd (or -1)
+int32_t WriteTrackHeader(MidiBuffer *buf) {
+    uint8_t headerInfo[] = {'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00};
+    int32_t start = buf->len;
+
+    if(!PutBytes(buf, headerInfo, 8)) return -1;
+    buf->status = 0;            // running status does not cross tracks
+    return start;
 }
 
 /* this SysEx message allows to use GS sound set beyond GM's 128 instruments
@@ -108,25 +172,44 @@ void WriteTrackHeader(FILE *fout) {
  * NOTE: after this SysEx message send bank change first (both MSB and LSB)
  * before sending program change
  */
-int32_t WriteSysEx_GS_Reset(FILE *fout) {
+int32_t WriteSysEx_GS_Reset(MidiBuffer *buf) {
     uint8_t SysEx[] = {0x00, 0xf0, 0x0a,
                        0x41, 0x7f, 0x42, 0x12, 0x40, 0x00, 0x7f, 0x00, 0x41, 0xf7};
-    
-    for(int i=0; i<13; i++) {
-        fwrite(SysEx+i, sizeof(uint8_t), 1, fout);
-    }
-    
+
+    if(!PutBytes(buf, SysEx, 13)) return -1;
+    buf->status = 0;            // sysex cancels running status
+
     return 13;
 }
 
-int32_t WriteTrackName(FILE *fout) {
-    uint8_t Meta[] = {0x00, 0xff, 0x03, 0x05, 'T', 'r', 'a', 'c', 'k'};
-    
-    for(int i=0; i<9; i++) {
-        fwrite(Meta+i, sizeof(uint8_t), 1, fout);
-    }
-    
-    return 9;
+int32_t WriteTrackName(const char *name, MidiBuffer *buf) {
+    uint8_t Meta[4] = {0x00, 0xff, 0x03};
+    int32_t len = strlen(name);
+
+    if(len > 0x7f) len = 0x7f;
+    Meta[3] = len;
+    if(!PutBytes(buf, Meta, 4) || !PutBytes(buf, (const uint8_t *)name, len)) return -1;
+    buf->status = 0;            // meta event cancels running status
+
+    return 4 + len;
+}
+
+/* time signature message: FF 58 04 nn dd cc bb
+ * where nn/2^dd is the time signature, cc is the number of midi clocks per metronome click
+ * and bb the number of 32nd notes per quarter note
+ */
+int32_t WriteTimeSignature(int32_t delay, int32_t num, int32_t denom, MidiBuffer *buf) {
+    int32_t deltaBytesLen = WriteDeltaTime(buf, delay);
+    uint8_t tsData[7] = {0xff, 0x58, 0x04, 0x00, 0x00, 24, 8};
+    int32_t dd = 0;
+
+    while((1 << dd) < denom) dd++;
+    tsData[3] = num;
+    tsData[4] = dd;
+    if((deltaBytesLen < 0) || !PutBytes(buf, tsData, 7)) return -1;
+    buf->status = 0;            // meta event cancels running status
+
+    return 7 + deltaBytesLen;
 }
 
 /* midi tempo message: FF 51 03 [3-byte integer]
@@ -135,22 +218,16 @@ int32_t WriteTrackName(FILE *fout) {
  * 0x7a120 = 500000, 500000us = 0.5s
  * 0.5 seconds per beat = 120 BPM
  */
-int32_t WriteTempo(int32_t delay, int32_t BPM, FILE *fout) {
-    AssertDeltaTime(delay);
-    uint8_t deltaBytes[4];
-    int32_t deltaBytesLen = ConvertToDeltaTime(deltaBytes, delay);
-    
+int32_t WriteTempo(int32_t delay, int32_t BPM, MidiBuffer *buf) {
+    int32_t deltaBytesLen = WriteDeltaTime(buf, delay);
+
     uint8_t tempoData[6] = {0xff, 0x51, 0x03};
     int32_t us = (int32_t)(1e6 * (60.0/BPM));
-    
+
     GetBytes(tempoData+3, us, 3);
-    for(int i=0; i<deltaBytesLen; i++) {
-        fwrite(deltaBytes+i, sizeof(uint8_t), 1, fout);
-    }
-    for(int i=0; i<6; i++) {
-        fwrite(tempoData+i, sizeof(uint8_t), 1, fout);
-    }
-    
+    if((deltaBytesLen < 0) || !PutBytes(buf, tempoData, 6)) return -1;
+    buf->status = 0;            // meta event cancels running status
+
     return 6 + deltaBytesLen;
 }
 
@@ -161,20 +238,8 @@ int32_t WriteTempo(int32_t delay, int32_t BPM, FILE *fout) {
  * commonly used v1 value:
  * 0x00, 0x20(bank MSB/LSB), 0x07(volume), 0x0A(pan), 0x40(sustain pedal)
  */
-int32_t WriteControlChange(int32_t delay, int32_t chn, int32_t cc, int32_t value, FILE *fout) {
-    AssertDeltaTime(delay);
-    uint8_t deltaBytes[4];
-    int32_t deltaBytesLen = ConvertToDeltaTime(deltaBytes, delay);
-    
-    uint8_t ccData[] = {0xb0+chn, cc, value};
-    for(int i=0; i<deltaBytesLen; i++) {
-        fwrite(deltaBytes+i, sizeof(uint8_t), 1, fout);
-    }
-    for(int i=0; i<3; i++) {
-        fwrite(ccData+i, sizeof(uint8_t), 1, fout);
-    }
-    
-    return 3 + deltaBytesLen;
+int32_t WriteControlChange(int32_t delay, int32_t chn, int32_t cc, int32_t value, MidiBuffer *buf) {
+    return WriteChannelEvent(buf, delay, 0xb0+chn, cc, value, 2);
 }
 
 /* program change: Cc pp
@@ -182,74 +247,37 @@ int32_t WriteControlChange(int32_t delay, int32_t chn, int32_t cc, int32_t value
  * pp is program number(00 to 7F)
  * e.g. C0 00: set channel 1's program to #0 (Piano 1)
  */
-int32_t WriteProgramChange(int32_t delay, int32_t chn, int32_t program, FILE *fout) {
-    AssertDeltaTime(delay);
-    uint8_t deltaBytes[4];
-    int32_t deltaBytesLen = ConvertToDeltaTime(deltaBytes, delay);
-    
-    uint8_t pcData[] = {0xc0+(uint8_t)chn, (uint8_t)program};
-    for(int i=0; i<deltaBytesLen; i++) {
-        fwrite(deltaBytes+i, sizeof(uint8_t), 1, fout);
-    }
-    for(int i=0; i<2; i++) {
-        fwrite(pcData+i, sizeof(uint8_t), 1, fout);
-    }
-    
-    return 2 + deltaBytesLen;
+int32_t WriteProgramChange(int32_t delay, int32_t chn, int32_t program, MidiBuffer *buf) {
+    return WriteChannelEvent(buf, delay, 0xc0+(uint8_t)chn, (uint8_t)program, 0, 1);
 }
 
 /* note message: 9c nn vv
  * where c is channel(0 to F, Ch1 to Ch16 respectively),
  * nn is note number(00 to 7F), vv is velocity (00 to 7F)
- * if velocity is 0 this corresponds to note OFF message
+ * if velocity is 0 this corresponds to note OFF message; this keeps running status across notes on and off
  */
-int32_t WriteNote(int32_t delay, int32_t chn, int32_t noteNum, int32_t vel, FILE *fout) {
-    AssertDeltaTime(delay);
-    uint8_t deltaBytes[4];
-    int32_t deltaBytesLen = ConvertToDeltaTime(deltaBytes, delay);
-    
-    uint8_t noteOnData[] = {0x90+chn, noteNum, vel};
-    for(int i=0; i<deltaBytesLen; i++) {
-        fwrite(deltaBytes+i, sizeof(uint8_t), 1, fout);
-    }
-    for(int i=0; i<3; i++) {
-        fwrite(noteOnData+i, sizeof(uint8_t), 1, fout);
-    }
-    
-    return 3 + deltaBytesLen;
+int32_t WriteNote(int32_t delay, int32_t chn, int32_t noteNum, int32_t vel, MidiBuffer *buf) {
+    return WriteChannelEvent(buf, delay, 0x90+chn, noteNum, vel, 2);
 }
 
 /* pitch bend message: Ec v1 v2
  * where c is channel(0 to F, Ch1 to Ch16 respectively),
  * either v1 or v2 is 00 to 7F
- * 
+ *
  * available bend value is 0 to 16383 (14bit full integer)
  * bend value = v2*128 + v1
  */
-int32_t WritePitchBend(int32_t delay, int32_t chn, int32_t value, FILE *fout) {
-    AssertDeltaTime(delay);
-    uint8_t deltaBytes[4];
-    int32_t deltaBytesLen = ConvertToDeltaTime(deltaBytes, delay);
-
-    uint8_t pitchBendData[] = {0xe0+chn, 0, 0};
-    pitchBendData[1] = value&0x7f;
-    pitchBendData[2] = (value&0x3f80) >> 7;
-    for(int i=0; i<deltaBytesLen; i++) {
-        fwrite(deltaBytes+i, sizeof(uint8_t), 1, fout);
-    }
-    for(int i=0; i<3; i++) {
-        fwrite(pitchBendData+i, sizeof(uint8_t), 1, fout);
-    }
-    
-    return 3 + deltaBytesLen;
+int32_t WritePitchBend(int32_t delay, int32_t chn, int32_t value, MidiBuffer *buf) {
+    return WriteChannelEvent(buf, delay, 0xe0+chn, value&0x7f, (value&0x3f80) >> 7, 2);
 }
 
-int32_t WriteTrackEnd(FILE *fout) {
+// write end of track, and set track size in the track header located at position start
+int32_t WriteTrackEnd(int32_t start, MidiBuffer *buf) {
     uint8_t EOT[4] = {0x00, 0xff, 0x2f, 0x00};
-    for(int i=0; i<4; i++) {
-        fwrite(EOT+i, sizeof(uint8_t), 1, fout);
-    }
-    
+
+    if(!PutBytes(buf, EOT, 4)) return -1;
+    buf->status = 0;
+    GetBytes(buf->data+start+4, buf->len - (start+8), 4);
+
     return 4;
 }
-
@@ -0,0 +1,371 @@
+/** @file pack.c
+ *
+ * @brief Compact encoding of a song. Notes are grouped in segments of 1 instrument x 1 page (64 bars); for each note,
+ * the quantized time is delta-coded against the previous note of the segment and the real time is coded against the quantized time,
+ * both as varints. Bar/beat/tick are rebuilt from absolute ticks when decoding.
+ * A file is a full block, possibly followed by blocks holding only the segments changed since (incremental save).
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+// write an unsigned varint (7 bits per byte, most significant bit set if more bytes follow)
+static uint8_t * put_varint (uint8_t *p, uint32_t value) {
+
+	while (value >= 0x80) {
+		*p++ = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+
+// read an unsigned varint; returns NULL if buffer ends before the varint does
+static uint8_t * get_varint (uint8_t *p, uint8_t *end, uint32_t *value) {
+
+	int shift;
+
+	*value = 0;
+	for (shift = 0; (p < end) && (shift < 35); shift += 7) {
+		*value |= (uint32_t) (*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) return p;
+	}
+	return NULL;
+}
+
+
+// signed values are zigzag coded, so small negative values stay small: 0, -1, 1, -2... become 0, 1, 2, 3...
+static uint32_t zigzag (int32_t value) {
+
+	return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+
+static int32_t unzigzag (uint32_t value) {
+
+	return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+
+// little endian fixed size values, used in the header
+static uint8_t * put_fixed (uint8_t *p, uint64_t value, int len) {
+
+	int i;
+
+	for (i = 0; i < len; i++) *p++ = (value >> (8 * i)) & 0xFF;
+	return p;
+}
+
+
+static uint64_t get_fixed (uint8_t *p, int len) {
+
+	int i;
+	uint64_t value = 0;
+
+	for (i = 0; i < len; i++) value |= (uint64_t) p [i] << (8 * i);
+	return value;
+}
+
+
+// convert a note into absolute ticks (quantized or real time)
+static uint32_t note_time (note_t *note, int ticks_per_bar, int quantized) {
+
+	if (quantized) return (note->qbar * ticks_per_bar) + note->qtick;
+	return (note->bar * ticks_per_bar) + note->tick;
+}
+
+
+// encode the notes of instr located in page (64 bars), taken from notes [first] to notes [last] (exclusive)
+// returns end of segment in buffer
+static uint8_t * pack_segment (note_t *notes, int first, int last, int instr, int page, int ticks_per_bar, uint8_t *p) {
+
+	uint32_t previous, qtime;
+	int i, nb;
+
+	// number of notes of the segment
+	nb = 0;
+	for (i = first; i < last; i++) if (notes [i].instrument == instr) nb++;
+	p = put_varint (p, nb);
+
+	previous = page * 64 * ticks_per_bar;
+	for (i = first; i < last; i++) {
+		if (notes [i].instrument != instr) continue;
+		qtime = note_time (&notes [i], ticks_per_bar, TRUE);
+		p = put_varint (p, zigzag (qtime - previous));
+		p = put_varint (p, zigzag (note_time (&notes [i], ticks_per_bar, FALSE) - qtime));
+		*p++ = (notes [i].key & 0x7F) | ((notes [i].status == MIDI_NOTEON) ? 0x80 : 0x00);
+		*p++ = notes [i].vel;
+		*p++ = notes [i].color;
+		previous = qtime;
+	}
+	return p;
+}
+
+
+// encode song sg into buf (at least PACK_SIZE bytes): header, then the segments of mask (see PACK_SEGMENT)
+// a block with all segments is a full song; a block with some segments only is appended to a full song, and replaces these segments
+// returns the number of bytes written
+int pack_song (song_cache_t * sg, uint8_t * buf, uint64_t mask) {
+
+	uint8_t *p, *seg;
+	uint32_t bits;
+	uint64_t bits64;
+	int ticks_per_bar;
+	int i, instr, page, first, last;
+
+	// header
+	p = buf;
+	memcpy (p, PACK_MAGIC, 4);
+	p += 4;
+	*p++ = PACK_VERSION;
+	memcpy (&bits, &sg->beats_per_bar, 4);
+	p = put_fixed (p, bits, 4);
+	memcpy (&bits, &sg->beat_type, 4);
+	p = put_fixed (p, bits, 4);
+	memcpy (&bits64, &sg->ticks_per_beat, 8);
+	p = put_fixed (p, bits64, 8);
+	memcpy (&bits64, &sg->beats_per_minute, 8);
+	p = put_fixed (p, bits64, 8);
+	memcpy (&bits, &sg->bpm_multiplier, 4);
+	p = put_fixed (p, bits, 4);
+	*p++ = sg->quantizer;
+	p = put_fixed (p, sg->length, 4);
+	for (i = 0; i < 8; i++) *p++ = sg->instruments [i];
+	for (i = 0; i < 8; i++) *p++ = sg->volumes [i];
+	p = put_fixed (p, mask, 8);
+
+	// segments: notes are sorted by bar, so the notes of a page are next to each other in the song
+	ticks_per_bar = (int) (sg->ticks_per_beat * sg->beats_per_bar);
+	first = 0;
+	for (page = 0; page < 8; page++) {
+		for (last = first; (last < sg->length) && (sg->notes [last].qbar < (page + 1) * 64); last++);
+		for (instr = 0; instr < 8; instr++) {
+			if (!(mask & PACK_SEGMENT (instr, page))) continue;
+			seg = p;
+			p = pack_segment (sg->notes, first, last, instr, page, ticks_per_bar, p + 4);
+			put_fixed (seg, p - (seg + 4), 4);		// size of the segment
+		}
+		first = last;
+	}
+
+	return (p - buf);
+}
+
+
+// decode a header into sg
+// returns 0 if ok, 1 if this is not a valid header
+static int get_header (uint8_t * p, song_cache_t * sg) {
+
+	uint32_t bits;
+	uint64_t bits64;
+	int i;
+
+	if ((memcmp (p, PACK_MAGIC, 4) != 0) || (p [4] != PACK_VERSION)) return 1;
+
+	p += 5;
+	bits = get_fixed (p, 4);
+	memcpy (&sg->beats_per_bar, &bits, 4);
+	bits = get_fixed (p + 4, 4);
+	memcpy (&sg->beat_type, &bits, 4);
+	bits64 = get_fixed (p + 8, 8);
+	memcpy (&sg->ticks_per_beat, &bits64, 8);
+	bits64 = get_fixed (p + 16, 8);
+	memcpy (&sg->beats_per_minute, &bits64, 8);
+	bits = get_fixed (p + 24, 4);
+	memcpy (&sg->bpm_multiplier, &bits, 4);
+	sg->quantizer = p [28];
+	sg->length = get_fixed (p + 29, 4);
+	p += 33;
+	for (i = 0; i < 8; i++) sg->instruments [i] = *p++;
+	for (i = 0; i < 8; i++) sg->volumes [i] = *p++;
+
+	if ((sg->length < 0) || (sg->length > SONG_SIZE)) return 1;
+	if ((sg->ticks_per_beat < 1) || (sg->beats_per_bar < 1)) return 1;
+	return 0;
+}
+
+
+// go through the blocks of a compact file: settings are taken from the last block, and each segment from the last block containing it
+// a block which has not been fully written (power cut during a save) is ignored, as well as anything after it
+// segments [] gets the position of each segment in buf, NULL if segment has never been written
+// returns the number of bytes of valid blocks, 0 if there is none
+static int walk_blocks (uint8_t * buf, int len, song_cache_t * sg, uint8_t ** segments) {
+
+	song_cache_t header;
+	uint8_t *seg [PACK_SEGMENTS];
+	uint8_t *p, *end;
+	uint64_t mask;
+	int i, instr, page, valid;
+
+	for (i = 0; i < PACK_SEGMENTS; i++) segments [i] = NULL;
+	p = buf;
+	end = buf + len;
+	valid = 0;
+
+	while (p + PACK_HEADER + 8 <= end) {
+		if (get_header (p, &header)) break;
+		mask = get_fixed (p + PACK_HEADER, 8);
+		p += PACK_HEADER + 8;
+
+		// check all segments of the block are there; segments are written page by page (see pack_song)
+		for (i = 0; i < PACK_SEGMENTS; i++) seg [i] = NULL;
+		for (page = 0; page < 8; page++) {
+			for (instr = 0; instr < 8; instr++) {
+				if (!(mask & PACK_SEGMENT (instr, page))) continue;
+				if ((p + 4 > end) || (p + 4 + get_fixed (p, 4) > end)) break;
+				seg [(instr * 8) + page] = p;
+				p += 4 + get_fixed (p, 4);
+			}
+			if (instr < 8) break;
+		}
+		if (page < 8) break;
+
+		// block is valid
+		memcpy (sg->instruments, header.instruments, 8 * sizeof (int));
+		memcpy (sg->volumes, header.volumes, 8 * sizeof (int));
+		sg->beats_per_bar = header.beats_per_bar;
+		sg->beat_type = header.beat_type;
+		sg->ticks_per_beat = header.ticks_per_beat;
+		sg->beats_per_minute = header.beats_per_minute;
+		sg->bpm_multiplier = header.bpm_multiplier;
+		sg->quantizer = header.quantizer;
+		sg->length = header.length;
+		for (i = 0; i < PACK_SEGMENTS; i++) if (seg [i] != NULL) segments [i] = seg [i];
+		valid = p - buf;
+	}
+
+	return valid;
+}
+
+
+// decode the settings and number of notes of a packed song into sg; notes are not decoded
+// returns 0 if ok, 1 if buffer does not contain a packed song
+int unpack_header (uint8_t * buf, int len, song_cache_t * sg) {
+
+	uint8_t *segments [PACK_SEGMENTS];
+
+	return ((walk_blocks (buf, len, sg, segments) == 0) ? 1 : 0);
+}
+
+
+// decode a packed song of len bytes into sg (sg->notes shall point to SONG_SIZE notes)
+// tracks are merged back into song order: by quantized time, note on before note off, then by instrument
+// returns the number of bytes of buf which have been decoded (see walk_blocks), 0 if data is invalid
+int unpack_song (uint8_t * buf, int len, song_cache_t * sg) {
+
+	uint8_t *segments [PACK_SEGMENTS];
+	uint8_t *p, *end;
+	note_t *tracks;						// notes decoded track by track, before merge
+	int start [9];						// index of first note of each track in tracks
+	int next [8];						// index of next note to merge for each track
+	uint32_t value, count, qtime, previous;
+	int ticks_per_bar, ticks_per_beat;
+	int i, instr, page, nb, best, valid;
+	note_t *a, *b;
+
+	valid = walk_blocks (buf, len, sg, segments);
+	if (valid == 0) return 0;
+
+	tracks = malloc ((sg->length + 1) * sizeof (note_t));
+	if (tracks == NULL) return 0;
+
+	ticks_per_beat = (int) sg->ticks_per_beat;
+	ticks_per_bar = (int) (sg->ticks_per_beat * sg->beats_per_bar);
+	nb = 0;
+
+	// decode the segments of each instrument, page after page: each track is then sorted
+	for (instr = 0; instr < 8; instr++) {
+		start [instr] = nb;
+		for (page = 0; page < 8; page++) {
+			p = segments [(instr * 8) + page];
+			if (p == NULL) continue;
+			end = p + 4 + get_fixed (p, 4);
+			p += 4;
+
+			if ((p = get_varint (p, end, &count)) == NULL) goto error;
+			if (nb + count > sg->length) goto error;
+
+			previous = page * 64 * ticks_per_bar;
+			for (i = 0; i < count; i++) {
+				memset (&tracks [nb], 0, sizeof (note_t));
+				tracks [nb].instrument = instr;
+
+				// quantized time
+				if ((p = get_varint (p, end, &qtime)) == NULL) goto error;
+				qtime = previous + unzigzag (qtime);
+				previous = qtime;
+				tracks [nb].qbar = qtime / ticks_per_bar;
+				tracks [nb].qtick = qtime % ticks_per_bar;
+				tracks [nb].qbeat = tracks [nb].qtick / ticks_per_beat;
+
+				// real time
+				if ((p = get_varint (p, end, &value)) == NULL) goto error;
+				value = qtime + unzigzag (value);
+				tracks [nb].bar = value / ticks_per_bar;
+				tracks [nb].tick = value % ticks_per_bar;
+				tracks [nb].beat = tracks [nb].tick / ticks_per_beat;
+
+				if (p + 3 > end) goto error;
+				tracks [nb].status = (*p & 0x80) ? MIDI_NOTEON : MIDI_NOTEOFF;
+				tracks [nb].key = *p++ & 0x7F;
+				tracks [nb].vel = *p++;
+				tracks [nb].color = *p++;
+				nb++;
+			}
+		}
+	}
+	start [8] = nb;
+	if (nb != sg->length) goto error;		// segments do not match song length given by last block
+
+	// merge tracks (each of them is sorted already)
+	for (instr = 0; instr < 8; instr++) next [instr] = start [instr];
+	for (i = 0; i < nb; i++) {
+		best = -1;
+		for (instr = 0; instr < 8; instr++) {
+			if (next [instr] == start [instr + 1]) continue;
+			if (best == -1) {
+				best = instr;
+				continue;
+			}
+			a = &tracks [next [instr]];
+			b = &tracks [next [best]];
+			if (a->qbar != b->qbar) {
+				if (a->qbar < b->qbar) best = instr;
+			}
+			else if (a->qtick != b->qtick) {
+				if (a->qtick < b->qtick) best = instr;
+			}
+			else if (a->status > b->status) best = instr;		// note on (0x90) before note off (0x80)
+		}
+		memcpy (&sg->notes [i], &tracks [next [best]++], sizeof (note_t));
+	}
+
+	free (tracks);
+	return valid;
+
+error:
+	free (tracks);
+	return 0;
+}
@@ -0,0 +1,9 @@
+/** @file pack.h
+ *
+ * @brief This file defines prototypes of functions inside pack.c
+ *
+ */
+
+int pack_song (song_cache_t *, uint8_t *, uint64_t);
+int unpack_header (uint8_t *, int, song_cache_t *);
+int unpack_song (uint8_t *, int, song_cache_t *);
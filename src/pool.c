@@ -0,0 +1,172 @@
+/** @file pool.c
+ *
+ * @brief Worker pool for whole-song passes (colors of bars and notes, transposition) run outside of process: the song is split
+ * in parts of consecutive notes, which are processed in parallel by the workers and the calling thread. Each part returns
+ * the segments it has changed (see PACK_SEGMENT), which are merged once all parts are done. Never to be used by process.
+ * A background thread also handles the occasional requests of process and of signal handlers (eg. dump of the event trace):
+ * it sleeps on a semaphore, which pool_post wakes up, instead of polling each request.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static pthread_t pool_threads [POOL_PARTS - 1];
+static int pool_workers = 0;					// number of workers started
+static pthread_mutex_t pool_run_mutex = PTHREAD_MUTEX_INITIALIZER;	// one pass at a time
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;		// protects the pass below
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;		// a pass has been posted
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;		// all workers are done with the pass
+static pool_job_t pool_job;						// pass being run
+static void *pool_arg;
+static int pool_length;
+static int pool_parts;
+static uint32_t pool_generation = 0;			// number of passes posted
+static int pool_pending;						// number of workers still running the pass
+static uint64_t pool_segments;					// segments changed by the workers
+static pthread_t pool_background_thread;
+static sem_t pool_wakeup;						// posted when there is a request for the background thread
+static volatile int pool_background_running = FALSE;
+
+
+// run part of the current pass
+static uint64_t pool_part (int part) {
+
+	return pool_job (part, (part * pool_length) / pool_parts, ((part + 1) * pool_length) / pool_parts, pool_arg);
+}
+
+
+// worker: wait for a pass, run its part, report the segments changed
+static void * pool_loop (void *arg) {
+
+	int part;
+	uint32_t generation;
+	uint64_t segments;
+
+	part = (int) (intptr_t) arg;
+	generation = 0;				// workers are started before the first pass
+	pthread_mutex_lock (&pool_mutex);
+	while (1) {
+		while (pool_generation == generation) pthread_cond_wait (&pool_start, &pool_mutex);
+		generation = pool_generation;
+		pthread_mutex_unlock (&pool_mutex);
+
+		segments = pool_part (part);
+
+		pthread_mutex_lock (&pool_mutex);
+		pool_segments |= segments;
+		if (--pool_pending == 0) pthread_cond_signal (&pool_done);
+	}
+
+	return NULL;
+}
+
+
+// run job on the notes [0, length) of the song, split in parts; the calling thread runs part 0
+// small songs are processed by the calling thread only, as waking up workers would cost more than the pass
+// returns the segments changed by all the parts
+uint64_t pool_run (pool_job_t job, void *arg, int length) {
+
+	uint64_t segments;
+
+	if ((pool_workers == 0) || (length < POOL_MIN_NOTES)) return job (0, 0, length, arg);
+
+	pthread_mutex_lock (&pool_run_mutex);
+	pthread_mutex_lock (&pool_mutex);
+	pool_job = job;
+	pool_arg = arg;
+	pool_length = length;
+	pool_parts = pool_workers + 1;
+	pool_pending = pool_workers;
+	pool_segments = 0;
+	pool_generation++;
+	pthread_cond_broadcast (&pool_start);
+	pthread_mutex_unlock (&pool_mutex);
+
+	segments = pool_part (0);
+
+	pthread_mutex_lock (&pool_mutex);
+	while (pool_pending > 0) pthread_cond_wait (&pool_done, &pool_mutex);
+	segments |= pool_segments;
+	pthread_mutex_unlock (&pool_mutex);
+	pthread_mutex_unlock (&pool_run_mutex);
+
+	return segments;
+}
+
+
+// number of parts a pass of length notes is split in
+int pool_size (int length) {
+
+	if ((pool_workers == 0) || (length < POOL_MIN_NOTES)) return 1;
+	return pool_workers + 1;
+}
+
+
+// wake up the background thread, to handle a request; safe to be called from process or from a signal handler
+void pool_post () {
+
+	if (pool_background_running) sem_post (&pool_wakeup);
+}
+
+
+// background thread: wait for requests, and hand them over to the modules; each module checks whether it has a request
+static void * pool_background (void *arg) {
+
+	while (1) {
+		if (sem_wait (&pool_wakeup) != 0) continue;		// interrupted by a signal
+		trace_work ();
+		latency_work ();
+		requant_work ();
+	}
+
+	return NULL;
+}
+
+
+// start the background thread, and one worker per core besides the calling thread (POOL_PARTS - 1 max)
+int pool_open () {
+
+	long cores;
+	int i;
+
+	if (!pool_background_running) {
+		sem_init (&pool_wakeup, 0, 0);
+		if (pthread_create (&pool_background_thread, NULL, pool_background, NULL) != 0) {
+			fprintf ( stderr, "Cannot start background thread\n" );
+			return FALSE;
+		}
+		pool_background_running = TRUE;
+	}
+
+	cores = sysconf (_SC_NPROCESSORS_ONLN);
+	if (cores > POOL_PARTS) cores = POOL_PARTS;
+	for (i = 0; i < cores - 1; i++) {
+		if (pthread_create (&pool_threads [i], NULL, pool_loop, (void *) (intptr_t) (i + 1)) != 0) {
+			fprintf ( stderr, "Cannot start worker thread\n" );
+			return FALSE;
+		}
+		pool_workers++;
+	}
+	return TRUE;
+}
@@ -0,0 +1,10 @@
+/** @file pool.h
+ *
+ * @brief This file defines prototypes of functions inside pool.c
+ *
+ */
+
+uint64_t pool_run (pool_job_t, void *, int);
+int pool_size (int);
+void pool_post ();
+int pool_open ();
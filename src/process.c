@@ -13,6 +13,61 @@
 #include "song.h"
 #include "disk.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+// play notes read from the song
+static void play_notes (note_t *notes_to_play, int lg) {
+
+	int i;
+	jack_midi_data_t buffer[5];
+
+	// go through the notes that we shall play
+	for (i=0; i<lg; i++) {
+		// note has been played live at its quantized time during this pass (see live.c): skip it this time only
+		if (notes_to_play [i].played) {
+			notes_to_play [i].played = FALSE;
+			continue;
+		}
+		// note was not played live; play it
+		buffer [0] = (notes_to_play [i].status) | (instr2chan (notes_to_play [i].instrument, midi_mode));
+		buffer [1] = notes_to_play [i].key;
+		buffer [2] = notes_to_play [i].vel;
+		// adjust velocity in case of fixed velocity && note-on
+		if ((is_velocity) && ((buffer [0] & 0xF0) == MIDI_NOTEON)) buffer [2] = DEFAULT_VELOCITY;
+		// play note only if note should be played (mute, solo, etc) or not note on
+		if (should_play (notes_to_play [i].instrument) || ((buffer [0] & 0xF0) != MIDI_NOTEON)) push_to_list (OUT, buffer);	// put in midisend buffer to play the note straight !
+	}
+}
+
+
+// send all notes off to all channels
+static void stop_notes () {
+
+	jack_midi_data_t buffer[5];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		buffer [0] = MIDI_CC | instr2chan (i, midi_mode);
+		buffer [1] = MIDI_CC_MUTE;
+		buffer [2] = 0x00;
+		// send midi command out to play note
+		push_to_list (OUT, buffer);
+		// midi events will be sent during the next process call
+	}	
+}
 
 
 // main process callback called at capture of (nframes) frames/samples
@@ -27,7 +82,22 @@ int process ( jack_nframes_t nframes, void *arg )
 	char ch;								// used to read keys from UI keyboard (not music MIDI keyboard)
 	note_t *notes_to_play;
 	int lg, bar, page;						// temp variables
+	int from_bar, from_tick;				// position from which song is read
 	double bpm;								// temp variable for tap tempo
+	uint64_t cycle_start, stage_start, read_start;	// timing statistics
+	jack_nframes_t cycle_frame;				// frame time of the start of the cycle (event trace)
+
+
+	cycle_start = stats_now ();
+	stage_start = cycle_start;
+	cycle_frame = jack_last_frame_time (client);
+	trace_event (TRACE_CYCLE_START, cycle_frame, nframes, NULL);
+
+	// a track has been requantized: switch to the requantized song
+	if (requant_pending ()) requant_swap ();
+
+	// a song has been loaded or saved: the journal restarts from it
+	if (journal_reset_pending ()) journal_reset_push ();
 
 
 	/***************************/
@@ -42,21 +112,27 @@ int process ( jack_nframes_t nframes, void *arg )
 	/*********************/
 	if (is_play) {
 
-		// read song to determine whether there are some notes to play
-		notes_to_play = read_from_song (previous_time_position.bar, previous_time_position.tick, time_position.bar, time_position.tick, &lg);
-
-		// go through the notes that we shall play
-		for (i=0; i<lg; i++) {
-			// note was not played live; play it
-			buffer [0] = (notes_to_play [i].status) | (instr2chan (notes_to_play [i].instrument, midi_mode));
-			buffer [1] = notes_to_play [i].key;
-			buffer [2] = notes_to_play [i].vel;
-			// adjust velocity in case of fixed velocity && note-on
-			if ((is_velocity) && ((buffer [0] & 0xF0) == MIDI_NOTEON)) buffer [2] = DEFAULT_VELOCITY;
-			// play note only if note should be played (mute, solo, etc) or not note on
-			if (should_play (notes_to_play [i].instrument) || ((buffer [0] & 0xF0) != MIDI_NOTEON)) push_to_list (OUT, buffer);	// put in midisend buffer to play the note straight !
+		// read song from previous position
+		from_bar = previous_time_position.bar;
+		from_tick = previous_time_position.tick;
+
+		// a cached song has been selected in load mode: finish current bar with current song, then switch to selected song
+		if ((cache_pending ()) && (previous_time_position.bar != time_position.bar)) {
+			notes_to_play = read_from_song (from_bar, from_tick, time_position.bar, 0, &lg);
+			play_notes (notes_to_play, lg);
+			stop_notes ();				// notes of current song would not get their note off
+			cache_swap ();
+			from_bar = time_position.bar;
+			from_tick = 0;
 		}
 
+		// read song to determine whether there are some notes to play
+		read_start = stats_now ();
+		notes_to_play = groove_read (from_bar, from_tick, time_position.bar, time_position.tick, &lg);
+		stats_stage (STATS_READ, read_start);
+		trace_notes (notes_to_play, lg, cycle_frame);
+		play_notes (notes_to_play, lg);
+
 		// play metronome
 		if (is_metronome) {
 			// read metronome to determine whether there are some notes to play
@@ -85,24 +161,25 @@ int process ( jack_nframes_t nframes, void *arg )
 			bar = time_position.bar % 64;
 
 			// check whether we are on the same page, or we need to move to a new page
+			// leds are not updated while file names are displayed (load mode), only UI state
 			if (page != ui_current_page) {
 				// display new page
 
 				// unlight previous pad 
 				ui_pages [ui_current_page] = LO_GREEN;
-				led_ui_page (ui_current_page);
+				if (!is_load) led_ui_page (ui_current_page);
 				
 				// light new pad
 				ui_current_page = page;		// ui_current_page is set to new pad
 				ui_pages [ui_current_page] = HI_GREEN;
-				led_ui_page (ui_current_page);
+				if (!is_load) led_ui_page (ui_current_page);
 
 				// display a full new page of bars for this instrument
-				led_ui_bars (ui_current_instrument, ui_current_page);
+				if (!is_load) led_ui_bars (ui_current_instrument, ui_current_page);
 			}
 
 			// display cursor on bar
-			led_ui_select (bar, bar);
+			if (!is_load) led_ui_select (bar, bar);
 		}
 		ui_current_bar = time_position.bar % 64;				// set ui current bar value between (0-63)
 		ui_limit1 = ui_current_bar;								// set selection as well (we are not in selection mode)
@@ -111,6 +188,7 @@ int process ( jack_nframes_t nframes, void *arg )
 		// copy current BBT position to previous BBT position
 		memcpy (&previous_time_position, &time_position, sizeof (jack_position_t));
 	}
+	stage_start = stats_stage (STATS_PLAY, stage_start);
 
 
 	/***************************************/
@@ -126,9 +204,15 @@ int process ( jack_nframes_t nframes, void *arg )
 			fprintf ( stderr, "Missed in event\n" );
 			continue;
 		}
+		trace_event (TRACE_KBD_IN, cycle_frame + in_event.time, 0, in_event.buffer);
+		// latency probes are not played nor recorded
+		if (latency_event (&in_event, cycle_frame + in_event.time)) continue;
 		// call processing function
 		kbd_midi_in_process (&in_event,nframes);
 	}
+	// send latency probes, if calibration is in progress
+	latency_cycle (cycle_frame);
+	stage_start = stats_stage (STATS_KBD_IN, stage_start);
 
 
 	/*******************************************/
@@ -146,6 +230,9 @@ int process ( jack_nframes_t nframes, void *arg )
 		// send midi stream
 		midi_write (midiout, 0, buffer);
 	}
+	// then live notes due during this cycle, at their frame offset
+	live_flush (midiout, cycle_frame, nframes);
+	stage_start = stats_stage (STATS_OUT, stage_start);
 
 
 	/*******************************************************/
@@ -155,6 +242,7 @@ int process ( jack_nframes_t nframes, void *arg )
 	// determine if clock shall be sent or not
 	if (send_clock_tick) {
 		buffer [0] = MIDI_CLOCK;
+		trace_event (TRACE_CLOCK, cycle_frame, 0, buffer);
 		push_to_list (CLK, buffer);	// put in midisend buffer to change channel volume
 	}
 
@@ -192,6 +280,7 @@ int process ( jack_nframes_t nframes, void *arg )
 		// send midi stream
 		midi_write (midiout, 0, buffer);
 	}
+	stage_start = stats_stage (STATS_CLOCK, stage_start);
 
 
 	/****************************************/
@@ -209,6 +298,7 @@ int process ( jack_nframes_t nframes, void *arg )
 		// send midi stream
 		midi_write (midiout, 0, buffer);
 	}
+	stage_start = stats_stage (STATS_KBD_OUT, stage_start);
 
 
 	/***************************************/
@@ -224,11 +314,20 @@ int process ( jack_nframes_t nframes, void *arg )
 			fprintf ( stderr, "Missed in event\n" );
 			continue;
 		}
+		trace_event (TRACE_UI_IN, cycle_frame + in_event.time, 0, in_event.buffer);
 		// call processing function
 		ui_midi_in_process (&in_event,nframes);
 	}
 
 
+	// cached song selected while not playing: switch straight
+	if ((cache_pending ()) && (!is_play)) cache_swap ();
+
+	// save directory has changed while file names are displayed: display them again
+	if ((is_load || is_save) && slots_changed) led_ui_files ();
+	stage_start = stats_stage (STATS_UI_IN, stage_start);
+
+
 	/***************************************/
 	/* Fifth, process MIDI out (UI) events */
 	/***************************************/
@@ -239,11 +338,15 @@ int process ( jack_nframes_t nframes, void *arg )
 	// clear midi write buffer
 	jack_midi_clear_buffer (midiout);
 
+	// pads whose color has changed during the cycle are added to the list of led requests
+	led_flush ();
+
 	//go through the list of led requests
 	while (pull_from_list (UI, buffer)) {
 		// send midi stream
 		midi_write (midiout, 0, buffer);
 	}
+	stage_start = stats_stage (STATS_UI_OUT, stage_start);
 
 
 	/**************************************/
@@ -257,6 +360,31 @@ int process ( jack_nframes_t nframes, void *arg )
 	switch (ch) {
 		case NO_KEY:	//ncurses has detected no keypress
 			break;
+		case TRACE_KEY:	// DUMP EVENT TRACE
+			trace_dump ();
+			break;
+		case STATS_KEY:	// PRINT COUNTERS OF MIDI OUT LISTS
+			stats_show ();
+			break;
+		case LATENCY_KEY:	// CALIBRATE LATENCY
+			latency_start ();
+			break;
+		case GROOVE_KEY:	// NEXT GROOVE
+			if ((is_load) || (is_save) || (instrument_bank) || (!is_quantized)) break;		// do not process if in load, save or instr selection modes, or in non-quantized mode
+			groove_next ();
+			break;
+		case GROOVE_USER_KEY:	// GROOVE FROM CURRENT BAR
+			if ((is_load) || (is_save) || (instrument_bank) || (!is_quantized)) break;		// do not process if in load, save or instr selection modes, or in non-quantized mode
+			groove_extract (ui_current_instrument, (ui_current_page * 64) + ui_current_bar);
+			break;
+		case GROOVE_PLAY_KEY:	// GROOVE AT PLAYBACK ON/OFF
+			if ((is_load) || (is_save) || (instrument_bank)) break;		// do not process if in load, save or instr selection modes
+			groove_play (!groove_is_playing ());
+			break;
+		case REQUANT_KEY:	// REQUANTIZE CURRENT INSTRUMENT
+			if ((is_load) || (is_save) || (instrument_bank)) break;		// do not process if in load, save or instr selection modes
+			requant_start (ui_current_instrument, quantizer, quantizer_off);
+			break;
 		case NUM_ENTER:	// PLAY
 		case SNUM_ENTER:
 			if ((is_load) || (is_save) || (instrument_bank)) break;		// do not process if in load, save or instr selection modes
@@ -291,6 +419,7 @@ int process ( jack_nframes_t nframes, void *arg )
 				default:
 					break;
 			}
+			groove_build ();		// grid of the groove follows the quantizer
 			break;
 		case NUM_DOT:	// RECORD
 		case SNUM_DOT:
@@ -406,23 +535,23 @@ int process ( jack_nframes_t nframes, void *arg )
 			is_load = is_load ? FALSE : TRUE;
 
 			if (is_load) {
-				is_play = FALSE;	// stop playing current song
-				stop_playing ();
-
+				// song keeps playing: a cached song is switched at next bar, other songs stop play when loaded
 				is_save = FALSE;
 				file_selected = 0xFF;
 				instrument_bank = 0;
+				cache_preload (-1);	// make sure songs next to current one are cached
 
 				// display screen with file names
 				led_ui_instruments (OFF);
 				led_ui_pages (OFF);
 				led_ui_files ();
 
-				// rest of loading is done in the main loop (outside process)
+				// rest of loading is done in the main loop (outside process), or in process for cached songs
 				// then, once loaded, UI falls back to standard bar mode
 			}
 			else {
 				// here, the user has pressed load again without selecting a file; we should go back to previous song state
+				cache_cancel ();
 				// light leds on the UI
 				led_ui_instruments (ON);
 				led_ui_pages (ON);
@@ -498,6 +627,9 @@ int process ( jack_nframes_t nframes, void *arg )
 		default:
 			break;
 	}
+	stats_stage (STATS_KEYS, stage_start);
+	stats_cycle (cycle_start, nframes);
+	trace_event (TRACE_CYCLE_END, cycle_frame, nframes, NULL);
 
 	return 0;
 }
@@ -508,7 +640,8 @@ int kbd_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 
 	uint8_t buffer [4];
 	note_t note;
-	int playnow;
+	int playnow, audible;
+	uint32_t qtick;
 
 
 	buffer [0] = event->buffer [0];
@@ -520,11 +653,9 @@ int kbd_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 		case MIDI_NOTEOFF:
 		case MIDI_NOTEON:
 
-			// fill-in note structure
+			// fill-in note structure, at the frame the event has been received, minus the round-trip latency (see latency.c)
 			note.instrument = ui_current_instrument;
-			note.bar = time_position.bar;
-			note.beat = time_position.beat;
-			note.tick = time_position.tick;
+			event_bbt (&time_position, nframes, (int) event->time - latency_offset (), &note);
 			note.qbar = note.bar;				// no quantization yet
 			note.qbeat = note.beat;
 			note.qtick = note.tick;
@@ -534,13 +665,33 @@ int kbd_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 
 			// this will fill the qbar/qbeat/qtick fields of the structure with quantized values
 			playnow = quantize_note (quantizer, quantizer_off, &note);
+
+			// the song has already been read up to the end of the cycle: a note quantized before it would not be played back any more
+			// with the groove applied at playback, it is read (and shall be scheduled) at its warped time, not at the grid time
+			note2tick (note, &qtick, TRUE);
+			qtick = groove_play_tick (qtick);
+			if (qtick < (time_position.bar * ticks_per_bar ()) + time_position.tick) playnow = TRUE;
 // for debug only
 //if (note.status == 0x90) printf ("ON , bar:%03d, beat:%d, tick:%04d, qbar:%03d, qbeat:%d, qtick:%04d, key:%d\r\n", note.bar, note.beat, note.tick, note.qbar, note.qbeat, note.qtick, note.key);
 //else printf ("OFF, bar:%03d, beat:%d, tick:%04d, qbar:%03d, qbeat:%d, qtick:%04d, key:%d\r\n", note.bar, note.beat, note.tick, note.qbar, note.qbeat, note.qtick, note.key);
 
+			// get midi channel from instrument number, and assign it to midi command
+			buffer [0] = (buffer [0] & 0xF0) | (instr2chan (ui_current_instrument, midi_mode));
+			// adjust velocity in case of fixed velocity && note-on
+			if ((is_velocity) && ((buffer [0] & 0xF0) == MIDI_NOTEON)) buffer [2] = DEFAULT_VELOCITY;
+			// play note only if note should be played (mute, solo, etc) or not note on
+			// means : we play notes off all the time, even if channel is muted 
+			audible = should_play (ui_current_instrument) || ((buffer [0] & 0xF0) != MIDI_NOTEON);
+
+			note.played = FALSE;
 			if (is_record && is_play) {			// record note
+				// note to be played in the future: play it at the frame of its quantized time, instead of waiting for the song to read it
+				if ((!playnow) && audible) note.played = live_schedule (jack_last_frame_time (client) + tick_offset (&time_position, nframes, qtick), buffer);
+
 				// write to song, with quantized values
 				write_to_song (note);
+				note.played = FALSE;			// mark only applies to the current pass
+				journal_note (&note);
 
 				// we have recorded something in the bar : set bar to a color
 				if (ui_bars [ui_current_instrument][note.qbar / 64][note.qbar % 64] == BLACK) {
@@ -551,19 +702,9 @@ int kbd_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 			// play the music straight, except if we are in play mode + recording, and that note should be played in the future
 			// in case we shall play the note now (while playing and recording), play it
 			// in case we don't play or don't record, play it straight as well
-			if (!is_record || !is_play || playnow) {
-				// play the music straight
-				// get midi channel from instrument number, and assign it to midi command
-				buffer [0] = (buffer [0] & 0xF0) | (instr2chan (ui_current_instrument, midi_mode));
-				// play note only if note should be played (mute, solo, etc) or not note on
-				// means : we play notes off all the time, even if channel is muted 
-				if (should_play (ui_current_instrument) || ((buffer [0] & 0xF0) != MIDI_NOTEON)) {
-
-					// adjust velocity in case of fixed velocity && note-on
-					if ((is_velocity) && ((buffer [0] & 0xF0) == MIDI_NOTEON)) buffer [2] = DEFAULT_VELOCITY;
-					push_to_list (OUT, buffer);	// put in midisend buffer to play the note straight !
-				}
-			}			
+			if ((!is_record || !is_play || playnow) && audible) {
+				push_to_list (OUT, buffer);	// put in midisend buffer to play the note straight !
+			}
 			break;
 
 		case MIDI_CC:
@@ -573,6 +714,7 @@ int kbd_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 			if (buffer [1] < 8) {
 				volume_list [buffer[1]] = buffer [2];	// set new volume
 				set_volume (buffer [1], buffer [2]);
+				journal_volume (buffer [1], buffer [2]);
 			}
 			break;
 	}
@@ -736,7 +878,15 @@ int ui_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 			else {
 				key = midi2bar (key);	// convert pad number to position in table
 
-				if ((is_load) || (is_save)) {		// save or load mode: get file name
+				if (is_load) {						// load mode: switch to cached song, or get file name
+					if (cache_select (key)) break;
+					is_play = FALSE;				// song shall be loaded from disk: stop playing current song
+					stop_playing ();
+					file_selected = key;
+					break;
+				}
+
+				if (is_save) {						// save mode: get file name
 					file_selected = key;
 					break;
 				}
@@ -751,6 +901,7 @@ int ui_midi_in_process (jack_midi_event_t *event, jack_nframes_t nframes) {
 
 					// set new midi instrument
 					set_instrument (ui_current_instrument, instrument_list [ui_current_instrument]);
+					journal_program (ui_current_instrument, instrument_list [ui_current_instrument]);
 					break;
 				}
 
@@ -813,6 +964,9 @@ void bar_process (int mode) {
 		if (is_play) return;
 		// if keypresses in progress, do nothing
 		if ((ui_limit1_pressed) || (ui_limit2_pressed)) return;
+
+		// keep track of the operation, to be able to recover the song after a crash
+		journal_edit (mode);
 			
 		blimit1 = ui_limit1 + (ui_current_page * 64);		// determine start bar number from page num
 		blimit2 = ui_limit2 + (ui_current_page * 64);		// determine end bar number from page num
@@ -936,12 +1090,32 @@ void bar_process (int mode) {
 // function used to transpose +/- an insrument in a song (half a tone each time)
 void transpo_process (int instr, int mode) {
 
-	int i;
+	int arg [2];
 
-	// read through all the song
-	for (i = 0; i < song_length; i++){
+	// keep track of the operation, to be able to recover the song after a crash
+	journal_transpo (instr, mode);
+
+	// read through all the song; process does not use the worker pool
+	arg [0] = instr;
+	arg [1] = mode;
+	set_dirty_segments (transpo_part (0, 0, song_length, arg));
+	return;
+}
+
+
+// transpose a part of the song: arg is the instrument and the mode; returns the segments changed
+uint64_t transpo_part (int part, int from, int to, void *arg) {
+
+	int i, instr, mode;
+	uint64_t segments;
+
+	instr = ((int *) arg) [0];
+	mode = ((int *) arg) [1];
+	segments = 0;
+	for (i = from; i < to; i++){
 		// check if note has the right instrument
 		if (song [i].instrument == instr) {
+			segments |= PACK_SEGMENT (instr, song [i].qbar / 64);
 			if (mode == PLUS) {
 				// Plus 1/2 tone (check boundaries)
 				if (song [i].key < 0x7F) song [i].key++;
@@ -952,7 +1126,18 @@ void transpo_process (int instr, int mode) {
 			}
 		}
 	}
-	return;
+	return segments;
+}
+
+
+// transpose an instrument outside of process (eg. recovery from the journal): parts of the song are transposed in parallel
+void transpo_song (int instr, int mode) {
+
+	int arg [2];
+
+	arg [0] = instr;
+	arg [1] = mode;
+	set_dirty_segments (pool_run (transpo_part, arg, song_length));
 }
 
 
@@ -986,7 +1171,6 @@ void start_playing () {
 void stop_playing () {
 
 	jack_midi_data_t buffer[5];				// midi out buffer for lighting the pad leds and for midi clock
-	int i;
 
 	// clear selection if play mode in progress
 	ui_limit1 = ui_current_bar;
@@ -996,15 +1180,9 @@ void stop_playing () {
 	// display between limit 1 and 2
 	ui_current_bar = led_ui_select (ui_limit1, ui_limit2);
 
-	// send all notes off to all channels
-	for (i = 0; i < 8; i++) {
-		buffer [0] = MIDI_CC | instr2chan (i, midi_mode);
-		buffer [1] = MIDI_CC_MUTE;
-		buffer [2] = 0x00;
-		// send midi command out to play note
-		push_to_list (OUT, buffer);
-		// midi events will be sent during the next process call
-	}	
+	// send all notes off to all channels; live notes waiting to be played are dropped
+	stop_notes ();
+	live_clear ();
 
 	// send midi stop
 	buffer [0] = MIDI_STOP;
@@ -9,5 +9,7 @@ int kbd_midi_in_process (jack_midi_event_t *, jack_nframes_t);
 int ui_midi_in_process (jack_midi_event_t *, jack_nframes_t);
 void bar_process (int);
 void transpo_process (int, int);
+uint64_t transpo_part (int, int, int, void *);
+void transpo_song (int, int);
 void start_playing ();
 void stop_playing ();
@@ -0,0 +1,177 @@
+/** @file requant.c
+ *
+ * @brief Requantization of a track of the current song, while playing. The background thread (see pool.c) takes a copy
+ * of the song (version checked with song_changes, so that a copy made while process changes the song is made again),
+ * quantizes it again from the raw timing of its notes into a second song buffer; process switches to this buffer at the start
+ * of a cycle, provided the song has not changed in the meantime (otherwise the thread starts again). Both are retried
+ * REQUANT_RETRIES times at most.
+ * Process never copies the song.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static note_t *requant_buffer = NULL;			// spare song buffer (SONG_SIZE notes)
+static note_t *requant_copy = NULL;				// copy of the song to be requantized (SONG_SIZE notes)
+static volatile int requant_request = -1;		// requested requantization (instrument, quantizers: see REQUANT_REQUEST), -1 if none
+static volatile int requant_busy = FALSE;		// TRUE from the request until the requantized song is switched to or dropped
+static int requant_retries;						// number of times the requantized song has been dropped because the song has changed
+static note_t * volatile requant_ready = NULL;	// requantized song, to be switched to by process
+static int requant_done;						// request the requantized song corresponds to
+static note_t *requant_from;					// song the copy has been taken from
+static uint32_t requant_version;				// and the version of this song (song_changes)
+static int requant_length;
+
+
+// request the requantization of track instr with quantizers quant_on (notes on) and quant_off (notes off); called from process
+// the song is copied by the thread; request is ignored if one is in progress
+void requant_start (int instr, int quant_on, int quant_off) {
+
+	if ((requant_copy == NULL) || (requant_busy)) return;
+
+	requant_busy = TRUE;
+	requant_retries = 0;
+	__sync_synchronize ();
+	requant_request = REQUANT_REQUEST (instr, quant_on, quant_off);
+	pool_post ();
+}
+
+
+// TRUE if a requantized song is waiting to be switched to
+int requant_pending () {
+
+	return (requant_ready != NULL);
+}
+
+
+// track instr of the song has been requantized: its segments are saved again, and bars with notes shall not be black
+static void requant_track (int instr) {
+
+	int page, i;
+
+	for (page = 0; page < 8; page++) set_dirty (instr, page * 64);
+	for (i = 0; i < song_length; i++) {
+		if ((song [i].instrument == instr) && (ui_bars [instr][song [i].qbar / 64][song [i].qbar % 64] == BLACK)) {
+			ui_bars [instr][song [i].qbar / 64][song [i].qbar % 64] = LO_YELLOW;
+		}
+	}
+}
+
+
+// switch to the requantized song; called from process at the start of a cycle
+// if the song has changed since the track has been requantized, it is requantized again
+void requant_swap () {
+
+	note_t *notes;
+	int request, instr;
+
+	notes = requant_ready;
+	if (notes == NULL) return;
+	request = requant_done;
+	requant_ready = NULL;
+
+	// song has changed: the thread starts again from the current song, unless it keeps changing (eg. recording)
+	if ((song != requant_from) || (song_changes != requant_version) || (song_length != requant_length)) {
+		if (++requant_retries >= REQUANT_RETRIES) requant_busy = FALSE;
+		else {
+			requant_request = request;
+			pool_post ();
+		}
+		return;
+	}
+	requant_busy = FALSE;
+
+	// former song becomes the spare buffer; notes waiting to be played live are played back by the song instead
+	live_clear ();
+	requant_buffer = song;
+	song = notes;
+
+	instr = REQUANT_INSTR (request);
+	requant_track (instr);
+	if ((instr == ui_current_instrument) && (!is_load) && (!is_save) && (!instrument_bank)) led_ui_bars (ui_current_instrument, ui_current_page);
+
+	journal_requant (instr, REQUANT_ON (request), REQUANT_OFF (request));
+}
+
+
+// requantize a track of the current song straight; process shall not modify the song meanwhile (eg. recovery from the journal)
+void requant_song (int instr, int quant_on, int quant_off) {
+
+	note_t *notes;
+
+	if (requant_buffer == NULL) return;
+	requantize (song, song_length, requant_buffer, instr, quant_on, quant_off);
+	notes = song;
+	song = requant_buffer;
+	requant_buffer = notes;
+	requant_track (instr);
+}
+
+
+// copy the song, with its version; the copy is made again if process has changed the song meanwhile
+// returns FALSE if the song has kept changing
+static int requant_snapshot () {
+
+	int i;
+
+	for (i = 0; i < REQUANT_RETRIES; i++) {
+		requant_version = song_changes;
+		__sync_synchronize ();
+		requant_from = song;
+		requant_length = song_length;
+		memcpy (requant_copy, requant_from, requant_length * sizeof (note_t));
+		__sync_synchronize ();
+		// a change in progress is seen at the latest by requant_swap, as song_changes is incremented once the song is changed
+		if ((song_changes == requant_version) && (song == requant_from) && (song_length == requant_length)) return TRUE;
+	}
+	return FALSE;
+}
+
+
+// copy the song, requantize the track into the spare buffer, then hand it over to process; called from the background thread (see pool.c)
+void requant_work () {
+
+	int request;
+
+	request = requant_request;
+	if ((request == -1) || (!__sync_bool_compare_and_swap (&requant_request, request, -1))) return;
+	if (!requant_snapshot ()) {
+		requant_busy = FALSE;		// request is dropped
+		return;
+	}
+	requantize (requant_copy, requant_length, requant_buffer, REQUANT_INSTR (request), REQUANT_ON (request), REQUANT_OFF (request));
+	requant_done = request;
+	__sync_synchronize ();
+	requant_ready = requant_buffer;
+}
+
+
+// allocate the spare song buffer and the copy of the song; requests are handled by the background thread (see pool.c)
+int requant_open () {
+
+	requant_buffer = malloc (SONG_SIZE * sizeof (note_t));
+	requant_copy = malloc (SONG_SIZE * sizeof (note_t));
+	if ((requant_buffer == NULL) || (requant_copy == NULL)) return FALSE;
+	return TRUE;
+}
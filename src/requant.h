@@ -0,0 +1,12 @@
+/** @file requant.h
+ *
+ * @brief This file defines prototypes of functions inside requant.c
+ *
+ */
+
+void requant_start (int, int, int);
+int requant_pending ();
+void requant_swap ();
+void requant_song (int, int, int);
+void requant_work ();
+int requant_open ();
@@ -0,0 +1,211 @@
+/** @file slot.c
+ *
+ * @brief Index of save slots. It is built once at startup, then kept up to date by a thread watching the save directory (inotify).
+ * This thread is then the only one writing the index; process and the cache thread only read it.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static char slot_directory [255];			// save directory being watched
+static int slot_fd = -1;					// inotify file descriptor
+static pthread_t slot_thread;
+static int slot_watching = FALSE;			// TRUE if the slot thread keeps the index up to date
+
+
+// convert a file name to a slot number: file name shall start with 2 hex digits (upper case, as written by save) followed by a dot
+// returns -1 if file name does not correspond to a slot
+static int name2slot (const char * name) {
+
+	int i, slot, digit;
+
+	slot = 0;
+	for (i = 0; i < 2; i++) {
+		if ((name [i] >= '0') && (name [i] <= '9')) digit = name [i] - '0';
+		else if ((name [i] >= 'A') && (name [i] <= 'F')) digit = name [i] - 'A' + 10;
+		else return -1;
+		slot = (slot * 16) + digit;
+	}
+	if ((name [2] != '.') || (slot >= 64)) return -1;
+	return slot;
+}
+
+
+// read song length and tempo from the beginning of a json save file, without parsing the whole file
+// song_length and tempo are written before the notes by save ()
+static void read_json_info (char * filename, slot_t * slot) {
+
+	FILE *fp;
+	char buffer [4096];
+	char *p;
+	int len;
+
+	fp = fopen (filename, "rt");
+	if (fp == NULL) return;
+	len = fread (buffer, 1, sizeof (buffer) - 1, fp);
+	fclose (fp);
+	buffer [len] = 0;
+
+	p = strstr (buffer, "\"song_length\"");
+	if ((p != NULL) && ((p = strchr (p, ':')) != NULL)) slot->nb_notes = atoi (p + 1);
+	p = strstr (buffer, "\"ticks_beats_per_minute\"");
+	if ((p != NULL) && ((p = strchr (p, ':')) != NULL)) slot->bpm = atof (p + 1);
+}
+
+
+// read song length and tempo from a compact save file (settings of the last block)
+static void read_pak_info (char * filename, slot_t * slot) {
+
+	FILE *fp;
+	uint8_t *buffer;
+	song_cache_t sg;
+	int len;
+
+	fp = fopen (filename, "rb");
+	if (fp == NULL) return;
+	buffer = malloc (PACK_SIZE);
+	if (buffer == NULL) {
+		fclose (fp);
+		return;
+	}
+	len = fread (buffer, 1, PACK_SIZE, fp);
+	fclose (fp);
+
+	if (unpack_header (buffer, len, &sg) == 0) {
+		slot->nb_notes = sg.length;
+		slot->bpm = sg.beats_per_minute;
+	}
+	free (buffer);
+}
+
+
+// refresh metadata of a single slot from the files in the save directory
+static void slot_update (int slot) {
+
+	char filename [sizeof (slot_directory) + 16];		// directory, "/", slot and extension
+	struct stat st;
+	slot_t info;
+	time_t json_mtime;
+
+	memset (&info, 0, sizeof (slot_t));
+	info.nb_notes = -1;						// unknown until read from the file
+
+	sprintf (filename, "%s/%02X.mid", slot_directory, slot);
+	if (stat (filename, &st) == 0) {
+		info.exists = TRUE;
+		info.size = st.st_size;
+		info.mtime = st.st_mtime;
+	}
+
+	// song file has priority over midi file, as this is the one that gets loaded
+	sprintf (filename, "%s/%02X.json", slot_directory, slot);
+	json_mtime = 0;
+	if (stat (filename, &st) == 0) {
+		info.exists = TRUE;
+		info.size = st.st_size;
+		info.mtime = st.st_mtime;
+		json_mtime = st.st_mtime;
+		read_json_info (filename, &info);
+	}
+
+	// compact song file has priority over json file if it is more recent (same as load)
+	sprintf (filename, "%s/%02X.pak", slot_directory, slot);
+	if ((stat (filename, &st) == 0) && (st.st_mtime >= json_mtime)) {
+		info.exists = TRUE;
+		info.size = st.st_size;
+		info.mtime = st.st_mtime;
+		read_pak_info (filename, &info);
+	}
+
+	memcpy (&save_slots [slot], &info, sizeof (slot_t));
+	cache_invalidate (slot);				// song cache shall decode the slot again
+	slots_changed = TRUE;
+}
+
+
+// a slot has been saved: refresh its metadata
+// when the directory is watched, the slot thread sees the files written by the save, and the index is left to it
+void slot_refresh (int slot) {
+
+	if (!slot_watching) slot_update (slot);
+}
+
+
+// thread watching the save directory: any file created, deleted, moved or written refreshes the corresponding slot
+static void * slot_loop (void *arg) {
+
+	char buffer [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	struct inotify_event *event;
+	char *p;
+	int len, slot;
+
+	while ((len = read (slot_fd, buffer, sizeof (buffer))) > 0) {
+		for (p = buffer; p < buffer + len; p += sizeof (struct inotify_event) + event->len) {
+			event = (struct inotify_event *) p;
+			if (event->len == 0) continue;
+			slot = name2slot (event->name);
+			if (slot != -1) slot_update (slot);
+		}
+	}
+
+	return NULL;
+}
+
+
+// build the index of save slots for directory, then start watching the directory for changes
+// returns FALSE if directory could not be read
+int slot_index_open (char * directory) {
+
+	DIR *dir;
+	struct dirent *ent;
+	int slot;
+
+	strncpy (slot_directory, directory, sizeof (slot_directory) - 1);
+	memset (save_slots, 0, 64 * sizeof (slot_t));
+
+	// build the index once
+	if ((dir = opendir (directory)) == NULL) {
+		fprintf ( stderr, "Directory not found.\n" );
+		return FALSE;
+	}
+	while ((ent = readdir (dir)) != NULL) {
+		slot = name2slot (ent->d_name);
+		if ((slot != -1) && (!save_slots [slot].exists)) slot_update (slot);
+	}
+	closedir (dir);
+
+	// then keep it up to date
+	slot_fd = inotify_init ();
+	if ((slot_fd < 0) || (inotify_add_watch (slot_fd, directory, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO) < 0)) {
+		fprintf ( stderr, "Cannot watch save directory; changes done outside of compo will not be seen.\n" );
+		return TRUE;
+	}
+	if (pthread_create (&slot_thread, NULL, slot_loop, NULL) != 0) {
+		fprintf ( stderr, "Cannot start save directory thread\n" );
+		return TRUE;
+	}
+	slot_watching = TRUE;
+
+	return TRUE;
+}
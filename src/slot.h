@@ -0,0 +1,8 @@
+/** @file slot.h
+ *
+ * @brief This file defines prototypes of functions inside slot.c
+ *
+ */
+
+void slot_refresh (int);
+int slot_index_open (char *);
@@ -12,6 +12,36 @@
 #include "song.h"
 #include "disk.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+// mark the segment of the song containing bar of instr as changed, so it is written by the next incremental save
+void set_dirty (int instr, int bar) {
+
+	dirty_segments |= PACK_SEGMENT (instr, bar / 64);
+	song_changes++;
+}
+
+
+// segments (see PACK_SEGMENT) have been changed, if any
+void set_dirty_segments (uint64_t segments) {
+
+	if (segments == 0) return;
+	dirty_segments |= segments;
+	song_changes++;
+}
 
 
 // write a note to song structure; insert it to the right place
@@ -59,6 +89,7 @@ void write_to_song (note_t note) {
 	// copy note in the empty space
 	memcpy (&song [i], &note, sizeof (note_t));									// memcpy is fine as no overlapping in memory
 	song_length++;
+	set_dirty (note.instrument, note.qbar);
 }
 
 
@@ -193,215 +224,6 @@ note_t * read_from (note_t* sg, int lg, u_int16_t b_limit1, u_int16_t t_limit1,
 }
 
 
-// for debug use only
-void test_copy_paste () {
-
-	test_write ();
-
-
-	copy (0, 1, 1);
-	display_song (copy_length, copy_buffer, "test: copy area that does not exist");
-
-	copy (3, 4, 1);
-	display_song (copy_length, copy_buffer, "test: copy 1st bar that exists but instr does not exist");
-
-	copy (3, 4, 2);
-	display_song (copy_length, copy_buffer, "test: copy 1st bar that exists and instr does exist");
-
-	copy (4, 5, 7);
-	display_song (copy_length, copy_buffer, "test: copy bar that exists and instr does exist");
-
-	copy (4, 5, 2);
-	display_song (copy_length, copy_buffer, "test: copy 2 bars in the middle of song");
-
-	copy (6, 7, 2);
-	display_song (copy_length, copy_buffer, "test: copy 2 bars at end of song");
-
-
-
-	cut (0, 1, 1);
-	display_song (song_length, song, "0, 1, 1 test: cut area that does not exist");
-	paste (10, 1 , 7, PASTE);
-	display_song (song_length, song, "10, 7 test: try to paste bar 10, instr 7");
-
-	cut (3, 4, 1);
-	display_song (song_length, song, "3, 4, 1 test: cut 1st bar that exists but instr does not exist");
-	paste (10, 1 , 7, PASTE);
-	display_song (song_length, song, "10, 7 test: try to paste bar 10, instr 7");
-
-	cut (3, 4, 2);
-	display_song (song_length, song, "3, 4, 2 test: cut 1st bar that exists and instr does exist");
-	paste (10, 1, 1, PASTE);
-	display_song (song_length, song, "10, 1 test: paste bar 10, instr 7");
-
-	cut (4, 5, 7);
-	display_song (song_length, song, "4, 5, 7 test: cut bar that exists and instr does exist");
-	paste (4, 1, 7, PASTE);
-	display_song (song_length, song, "4, 7 test: paste same place, same instr");
-
-	cut (4, 5, 2);
-	display_song (song_length, song, "4, 5, 2 test: cut 2 bars in the middle of song");
-	paste (2, 1, 0, PASTE);
-	display_song (song_length, song, "2, 0 test: paste 1st bar of song");
-
-	cut (6, 7, 2);
-	display_song (song_length, song, "6, 7, 2 test: cut 2 bars near end of song");
-	paste (5, 1, 1, PASTE);
-	display_song (song_length, song, "5, 1 test: paste in middle of song");
-
-	cut (5, 20, 1);
-	display_song (song_length, song, "5, 20, 1 test: cut 3 bars mid of song");
-	display_song (copy_length, copy_buffer, "test: content of copy buffer");
-	paste (30, 15, 2, PASTE);
-	display_song (song_length, song, "30, 2 test: paste at end of song");
-
-	cut (29, 31, 2);
-	display_song (song_length, song, "29, 31, 2 test: cut 3 bars near end of song");
-	display_song (copy_length, copy_buffer, "test: content of copy buffer");
-	paste (0, 2, 6, PASTE);
-	display_song (song_length, song, "0, 6 test: paste at start of song, bar shall be 1");
-}
-
-
-// for debug use only
-void test_write () {
-
-	note_t note;
-
-	note.bar =5;
-	note.beat =1;
-	note.tick =480;
-	note.qbar =5;
-	note.qbeat =1;
-	note.qtick =480;
-	note.instrument =1;
-	write_to_song (note);
-	display_song (song_length, song, "test: insert 1st note in song");
-
-	note.bar =6;
-	note.beat =0;
-	note.tick =0;
-	note.qbar =6;
-	note.qbeat =0;
-	note.qtick =0;
-	note.instrument =2;
-	write_to_song (note);
-	display_song (song_length, song, "insert note at end of song");
-
-	note.bar =3;
-	note.beat =2;
-	note.tick =960;
-	note.qbar =3;
-	note.qbeat =2;
-	note.qtick =960;
-	note.instrument =2;
-	write_to_song (note);
-	display_song (song_length, song, "insert note at beginning of song");
-
-	note.bar =4;
-	note.beat =2;
-	note.tick =960;
-	note.qbar =4;
-	note.qbeat =2;
-	note.qtick =960;
-	note.instrument =2;
-	write_to_song (note);
-	display_song (song_length, song, "insert note between 2 bars");
-
-	note.bar =4;
-	note.beat =2;
-	note.tick =960;
-	note.qbar =4;
-	note.qbeat =2;
-	note.qtick =960;
-	note.instrument =2;
-	write_to_song (note);
-	display_song (song_length, song, "insert note same as previous");
-
-	note.bar =4;
-	note.beat =2;
-	note.tick =961;
-	note.qbar =4;
-	note.qbeat =2;
-	note.qtick =961;
-	note.instrument =7;
-	write_to_song (note);
-	display_song (song_length, song, "insert note same bar, higher tick");
-
-	note.bar =4;
-	note.beat =1;
-	note.tick =959;
-	note.qbar =4;
-	note.qbeat =1;
-	note.qtick =959;
-	note.instrument =7;
-	write_to_song (note);
-	display_song (song_length, song, "insert note same bar, lower tick");
-
-	note.bar =4;
-	note.beat =2;
-	note.tick =960;
-	note.qbar =4;
-	note.qbeat =2;
-	note.qtick =960;
-	note.instrument =3;
-	write_to_song (note);
-	display_song (song_length, song, "insert note same as previous, with higher instr");
-
-	note.bar =4;
-	note.beat =2;
-	note.tick =960;
-	note.qbar =4;
-	note.qbeat =2;
-	note.qtick =960;
-	note.instrument =0;
-	write_to_song (note);
-	display_song (song_length, song, "insert note same as previous, with lower instr");
-
-	note.bar =6;
-	note.beat =3;
-	note.tick =1440;
-	note.qbar =6;
-	note.qbeat =3;
-	note.qtick =1440;
-	note.instrument =2;
-	write_to_song (note);
-	display_song (song_length, song, "insert note at end of song");
-
-}
-
-
-// for debug use only
-void test_read () {
-
-	note_t *note;
-	int length;
-
-	note = read_from_song (1, 0, 1, 480, &length);
-	display_song (length, note, "read note that does not exist (before 1st bar)");
-	note = read_from_song (7, 0, 7, 480, &length);
-	display_song (length, note, "read note that does not exist (after last bar)");
-	note = read_from_song (3, 0, 3, 960, &length);
-	display_song (length, note, "read note that does not exist in the middle of song");
-	note = read_from_song (3, 0, 3, 961, &length);
-	display_song (length, note, "read 1 note");
-	note = read_from_song (3, 960, 4, 960, &length);
-	display_song (length, note, "read 2 notes");
-	note = read_from_song (3, 0, 6, 1500, &length);
-	display_song (length, note, "read all notes of song");
-	note = read_from_song (4, 0, 4, 1260, &length);
-	display_song (length, note, "read bar 4 only");
-	note = read_from_song (4, 960, 4, 960, &length);
-	display_song (length, note, "read bar 4, tick 960 only; no result as end limit is exclusive");
-	note = read_from_song (4, 960, 4, 961, &length);
-	display_song (length, note, "read bar 4, tick 960 only");
-	note = read_from_song (6, 1450, 6, 1900, &length);
-	display_song (length, note, "read note that does not exist, at end of song");
-	note = read_from_song (6, 1450, 20, 1900, &length);
-	display_song (length, note, "read note that does not exist, at end of song (and bar does not even exist)");
-}
-
-
 // for debug use only
 void display_song (int lg, note_t *sg, char * st) {
 	int i;
@@ -435,14 +257,16 @@ void copy_cut (u_int16_t b_limit1, u_int16_t b_limit2, int instr, int mode) {
 			if ((mode == COPY) || (mode == CUT)) {
 				// copy the note to the copy buffer
 				memcpy (&copy_buffer [copy_length], &note [i], sizeof (note_t));		// no issue in using memcpy as memory should not overlap
-				// correct the bar number in copy buffer so bar_limit1 is now 0
+				// correct the bar number in copy buffer so bar_limit1 is now 0 (raw bar as well, it may become negative)
 				copy_buffer [copy_length].qbar = copy_buffer [copy_length].qbar - b_limit1;
+				copy_buffer [copy_length].bar = copy_buffer [copy_length].bar - b_limit1;
 				copy_length++;
 			}
 
 			if ((mode == CUT) || (mode == DEL)) {
 				// set 0xFFFF in bar number of note, so we can erase it afterwards
 				note [i].bar = 0xFFFF;
+				set_dirty (instr, note [i].qbar);
 			}
 		}
 	}
@@ -498,7 +322,7 @@ void cut (u_int16_t b_limit1, u_int16_t b_limit2, int instr) {
 void paste (u_int16_t b_limit1, int nb_bars_to_clear, int instr, int mode) {
 
 	note_t note;		// temp note
-	int i;
+	int i, bar;
 	uint16_t b_limit2;	// exclusive limit where to stop erasing
 
 	// make sure copy_buffer has some content; if not, then leave
@@ -516,7 +340,14 @@ void paste (u_int16_t b_limit1, int nb_bars_to_clear, int instr, int mode) {
 		// take note from copy_buffer and store it in a temporary space
 		memcpy (&note, &copy_buffer [i], sizeof (note_t));
 		// correct bar so it matches to destination bar, correct instrument to match destination instrument
-		note.bar += b_limit1;
+		// raw time before the start of the song (note played early, quantized to bar 0) is set to the start of the song
+		bar = (int16_t) note.bar + b_limit1;
+		if (bar < 0) {
+			note.bar = 0;
+			note.beat = 0;
+			note.tick = 0;
+		}
+		else note.bar = bar;
 		note.qbar += b_limit1;
 		note.instrument = instr;
 		// add to song
@@ -601,3 +432,683 @@ void create_metronome () {
 		memcpy (&metronome [(i*8) + 7], &note, sizeof (note_t));
 	}
 }
+
+
+/*****************************/
+/* requantization of a track */
+/*****************************/
+
+static note_t requant_notes [SONG_SIZE];		// notes of the track being requantized
+static uint64_t requant_order [SONG_SIZE];		// raw time of each note of the track (high 32 bits), and its index in requant_notes
+
+
+static int compare_order (const void *a, const void *b) {
+
+	const uint64_t *oa = a, *ob = b;
+
+	return (*oa > *ob) - (*oa < *ob);
+}
+
+
+// TRUE if note a comes before note b in a song: sorted by qbar, qtick, then note-on before note-off (same as write_to_song)
+static int note_before (note_t * a, note_t * b) {
+
+	if (a->qbar != b->qbar) return (a->qbar < b->qbar);
+	if (a->qtick != b->qtick) return (a->qtick < b->qtick);
+	return (a->status > b->status);
+}
+
+
+// quantize again the notes of instrument instr of song src (length notes), from their raw timing, with the rules of quantize_note:
+// a note-on is quantized from the previous note-on of the instrument, a note-off from the note-on of the same key (open note)
+// notes are processed in a single pass in raw time order, instead of the order they have been recorded in; src is not modified
+// the requantized song is written to dst (sorted); returns its length
+int requantize (note_t * src, int length, note_t * dst, int instr, int quant_on, int quant_off) {
+
+	note_t *note;
+	int32_t open [128];			// quantized tick of the note-on of each key which has not been released yet, -1 if none
+	int32_t prev_on, q, d, max;
+	uint32_t tick;
+	int i, j, k, nb;
+
+	// notes of the track, in raw time order (notes of the same time keep their order)
+	nb = 0;
+	for (i = 0; i < length; i++) {
+		if (src [i].instrument != instr) continue;
+		note2tick (src [i], &tick, FALSE);
+		requant_order [nb] = ((uint64_t) tick << 32) | nb;
+		memcpy (&requant_notes [nb], &src [i], sizeof (note_t));
+		nb++;
+	}
+	qsort (requant_order, nb, sizeof (uint64_t), compare_order);
+
+	// single pass with the table of open notes
+	max = (512 * ticks_per_bar ()) - 1;		// last tick of the song
+	prev_on = -1;
+	for (i = 0; i < 128; i++) open [i] = -1;
+	for (i = 0; i < nb; i++) {
+		note = &requant_notes [requant_order [i] & 0xFFFFFFFF];
+		tick = requant_order [i] >> 32;
+
+		if (note->status == MIDI_NOTEON) {
+			if (prev_on < 0) q = quantize (tick, quant_on);					// first note-on of the track: quantized on its own
+			else {
+				d = tick - prev_on;
+				if (d < 0) d = 0;
+				q = prev_on + quantize (d, quant_on);						// time difference with the previous note-on is quantized
+			}
+			if (q > max) q = max;
+			prev_on = q;
+			open [note->key & 0x7F] = q;
+		}
+		else {
+			if (open [note->key & 0x7F] < 0) q = quantize (tick, quant_off);	// no note-on: quantized on its own
+			else {
+				d = tick - open [note->key & 0x7F];
+				if (d < 0) d = 0;
+				d = quantize (d, quant_off);								// length of the note is quantized
+				if (d == 0) d = min_time (quant_off);
+				q = open [note->key & 0x7F] + d - 1;						// note-off ends 1 tick before the grid
+				open [note->key & 0x7F] = -1;
+			}
+			if (q > max) q = max;
+		}
+		tick2note (q, note, TRUE);
+		note->played = FALSE;
+	}
+
+	// sort the track, then merge it with the other tracks (already sorted)
+	qsort (requant_notes, nb, sizeof (note_t), compare_notes);
+	for (i = 0, j = 0, k = 0; k < length; k++) {
+		while ((i < length) && (src [i].instrument == instr)) i++;
+		if ((j < nb) && ((i == length) || note_before (&requant_notes [j], &src [i]))) memcpy (&dst [k], &requant_notes [j++], sizeof (note_t));
+		else memcpy (&dst [k], &src [i++], sizeof (note_t));
+	}
+	return length;
+}
+
+
+/**************************/
+/* tests (debug use only) */
+/**************************/
+
+// each test function replaces the current song, and returns the number of failed checks (0 if all checks pass)
+// failed checks are printed; test_song () runs all the tests
+
+static int test_failures;					// number of failed checks of the test being run
+static note_t test_ref [SONG_SIZE];			// reference model of the song
+static int test_ref_length;
+static note_t test_ref_copy [COPY_SIZE];	// reference model of the copy buffer
+static int test_ref_copy_length;
+
+
+// record the result of a check
+static void test_check (int condition, char * st) {
+
+	if (condition) return;
+	printf ("FAIL: %s\n", st);
+	test_failures++;
+}
+
+
+// empty song and copy buffer, with 4/4 and 480 ticks per beat
+static void test_clear () {
+
+	time_beats_per_bar = 4.0;
+	time_ticks_per_beat = 480.0;
+	timebase_update ();
+	memset (song, 0, SONG_SIZE * sizeof (note_t));
+	song_length = 0;
+	copy_length = 0;
+	test_ref_length = 0;
+	test_ref_copy_length = 0;
+}
+
+
+// set a note at quantized position (qbar, qtick); raw position is the same
+static void test_set_note (note_t * note, int qbar, int qtick, int instr, int status, int key) {
+
+	memset (note, 0, sizeof (note_t));
+	note->instrument = instr;
+	note->status = status;
+	note->key = key;
+	note->vel = (status == MIDI_NOTEON) ? DEFAULT_VELOCITY : 0;
+	tick2note ((qbar * 1920) + qtick, note, TRUE);
+	tick2note ((qbar * 1920) + qtick, note, FALSE);
+}
+
+
+// write a note at quantized position (qbar, qtick)
+static void test_write_note (int qbar, int qtick, int instr, int status) {
+
+	note_t note;
+
+	test_set_note (&note, qbar, qtick, instr, status, 60);
+	write_to_song (note);
+}
+
+
+// returns TRUE if song is sorted as write_to_song () sorts it: by qbar, qtick, then note-on before note-off
+static int test_is_sorted () {
+
+	int i;
+
+	for (i = 1; i < song_length; i++) {
+		if (song [i].qbar != song [i - 1].qbar) {
+			if (song [i].qbar < song [i - 1].qbar) return FALSE;
+		}
+		else if (song [i].qtick != song [i - 1].qtick) {
+			if (song [i].qtick < song [i - 1].qtick) return FALSE;
+		}
+		else if (song [i].status > song [i - 1].status) return FALSE;
+	}
+	return TRUE;
+}
+
+
+static int compare_bytes (const void *a, const void *b) {
+
+	return memcmp (a, b, sizeof (note_t));
+}
+
+
+// returns TRUE if notes contains the same notes as the song, in any order
+static int test_same_notes (note_t * notes, int lg) {
+
+	static note_t sorted_song [SONG_SIZE], sorted_notes [SONG_SIZE];
+
+	if (lg != song_length) return FALSE;
+	memcpy (sorted_song, song, lg * sizeof (note_t));
+	memcpy (sorted_notes, notes, lg * sizeof (note_t));
+	qsort (sorted_song, lg, sizeof (note_t), compare_bytes);
+	qsort (sorted_notes, lg, sizeof (note_t), compare_bytes);
+	return (memcmp (sorted_song, sorted_notes, lg * sizeof (note_t)) == 0);
+}
+
+
+// remove the notes of instr in bars [b1, b2) from the reference model
+static void test_ref_delete (int b1, int b2, int instr) {
+
+	int i, j;
+
+	for (i = 0, j = 0; i < test_ref_length; i++) {
+		if ((test_ref [i].instrument == instr) && (test_ref [i].qbar >= b1) && (test_ref [i].qbar < b2)) continue;
+		if (i != j) memcpy (&test_ref [j], &test_ref [i], sizeof (note_t));
+		j++;
+	}
+	test_ref_length = j;
+}
+
+
+// check the result of read_from_song (length, notes) for the window (b1, t1) inclusive to (b2, t2) exclusive
+// expected result: the notes of the song inside the window, which are consecutive in a sorted song
+static void test_check_read (int b1, int t1, int b2, int t2, int lg, note_t * notes, char * st) {
+
+	int i, first, expected;
+	char msg [128];
+
+	first = -1;
+	expected = 0;
+	for (i = 0; i < song_length; i++) {
+		if ((song [i].qbar < b1) || ((song [i].qbar == b1) && (song [i].qtick < t1))) continue;
+		if ((song [i].qbar > b2) || ((song [i].qbar == b2) && (song [i].qtick >= t2))) continue;
+		if (first == -1) first = i;
+		expected++;
+	}
+
+	sprintf (msg, "%.40s: read (%d, %d) to (%d, %d) returns %d notes, expected %d", st, b1, t1, b2, t2, lg, expected);
+	test_check (lg == expected, msg);
+	if ((lg == expected) && (expected > 0)) {
+		sprintf (msg, "%.40s: read (%d, %d) to (%d, %d) does not start at note %d", st, b1, t1, b2, t2, first);
+		test_check (notes == &song [first], msg);
+	}
+}
+
+
+// write_to_song: notes are inserted at the right place
+int test_write () {
+
+	static const int expected [10][3] = {{3, 960, 2}, {4, 959, 7}, {4, 960, 0}, {4, 960, 3}, {4, 960, 2}, {4, 960, 2}, {4, 961, 7}, {5, 480, 1}, {6, 0, 2}, {6, 1440, 2}};
+	int i, ok;
+
+	test_failures = 0;
+	test_clear ();
+
+	test_write_note (5, 480, 1, MIDI_NOTEON);		// 1st note in song
+	test_write_note (6, 0, 2, MIDI_NOTEON);			// at end of song
+	test_write_note (3, 960, 2, MIDI_NOTEON);		// at beginning of song
+	test_write_note (4, 960, 2, MIDI_NOTEON);		// between 2 bars
+	test_write_note (4, 960, 2, MIDI_NOTEON);		// same as previous
+	test_write_note (4, 961, 7, MIDI_NOTEON);		// same bar, higher tick
+	test_write_note (4, 959, 7, MIDI_NOTEON);		// same bar, lower tick
+	test_write_note (4, 960, 3, MIDI_NOTEON);		// same position as previous, with higher instr: goes first
+	test_write_note (4, 960, 0, MIDI_NOTEON);		// same position as previous, with lower instr: goes first
+	test_write_note (6, 1440, 2, MIDI_NOTEON);		// at end of song
+
+	test_check (song_length == 10, "write: song length");
+	ok = TRUE;
+	for (i = 0; i < 10; i++) {
+		if ((song [i].qbar != expected [i][0]) || (song [i].qtick != expected [i][1]) || (song [i].instrument != expected [i][2])) ok = FALSE;
+	}
+	test_check (ok, "write: order of notes");
+	test_check (test_is_sorted (), "write: song is sorted");
+
+	// note-on goes before note-off at the same position, whatever the order of writing
+	test_write_note (7, 0, 1, MIDI_NOTEOFF);
+	test_write_note (7, 0, 1, MIDI_NOTEON);
+	test_write_note (7, 0, 2, MIDI_NOTEOFF);
+	test_check ((song [10].status == MIDI_NOTEON) && (song [11].status == MIDI_NOTEOFF) && (song [12].status == MIDI_NOTEOFF), "write: note-on before note-off");
+	test_check (test_is_sorted (), "write: song is sorted after note-off");
+
+	// a full song is not written to
+	song_length = SONG_SIZE;
+	test_write_note (0, 0, 0, MIDI_NOTEON);
+	test_check (song_length == SONG_SIZE, "write: full song");
+
+	return test_failures;
+}
+
+
+// read_from_song: start of the window is inclusive, end is exclusive
+int test_read () {
+
+	note_t *note;
+	int length, failures;
+
+	failures = test_write ();			// song of test_write ()
+	test_failures = failures;
+	song_length = 10;
+
+	note = read_from_song (1, 0, 1, 480, &length);
+	test_check ((length == 0) && (note == NULL), "read: before 1st bar");
+	note = read_from_song (7, 0, 7, 480, &length);
+	test_check ((length == 0) && (note == NULL), "read: after last bar");
+	note = read_from_song (3, 0, 3, 960, &length);
+	test_check (length == 0, "read: end limit is exclusive");
+	note = read_from_song (3, 0, 3, 961, &length);
+	test_check ((length == 1) && (note == &song [0]), "read: 1 note");
+	note = read_from_song (3, 960, 4, 960, &length);
+	test_check ((length == 2) && (note == &song [0]), "read: 2 notes over 2 bars");
+	note = read_from_song (3, 0, 6, 1500, &length);
+	test_check ((length == 10) && (note == &song [0]), "read: all notes");
+	note = read_from_song (4, 0, 4, 1260, &length);
+	test_check ((length == 6) && (note == &song [1]), "read: bar 4 only");
+	note = read_from_song (4, 960, 4, 960, &length);
+	test_check (length == 0, "read: empty window");
+	note = read_from_song (4, 960, 4, 961, &length);
+	test_check ((length == 4) && (note == &song [2]), "read: tick 960 only");
+	note = read_from_song (6, 1450, 6, 1900, &length);
+	test_check (length == 0, "read: end of song");
+	note = read_from_song (6, 1450, 20, 1900, &length);
+	test_check (length == 0, "read: after end of song, bar does not exist");
+	note = read_from_song (0, 0, 512, 0, &length);
+	test_check ((length == 10) && (note == &song [0]), "read: whole song");
+
+	return test_failures;
+}
+
+
+// copy, cut and paste of bars of an instrument
+int test_copy_paste () {
+
+	note_t *note;
+	int length, i;
+
+	test_failures = 0;
+	test_clear ();
+
+	// instr 1: 1 note per bar in bars 2 to 5; instr 2: 1 note in bar 3
+	for (i = 2; i < 6; i++) {
+		test_write_note (i, 0, 1, MIDI_NOTEON);
+		test_write_note (i, 479, 1, MIDI_NOTEOFF);
+	}
+	test_write_note (3, 100, 2, MIDI_NOTEON);
+
+	copy (0, 2, 1);
+	test_check (copy_length == 0, "copy: area without notes");
+	copy (2, 4, 2);
+	test_check ((copy_length == 1) && (copy_buffer [0].qbar == 1) && (copy_buffer [0].qtick == 100), "copy: other instr is not copied, bars start at 0");
+	copy (3, 5, 1);
+	test_check ((copy_length == 4) && (copy_buffer [0].qbar == 0) && (copy_buffer [3].qbar == 1), "copy: 2 bars, end bar is exclusive");
+	test_check (song_length == 9, "copy: song is unchanged");
+
+	cut (3, 5, 1);
+	test_check ((copy_length == 4) && (song_length == 5), "cut: notes are removed from song");
+	note = read_from_song (3, 0, 5, 0, &length);
+	test_check ((length == 1) && (note [0].instrument == 2), "cut: other instr is kept");
+	test_check (test_is_sorted (), "cut: song is sorted");
+
+	paste (10, 2, 3, PASTE);
+	note = read_from_song (10, 0, 12, 0, &length);
+	test_check ((length == 4) && (note [0].instrument == 3) && (note [0].qbar == 10) && (note [0].bar == 10) && (note [3].qbar == 11), "paste: bars and instr are set");
+	test_check ((song_length == 9) && (copy_length == 4), "paste: copy buffer is kept");
+
+	paste (10, 2, 3, PASTE);
+	test_check (song_length == 9, "paste: destination is cleared first");
+	paste (10, 2, 3, OVERDUB);
+	test_check (song_length == 13, "overdub: destination is kept");
+	test_check (test_is_sorted (), "paste: song is sorted");
+
+	copy_length = 0;
+	paste (2, 4, 1, PASTE);
+	test_check (song_length == 13, "paste: empty copy buffer does not clear destination");
+
+	return test_failures;
+}
+
+
+// quantize () and quantize_note (), with 4/4 and 480 ticks per beat (1920 ticks per bar)
+int test_quantize () {
+
+	note_t note;
+	int status;
+
+	test_failures = 0;
+	test_clear ();
+
+	test_check (quantize (119, EIGHTH) == 0, "quantize: round down");
+	test_check (quantize (120, EIGHTH) == 240, "quantize: half step rounds up");
+	test_check (quantize (1000, FREE_TIMING) == 1000, "quantize: free timing");
+	test_check (quantize (1919, QUARTER) == 1920, "quantize: next bar");
+	test_check ((min_time (SIXTEENTH) == 120) && (min_time (FREE_TIMING) == 1), "min_time");
+
+	// first note of the instrument: quantized on its own
+	test_set_note (&note, 2, 130, 1, MIDI_NOTEON, 60);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 2) && (note.qtick == 120) && (note.qbeat == 0) && (note.tick == 130), "quantize_note: 1st note, rounded to the past");
+	test_check (status == TRUE, "quantize_note: note in the past is played straight");
+	write_to_song (note);
+
+	test_set_note (&note, 2, 1910, 2, MIDI_NOTEON, 60);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 3) && (note.qtick == 0), "quantize_note: other instr, rounded to next bar");
+	test_check (status == FALSE, "quantize_note: note in the future is played later");
+
+	// note-off: length from the note-on is quantized, and ends 1 tick before the grid
+	test_set_note (&note, 2, 400, 1, MIDI_NOTEOFF, 60);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 2) && (note.qtick == 359) && (status == TRUE), "quantize_note: note-off");
+
+	test_set_note (&note, 2, 125, 1, MIDI_NOTEOFF, 60);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 2) && (note.qtick == 359) && (status == FALSE), "quantize_note: very short note lasts 1 step");
+
+	test_set_note (&note, 2, 400, 1, MIDI_NOTEOFF, 61);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 2) && (note.qtick == 480), "quantize_note: note-off of another key is quantized on its own");
+
+	// next note-on: time from the previous note-on is quantized
+	test_set_note (&note, 2, 370, 1, MIDI_NOTEON, 62);
+	status = quantize_note (SIXTEENTH, EIGHTH, &note);
+	test_check ((note.qbar == 2) && (note.qtick == 360) && (status == TRUE), "quantize_note: next note-on");
+
+	return test_failures;
+}
+
+
+// requantize (): notes recorded with quantize_note () are quantized again from their raw timing
+int test_requantize () {
+
+	static note_t recorded [SONG_SIZE];
+	static const int ticks [] = {130, 400, 370, 700, 990, 1250, 1930, 2100};		// raw time of the notes of instrument 1
+	static const int keys [] = {60, 60, 62, 62, 64, 64, 65, 65};
+	static const int status [] = {MIDI_NOTEON, MIDI_NOTEOFF, MIDI_NOTEON, MIDI_NOTEOFF, MIDI_NOTEON, MIDI_NOTEOFF, MIDI_NOTEON, MIDI_NOTEOFF};
+	note_t note;
+	uint32_t tick, raw;
+	int i, lg, same;
+
+	test_failures = 0;
+	test_clear ();
+
+	// record the notes in time order, as process does; instrument 2 is written straight
+	for (i = 0; i < 8; i++) {
+		test_set_note (&note, 0, ticks [i], 1, status [i], keys [i]);
+		quantize_note (SIXTEENTH, EIGHTH, &note);
+		write_to_song (note);
+		test_write_note (i, 0, 2, (i % 2) ? MIDI_NOTEOFF : MIDI_NOTEON);
+	}
+	lg = song_length;
+	memcpy (recorded, song, lg * sizeof (note_t));
+
+	// same quantizers: same song
+	test_check (requantize (recorded, lg, song, 1, SIXTEENTH, EIGHTH) == lg, "requantize: length");
+	test_check (memcmp (recorded, song, lg * sizeof (note_t)) == 0, "requantize: same quantizers give the recorded song");
+
+	// free timing: notes of instrument 1 go back to their raw time (1 tick earlier for notes off, as quantize_note does)
+	requantize (recorded, lg, song, 1, FREE_TIMING, FREE_TIMING);
+	test_check (test_is_sorted (), "requantize: song is sorted with free timing");
+	same = TRUE;
+	for (i = 0; i < lg; i++) {
+		if (song [i].instrument != 1) continue;
+		note2tick (song [i], &tick, TRUE);
+		note2tick (song [i], &raw, FALSE);
+		if (tick != ((song [i].status == MIDI_NOTEON) ? raw : raw - 1)) same = FALSE;
+	}
+	test_check (same, "requantize: free timing gives raw time");
+
+	// other instruments are not changed
+	same = TRUE;
+	for (i = 0; i < lg; i++) {
+		if ((song [i].instrument == 2) && (song [i].qbar != song [i].bar)) same = FALSE;
+	}
+	test_check (same, "requantize: other instruments are not changed");
+
+	// quarters: 1st note-on 130 -> 0, next one is 370 ticks later -> 480, its note-off 330 ticks later -> 480 + 480 - 1
+	requantize (recorded, lg, song, 1, QUARTER, QUARTER);
+	same = 0;
+	for (i = 0; i < lg; i++) {
+		if ((song [i].instrument != 1) || (song [i].key != 62)) continue;
+		note2tick (song [i], &tick, TRUE);
+		if ((song [i].status == MIDI_NOTEON) && (tick == 480)) same++;
+		if ((song [i].status == MIDI_NOTEOFF) && (tick == 959)) same++;
+	}
+	test_check (same == 2, "requantize: quarters");
+	test_check (test_is_sorted (), "requantize: song is sorted with quarters");
+
+	return test_failures;
+}
+
+
+// grooves: table lookups of groove.c against quantize (), swing, playback warp and templates (eighths, 1920 ticks per bar)
+int test_groove () {
+
+	note_t note, *notes;
+	uint32_t tick;
+	int i, lg, same, saved;
+
+	test_failures = 0;
+	test_clear ();
+	saved = quantizer;
+	quantizer = EIGHTH;
+
+	// straight grid: same as quantize (), half step rounds up
+	groove_select (GROOVE_STRAIGHT, 0);
+	same = TRUE;
+	for (tick = 0; tick < 3 * 1920; tick++) if (groove_quantize (tick) != quantize (tick, EIGHTH)) same = FALSE;
+	test_check (same, "groove: straight grid is quantize ()");
+
+	// swing 66%: offbeat eighths go to 316 (2 x 240 x 66%), limits are half-way between targets
+	groove_select (GROOVE_SWING, 66);
+	test_check ((groove_quantize (1920 + 300) == 1920 + 316) && (groove_quantize (1920 + 400) == 1920 + 480), "groove: swing");
+	test_check ((groove_quantize (1920 + 158) == 1920 + 316) && (groove_quantize (1920 + 157) == 1920), "groove: swing limits");
+	test_check (groove_quantize (1919) == 1920, "groove: next bar");
+
+	// record with quantize_note: notes on use the groove, notes off keep the quantizer
+	test_set_note (&note, 1, 300, 1, MIDI_NOTEON, 60);
+	quantize_note (EIGHTH, EIGHTH, &note);
+	test_check ((note.qbar == 1) && (note.qtick == 316) && (note.tick == 300), "groove: quantize_note");
+	write_to_song (note);
+
+	// playback: the offbeat eighth of a straight song is played at 316, notes are read once
+	test_write_note (2, 240, 1, MIDI_NOTEON);
+	test_write_note (2, 479, 1, MIDI_NOTEOFF);
+	groove_play (TRUE);
+	notes = groove_read (2, 200, 2, 316, &lg);
+	test_check (lg == 0, "groove: offbeat is not played on the grid");
+	notes = groove_read (2, 316, 2, 317, &lg);
+	test_check ((lg == 1) && (notes [0].qtick == 240), "groove: offbeat is played late");
+	notes = groove_read (2, 317, 2, 480, &lg);
+	test_check ((lg == 1) && (notes [0].status == MIDI_NOTEOFF), "groove: note off is played after its note on");
+	test_check (groove_play_tick ((2 * 1920) + 240) == (2 * 1920) + 316, "groove: live notes are scheduled at the warped time");
+	groove_play (FALSE);
+	test_check (groove_play_tick ((2 * 1920) + 240) == (2 * 1920) + 240, "groove: live notes are scheduled on the grid");
+	notes = groove_read (2, 200, 2, 316, &lg);
+	test_check ((lg == 1) && (notes [0].qtick == 240), "groove: no groove at playback");
+
+	// template from bar 4: steps with a note on go to the average of its raw time, other steps stay on the grid
+	test_set_note (&note, 4, 10, 3, MIDI_NOTEON, 60);
+	write_to_song (note);
+	test_set_note (&note, 4, 0, 3, MIDI_NOTEON, 62);
+	tick2note ((4 * 1920) + 270, &note, FALSE);
+	write_to_song (note);
+	test_set_note (&note, 4, 240, 3, MIDI_NOTEON, 64);
+	tick2note ((4 * 1920) + 250, &note, FALSE);
+	write_to_song (note);
+	groove_extract (3, 4);
+	test_check ((groove_quantize (5 * 1920) == (5 * 1920) + 10) && (groove_quantize ((5 * 1920) + 200) == (5 * 1920) + 260), "groove: template");
+	test_check (groove_quantize ((5 * 1920) + 500) == (5 * 1920) + 480, "groove: template, step without note");
+
+	groove_select (GROOVE_OFF, 0);
+	test_check (groove_quantize (300) == 300, "groove: off");
+	quantizer = saved;
+	for (i = 0; i < song_length; i++) song [i].played = FALSE;
+
+	return test_failures;
+}
+
+
+// randomized tests: nb_runs sequences of random operations are applied to the song and to a reference model
+// (unsorted list of notes), then compared; the song shall stay sorted and hold the same notes as the model
+int test_random (int nb_runs, unsigned int seed) {
+
+	note_t note, *notes;
+	char msg [128];
+	int run, op, i, lg, b1, b2, t1, t2, instr, shift, mode;
+
+	test_failures = 0;
+	srand (seed);
+
+	for (run = 0; (run < nb_runs) && (test_failures == 0); run++) {
+		test_clear ();
+
+		for (op = 0; (op < 200) && (test_failures == 0); op++) {
+			b1 = rand () % 48;
+			b2 = b1 + 1 + (rand () % 8);
+			instr = rand () % 4;
+
+			switch (rand () % 8) {
+				case 0:
+				case 1:
+				case 2:
+					// write a note; bars are kept low, so inserted bars do not go over the end of the song
+					test_set_note (&note, b1, (rand () % 16) * 120, instr, (rand () % 2) ? MIDI_NOTEON : MIDI_NOTEOFF, rand () % 128);
+					note.tick = rand () % 1920;
+					write_to_song (note);
+					memcpy (&test_ref [test_ref_length++], &note, sizeof (note_t));
+					sprintf (msg, "random %d/%d: write", run, op);
+					break;
+
+				case 3:
+					// copy or cut: copy buffer gets the notes of instr in [b1, b2), with bars starting from 0
+					test_ref_copy_length = 0;
+					for (i = 0; i < test_ref_length; i++) {
+						if ((test_ref [i].instrument != instr) || (test_ref [i].qbar < b1) || (test_ref [i].qbar >= b2)) continue;
+						memcpy (&test_ref_copy [test_ref_copy_length], &test_ref [i], sizeof (note_t));
+						test_ref_copy [test_ref_copy_length].qbar -= b1;
+						test_ref_copy [test_ref_copy_length].bar -= b1;
+						test_ref_copy_length++;
+					}
+					if (rand () % 2) {
+						copy (b1, b2, instr);
+						sprintf (msg, "random %d/%d: copy (%d, %d, %d)", run, op, b1, b2, instr);
+					}
+					else {
+						cut (b1, b2, instr);
+						test_ref_delete (b1, b2, instr);
+						sprintf (msg, "random %d/%d: cut (%d, %d, %d)", run, op, b1, b2, instr);
+					}
+					test_check (test_ref_copy_length == copy_length, msg);
+					break;
+
+				case 4:
+					// paste or overdub the copy buffer at b1, for instr
+					if (copy_length == 0) break;
+					if (rand () % 2) {
+						paste (b1, b2 - b1, instr, PASTE);
+						test_ref_delete (b1, b2, instr);
+						sprintf (msg, "random %d/%d: paste (%d, %d, %d)", run, op, b1, b2 - b1, instr);
+					}
+					else {
+						paste (b1, b2 - b1, instr, OVERDUB);
+						sprintf (msg, "random %d/%d: overdub (%d, %d)", run, op, b1, instr);
+					}
+					for (i = 0; i < test_ref_copy_length; i++) {
+						memcpy (&test_ref [test_ref_length], &test_ref_copy [i], sizeof (note_t));
+						test_ref [test_ref_length].qbar += b1;
+						test_ref [test_ref_length].bar += b1;
+						test_ref [test_ref_length].instrument = instr;
+						test_ref_length++;
+					}
+					break;
+
+				case 5:
+				case 6:
+					// insert or remove bars [b1, b2) of instr, as done from the UI (notes after bar 511 are not moved)
+					mode = (rand () % 2) ? INSERT : REMOVE;
+					if (mode == REMOVE) test_ref_delete (b1, b2, instr);
+					for (i = 0; i < test_ref_length; i++) {
+						if ((test_ref [i].instrument != instr) || (test_ref [i].qbar < b1) || (test_ref [i].qbar >= 512)) continue;
+						shift = (mode == INSERT) ? b2 - b1 : b1 - b2;
+						test_ref [i].qbar += shift;
+						test_ref [i].bar += shift;
+					}
+
+					is_play = FALSE;
+					ui_current_page = 0;
+					ui_current_instrument = instr;
+					ui_limit1 = b1;
+					ui_limit2 = b2 - 1;
+					lg = copy_length;
+					bar_process (mode);
+					sprintf (msg, "random %d/%d: %s (%d, %d, %d)", run, op, (mode == INSERT) ? "insert" : "remove", b1, b2, instr);
+					test_check (copy_length == lg, msg);		// copy buffer is kept
+					break;
+
+				case 7:
+					// read a random window
+					b2 = b1 + (rand () % 4);
+					t1 = (rand () % 17) * 120;
+					t2 = (rand () % 17) * 120;
+					if ((b2 == b1) && (t2 < t1)) t2 = t1;
+					notes = read_from_song (b1, t1, b2, t2, &lg);
+					sprintf (msg, "random %d/%d", run, op);
+					test_check_read (b1, t1, b2, t2, lg, notes, msg);
+					break;
+			}
+
+			test_check (test_is_sorted (), msg);
+			test_check (test_same_notes (test_ref, test_ref_length), msg);
+		}
+	}
+
+	return test_failures;
+}
+
+
+// run all the tests of the song structure; the current song is lost
+// returns the number of failed checks
+int test_song () {
+
+	int failures;
+
+	failures = test_write ();
+	failures += test_read ();
+	failures += test_copy_paste ();
+	failures += test_quantize ();
+	failures += test_requantize ();
+	failures += test_groove ();
+	failures += test_random (100, 1);
+	test_clear ();
+	printf ("song tests: %s (%d failed checks)\n", failures ? "FAILED" : "passed", failures);
+	return failures;
+}
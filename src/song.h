@@ -5,19 +5,27 @@
  */
 
 
+void set_dirty (int, int);
+void set_dirty_segments (uint64_t);
 void write_to_song (note_t);
 note_t* read_from_song (u_int16_t, u_int16_t, u_int16_t, u_int16_t, int*);
 note_t* read_from_metronome (u_int16_t, u_int16_t, u_int16_t, u_int16_t, int*);
 note_t* read_from (note_t*, int, u_int16_t, u_int16_t, u_int16_t, u_int16_t, int*);
-void test_copy_paste ();
-void test_write ();
-void test_read ();
 void display_song (int, note_t *, char *);
 void copy_cut (u_int16_t, u_int16_t, int, int);
 void copy (u_int16_t, u_int16_t, int);
 void cut (u_int16_t, u_int16_t, int);
 void paste (u_int16_t, int, int, int);
 void create_metronome ();
+int requantize (note_t *, int, note_t *, int, int, int);
+int test_write ();
+int test_read ();
+int test_copy_paste ();
+int test_quantize ();
+int test_requantize ();
+int test_groove ();
+int test_random (int, unsigned int);
+int test_song ();
 
 
 
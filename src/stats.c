@@ -0,0 +1,377 @@
+/** @file stats.c
+ *
+ * @brief Timing statistics of the process callback. The realtime thread records the duration of each stage of process ()
+ * into histograms (single writer, no lock); a non-realtime thread reads them, together with xruns and JACK DSP load,
+ * and makes a report of percentiles periodically, which is printed on request and optionally appended to a report file.
+ * Pushes to the midi out lists are counted as well (high-water mark, overflows, messages per cycle), to size the lists,
+ * together with the pacing of the led output (cycles over the led budget, and how many cycles a redraw takes).
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static volatile uint32_t stats_histo [STATS_STAGES][STATS_BUCKETS];	// number of cycles per duration bucket, for each stage; written by process only
+static volatile uint64_t stats_sum [STATS_STAGES];				// total duration of each stage, in ns
+static volatile uint32_t stats_late = 0;		// cycles which took more than STATS_BUDGET % of the period
+static volatile uint32_t stats_xruns = 0;		// xruns reported by JACK
+static volatile uint32_t stats_pushes [STATS_LISTS];		// messages pushed to each midi out list
+static volatile uint32_t stats_cycle_pushes [STATS_LISTS];	// messages pushed during current cycle
+static volatile uint32_t stats_cycle_max [STATS_LISTS];		// max messages pushed during a cycle
+static volatile uint32_t stats_high [STATS_LISTS];			// high-water mark of each list
+static volatile uint32_t stats_overflows [STATS_LISTS];		// number of times a list has been full (push_to_list wraps, pending messages are lost)
+static volatile uint32_t stats_led_sent = 0;	// led messages sent by led_flush
+static volatile uint32_t stats_led_paced = 0;	// cycles which have left pads for the next cycles (led budget reached)
+static volatile uint32_t stats_led_left = 0;	// max number of pads left at the end of a cycle
+static volatile uint32_t stats_led_run = 0;		// number of cycles of the current redraw
+static volatile uint32_t stats_led_drain = 0;	// max number of cycles taken by a redraw
+static volatile int stats_request = FALSE;		// set by stats_show (), processed by reporter thread
+static char stats_filename [255];				// report file
+static char stats_last [STATS_TEXT] = "";		// last report, printed on request; written and read by reporter thread only
+static pthread_t stats_thread;
+
+static const char *stats_names [STATS_STAGES] = {"cycle", "play", "kbd in", "out", "clock", "kbd out", "ui in", "ui out", "keys", "read"};
+static const char *stats_list_names [STATS_LISTS] = {"ui", "kbd", "out", "clk", "kbd clk"};
+
+
+// current time in ns (monotonic clock)
+uint64_t stats_now () {
+
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+// convert a duration into a histogram bucket: 4 buckets per power of 2, ie. a precision of 25% at most
+static int stats_bucket (uint64_t ns) {
+
+	int msb;
+
+	if (ns < 4) return ns;
+	if (ns > 0xFFFFFFFFULL) return STATS_BUCKETS - 1;
+	msb = 31 - __builtin_clz ((uint32_t) ns);
+	return (msb * 4) + ((ns >> (msb - 2)) & 3);
+}
+
+
+// upper limit of a histogram bucket, in ns
+static uint64_t stats_bucket_max (int bucket) {
+
+	if (bucket < 4) return bucket + 1;
+	if (bucket < 8) return 4;			// not used
+	return ((uint64_t) (4 + (bucket & 3) + 1)) << ((bucket / 4) - 2);
+}
+
+
+// record the duration of a stage of process, which started at start; called from process
+// returns current time, which is the start of next stage
+uint64_t stats_stage (int stage, uint64_t start) {
+
+	uint64_t now;
+
+	now = stats_now ();
+	stats_histo [stage][stats_bucket (now - start)]++;
+	stats_sum [stage] += now - start;
+	return now;
+}
+
+
+// record the duration of a whole cycle of process, which started at start; called from process at the end of the cycle
+void stats_cycle (uint64_t start, jack_nframes_t nframes) {
+
+	uint64_t duration, period;
+	int i;
+
+	duration = stats_now () - start;
+	stats_histo [STATS_CYCLE][stats_bucket (duration)]++;
+	stats_sum [STATS_CYCLE] += duration;
+
+	// messages pushed to the lists during the cycle
+	for (i = 0; i < STATS_LISTS; i++) {
+		if (stats_cycle_pushes [i] > stats_cycle_max [i]) stats_cycle_max [i] = stats_cycle_pushes [i];
+		stats_cycle_pushes [i] = 0;
+	}
+
+	// compare to the time we have for this cycle
+	period = ((uint64_t) nframes * 1000000000ULL) / jack_get_sample_rate (client);
+	if (duration * 100 > period * STATS_BUDGET) stats_late++;
+}
+
+
+// record a push to a midi out list (UI, KBD, OUT, CLK, KBD_CLK), at position index; called from push_to_list
+void stats_push (int list, int index) {
+
+	stats_pushes [list]++;
+	stats_cycle_pushes [list]++;
+	if (index + 1 > stats_high [list]) stats_high [list] = index + 1;
+	if (index >= LIST_ELT - 1) stats_overflows [list]++;
+}
+
+
+// record a flush of leds: sent messages have been sent during the cycle, left pads are waiting for the next cycles; called from led_flush
+void stats_leds (int sent, int left) {
+
+	stats_led_sent += sent;
+	if (left > stats_led_left) stats_led_left = left;
+	if (left > 0) {
+		stats_led_paced++;
+		stats_led_run++;
+	}
+	else if (stats_led_run > 0) {
+		if (stats_led_run + 1 > stats_led_drain) stats_led_drain = stats_led_run + 1;		// last cycle of the redraw
+		stats_led_run = 0;
+	}
+}
+
+
+// get the counters of the led output since last reset: cycles which have reached the budget, max pads left, max cycles of a redraw
+// returns the number of led messages sent
+uint32_t stats_led (uint32_t * paced, uint32_t * left, uint32_t * drain) {
+
+	*paced = stats_led_paced;
+	*left = stats_led_left;
+	*drain = stats_led_drain;
+	return stats_led_sent;
+}
+
+
+// get the counters of a midi out list since last reset: high-water mark, overflows (LIST_ELT messages lost each time), max messages in a cycle
+// returns the number of messages pushed
+uint32_t stats_list (int list, uint32_t * high, uint32_t * overflows, uint32_t * cycle_max) {
+
+	*high = stats_high [list];
+	*overflows = stats_overflows [list];
+	*cycle_max = stats_cycle_max [list];
+	return stats_pushes [list];
+}
+
+
+// request the last report and the counters of the midi out lists to be printed on the terminal; may be called from process
+void stats_show () {
+
+	stats_request = TRUE;
+}
+
+
+// xrun callback, called by JACK
+int stats_xrun (void *arg) {
+
+	stats_xruns++;
+	return 0;
+}
+
+
+// duration (ns) under which there is a given ratio of the cycles of histo (number of cycles per bucket)
+static uint64_t stats_percentile (uint32_t * histo, uint32_t total, double ratio) {
+
+	uint32_t count;
+	int i;
+
+	count = 0;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		count += histo [i];
+		if (count >= total * ratio) return stats_bucket_max (i);
+	}
+	return stats_bucket_max (STATS_BUCKETS - 1);
+}
+
+
+// clear the statistics; process shall not be running (eg. offline benchmark)
+void stats_reset () {
+
+	memset ((void *) stats_histo, 0, sizeof (stats_histo));
+	memset ((void *) stats_sum, 0, sizeof (stats_sum));
+	stats_late = 0;
+	stats_xruns = 0;
+	memset ((void *) stats_pushes, 0, sizeof (stats_pushes));
+	memset ((void *) stats_cycle_pushes, 0, sizeof (stats_cycle_pushes));
+	memset ((void *) stats_cycle_max, 0, sizeof (stats_cycle_max));
+	memset ((void *) stats_high, 0, sizeof (stats_high));
+	memset ((void *) stats_overflows, 0, sizeof (stats_overflows));
+	stats_led_sent = 0;
+	stats_led_paced = 0;
+	stats_led_left = 0;
+	stats_led_run = 0;
+	stats_led_drain = 0;
+}
+
+
+// get mean, 99th percentile and max duration (ns) of a stage since last reset
+// returns the number of times the stage has been recorded
+uint32_t stats_summary (int stage, uint64_t * mean, uint64_t * p99, uint64_t * max) {
+
+	uint32_t histo [STATS_BUCKETS];
+	uint32_t total;
+	int i;
+
+	total = 0;
+	*max = 0;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		histo [i] = stats_histo [stage][i];
+		total += histo [i];
+		if (histo [i]) *max = stats_bucket_max (i);
+	}
+	*mean = total ? stats_sum [stage] / total : 0;
+	*p99 = total ? stats_percentile (histo, total, 0.99) : 0;
+	return total;
+}
+
+
+// print the counters of the midi out lists, since start
+static void stats_print_lists (FILE * fp, char * eol) {
+
+	uint32_t pushes, high, overflows, cycle_max, paced, left, drain;
+	int i;
+
+	fprintf (fp, "  %-8s %10s %10s %10s %10s  (list of %d messages)%s", "list", "pushed", "max/cycle", "high", "overflows", LIST_ELT, eol);
+	for (i = 0; i < STATS_LISTS; i++) {
+		pushes = stats_list (i, &high, &overflows, &cycle_max);
+		fprintf (fp, "  %-8s %10u %10u %10u %10u%s", stats_list_names [i], pushes, cycle_max, high, overflows, eol);
+	}
+	pushes = stats_led (&paced, &left, &drain);
+	fprintf (fp, "  leds: %u messages, %u cycles over budget, %u pads left at most, redraws of %u cycles at most%s", pushes, paced, left, drain, eol);
+}
+
+
+// append text and the counters of the midi out lists to the report file; once the file is over STATS_LOG_SIZE, it is kept as STATS_FILE.1 and a new file is started
+// so that the SD card does not fill up with reports
+static void stats_append (char * text) {
+
+	FILE *fp;
+	struct stat st;
+	char previous [270];
+
+	if ((stat (stats_filename, &st) == 0) && (st.st_size + strlen (text) > STATS_LOG_SIZE)) {
+		sprintf (previous, "%s.1", stats_filename);
+		rename (stats_filename, previous);
+	}
+	fp = fopen (stats_filename, "at");
+	if (fp == NULL) return;
+	fputs (text, fp);
+	stats_print_lists (fp, "\n");
+	fclose (fp);
+}
+
+
+// write a report of the last period in memory (see stats_last): percentiles of each stage, late cycles, xruns, DSP load
+// it is appended to the report file if STATS_LOG is set, with the counters of the lists
+static void stats_report (uint32_t previous [STATS_STAGES][STATS_BUCKETS], uint32_t * late, uint32_t * xruns, float load_max, float load_avg) {
+
+	FILE *fp;
+	uint32_t histo [STATS_BUCKETS];
+	uint32_t total, value;
+	int stage, i, max;
+	time_t now;
+	char date [32];
+
+	fp = fmemopen (stats_last, STATS_TEXT, "w");
+	if (fp == NULL) return;
+
+	now = time (NULL);
+	strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S", localtime (&now));
+	value = stats_late;
+	fprintf (fp, "%s  late cycles (>%d%% of period): %u  xruns: %u  dsp load: %.1f%% avg, %.1f%% max\n", date, STATS_BUDGET, value - *late, stats_xruns - *xruns, load_avg, load_max);
+	*late = value;
+	*xruns = stats_xruns;
+
+	fprintf (fp, "  %-8s %10s %8s %8s %8s %8s %8s  (us)\n", "stage", "cycles", "p50", "p90", "p99", "p99.9", "max");
+	for (stage = 0; stage < STATS_STAGES; stage++) {
+
+		// histogram of the period: difference with previous report
+		total = 0;
+		max = 0;
+		for (i = 0; i < STATS_BUCKETS; i++) {
+			value = stats_histo [stage][i];
+			histo [i] = value - previous [stage][i];
+			previous [stage][i] = value;
+			total += histo [i];
+			if (histo [i]) max = i;
+		}
+		if (total == 0) continue;
+
+		fprintf (fp, "  %-8s %10u %8.1f %8.1f %8.1f %8.1f %8.1f\n", stats_names [stage], total,
+			stats_percentile (histo, total, 0.5) / 1000.0, stats_percentile (histo, total, 0.9) / 1000.0,
+			stats_percentile (histo, total, 0.99) / 1000.0, stats_percentile (histo, total, 0.999) / 1000.0, stats_bucket_max (max) / 1000.0);
+	}
+	fclose (fp);
+	stats_last [STATS_TEXT - 1] = 0;		// report may have been truncated
+
+	if (STATS_LOG) stats_append (stats_last);
+}
+
+
+// print the last report and the counters of the midi out lists on the terminal (curses terminal: lines end with \r\n)
+static void stats_print () {
+
+	char *line, *end;
+
+	for (line = stats_last; *line != 0; line = end + 1) {
+		end = strchr (line, '\n');
+		if (end == NULL) break;
+		fprintf (stderr, "%.*s\r\n", (int) (end - line), line);
+	}
+	stats_print_lists (stderr, "\r\n");
+}
+
+
+// reporter thread: sample DSP load every second, write a report every STATS_PERIOD seconds
+// last report and counters of the lists are printed on the terminal on request
+static void * stats_loop (void *arg) {
+
+	static uint32_t previous [STATS_STAGES][STATS_BUCKETS];
+	uint32_t late, xruns;
+	float load, load_max, load_sum;
+	int nb;
+
+	memset (previous, 0, sizeof (previous));
+	late = 0;
+	xruns = 0;
+	while (1) {
+		load_max = 0.0;
+		load_sum = 0.0;
+		for (nb = 0; nb < STATS_PERIOD; nb++) {
+			sleep (1);
+			if (__sync_bool_compare_and_swap (&stats_request, TRUE, FALSE)) stats_print ();
+			load = jack_cpu_load (client);
+			load_sum += load;
+			if (load > load_max) load_max = load;
+		}
+		stats_report (previous, &late, &xruns, load_max, load_sum / nb);
+	}
+
+	return NULL;
+}
+
+
+// start the reporter thread; with STATS_LOG, reports are appended to STATS_FILE in directory
+int stats_open (char * directory) {
+
+	sprintf (stats_filename, "%s/%s", directory, STATS_FILE);
+	if (pthread_create (&stats_thread, NULL, stats_loop, NULL) != 0) {
+		fprintf ( stderr, "Cannot start statistics thread\n" );
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -0,0 +1,18 @@
+/** @file stats.h
+ *
+ * @brief This file defines prototypes of functions inside stats.c
+ *
+ */
+
+uint64_t stats_now ();
+uint64_t stats_stage (int, uint64_t);
+void stats_cycle (uint64_t, jack_nframes_t);
+void stats_push (int, int);
+void stats_leds (int, int);
+uint32_t stats_led (uint32_t *, uint32_t *, uint32_t *);
+uint32_t stats_list (int, uint32_t *, uint32_t *, uint32_t *);
+void stats_show ();
+int stats_xrun (void *);
+void stats_reset ();
+uint32_t stats_summary (int, uint64_t *, uint64_t *, uint64_t *);
+int stats_open (char *);
@@ -0,0 +1,195 @@
+/** @file trace.c
+ *
+ * @brief Event trace of the process callback. Cycles, midi in events, notes read from the song, clock pulses and list pushes
+ * are recorded into a ring (lock-free: a slot is reserved with an atomic increment); on request (key or SIGUSR1),
+ * the background thread (see pool_post) dumps the ring to a Chrome trace file (JSON), to be opened in chrome://tracing or Perfetto.
+ *
+ */
+
+#include "types.h"
+#include "globals.h"
+#include "process.h"
+#include "utils.h"
+#include "led.h"
+#include "song.h"
+#include "disk.h"
+#include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static trace_t trace_ring [TRACE_SIZE];			// last TRACE_SIZE events
+static volatile uint32_t trace_head = 0;		// number of events recorded so far; next event goes to trace_ring [trace_head % TRACE_SIZE]
+static volatile int trace_enabled = FALSE;		// events are only recorded once the trace has been opened
+static volatile int trace_request = FALSE;		// set by trace_dump (), processed by the background thread
+static char trace_directory [255];				// trace files are written there
+
+// name and track (tid) of each type of event in the trace file
+static const char *trace_names [TRACE_TYPES] = {"cycle", "cycle", "kbd in", "ui in", "note", "clock", "push"};
+static const int trace_tracks [TRACE_TYPES] = {1, 1, 2, 3, 4, 5, 6};
+static const char *trace_track_names [7] = {"", "process", "kbd in", "ui in", "song", "clock", "lists"};
+static const char *trace_lists [5] = {"ui", "kbd", "out", "clk", "kbd clk"};
+
+
+// record an event; may be called from any thread, but it is meant for process
+// frame is the absolute frame time of the event, arg is the list for pushes, the instrument for notes, the number of frames for cycles
+void trace_event (int type, jack_nframes_t frame, int arg, uint8_t * data) {
+
+	trace_t *t;
+	uint32_t index;
+
+	if (!trace_enabled) return;
+
+	index = __sync_fetch_and_add (&trace_head, 1);
+	t = &trace_ring [index % TRACE_SIZE];
+	t->seq = 0;							// slot is being written
+	__sync_synchronize ();
+	t->ns = stats_now ();
+	t->frame = frame;
+	t->type = type;
+	t->arg = arg;
+	if (data != NULL) memcpy (t->data, data, 3);
+	else memset (t->data, 0, 3);
+	__sync_synchronize ();
+	t->seq = index + 1;					// slot is complete
+}
+
+
+// record the notes read from the song in a cycle
+void trace_notes (note_t * notes, int lg, jack_nframes_t frame) {
+
+	int i;
+	uint8_t data [3];
+
+	if (!trace_enabled) return;
+
+	for (i = 0; i < lg; i++) {
+		data [0] = notes [i].status;
+		data [1] = notes [i].key;
+		data [2] = notes [i].vel;
+		trace_event (TRACE_NOTE, frame, notes [i].instrument, data);
+	}
+}
+
+
+// request a dump of the trace; safe to be called from a signal handler or from process
+void trace_dump () {
+
+	trace_request = TRUE;
+	pool_post ();
+}
+
+
+static void trace_signal (int sig) {
+
+	trace_dump ();
+}
+
+
+// write the events of the ring to a Chrome trace file; events overwritten while copying are skipped
+static void trace_write () {
+
+	FILE *fp;
+	trace_t *events, *t;
+	uint32_t head, first, i;
+	uint64_t origin;
+	int nb, type;
+	static int count = 0;				// number of dumps, so that 2 dumps in the same second get different files
+	time_t now;
+	char filename [512], date [32];
+
+	events = malloc (TRACE_SIZE * sizeof (trace_t));
+	if (events == NULL) return;
+
+	// copy the ring, then check which slots have been overwritten or were being written during the copy
+	head = trace_head;
+	first = (head > TRACE_SIZE) ? head - TRACE_SIZE : 0;
+	nb = 0;
+	for (i = first; i < head; i++) {
+		memcpy (&events [nb], &trace_ring [i % TRACE_SIZE], sizeof (trace_t));
+		if (events [nb].seq == i + 1) nb++;
+	}
+	__sync_synchronize ();
+	head = trace_head;
+	for (i = 0; (i < nb) && (head > TRACE_SIZE) && (events [i].seq - 1 < head - TRACE_SIZE); i++);
+	if (i == nb) {
+		free (events);
+		return;
+	}
+
+	now = time (NULL);
+	strftime (date, sizeof (date), "%Y%m%d-%H%M%S", localtime (&now));
+	sprintf (filename, "%s/trace-%s-%d.json", trace_directory, date, count++);
+	fp = fopen (filename, "wt");
+	if (fp == NULL) {
+		free (events);
+		return;
+	}
+
+	fprintf (fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (type = 1; type < 7; type++) {
+		fprintf (fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", type, trace_track_names [type]);
+	}
+
+	// time stamps are in us, from the first event
+	origin = events [i].ns;
+	for (; i < nb; i++) {
+		t = &events [i];
+		fprintf (fp, "{\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,", trace_names [t->type], trace_tracks [t->type], (t->ns - origin) / 1000.0);
+		switch (t->type) {
+			case TRACE_CYCLE_START:
+				fprintf (fp, "\"ph\":\"B\",\"args\":{\"frame\":%u,\"nframes\":%d}},\n", t->frame, t->arg);
+				break;
+			case TRACE_CYCLE_END:
+				fprintf (fp, "\"ph\":\"E\"},\n");
+				break;
+			case TRACE_CLOCK:
+				fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"frame\":%u}},\n", t->frame);
+				break;
+			case TRACE_PUSH:
+				fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"list\":\"%s\",\"frame\":%u,\"midi\":\"%02X %02X %02X\"}},\n",
+					trace_lists [t->arg], t->frame, t->data [0], t->data [1], t->data [2]);
+				break;
+			case TRACE_NOTE:
+				fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"instrument\":%d,\"frame\":%u,\"midi\":\"%02X %02X %02X\"}},\n",
+					t->arg, t->frame, t->data [0], t->data [1], t->data [2]);
+				break;
+			default:
+				fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"args\":{\"frame\":%u,\"midi\":\"%02X %02X %02X\"}},\n",
+					t->frame, t->data [0], t->data [1], t->data [2]);
+				break;
+		}
+	}
+	// last event shall not be followed by a comma
+	fprintf (fp, "{\"name\":\"dump\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":1,\"ts\":%.3f}\n]}\n", (stats_now () - origin) / 1000.0);
+	fclose (fp);
+	free (events);
+}
+
+
+// write the trace file if a dump has been requested; called from the background thread (see pool.c)
+void trace_work () {
+
+	if (__sync_bool_compare_and_swap (&trace_request, TRUE, FALSE)) trace_write ();
+}
+
+
+// start recording events; trace files are written to directory, once a dump is requested by SIGUSR1 or trace_dump ()
+int trace_open (char * directory) {
+
+	strncpy (trace_directory, directory, sizeof (trace_directory) - 1);
+	signal (SIGUSR1, trace_signal);
+	trace_enabled = TRUE;
+	return TRUE;
+}
@@ -0,0 +1,11 @@
+/** @file trace.h
+ *
+ * @brief This file defines prototypes of functions inside trace.c
+ *
+ */
+
+void trace_event (int, jack_nframes_t, int, uint8_t *);
+void trace_notes (note_t *, int, jack_nframes_t);
+void trace_dump ();
+void trace_work ();
+int trace_open (char *);
@@ -13,12 +13,18 @@
 #include <signal.h>
 #include <dirent.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/inotify.h>
 #include <ncurses.h>
 #ifndef WIN32
 #include <unistd.h>
 #endif
 #include <jack/jack.h>
 #include <jack/midiport.h>
+#include <jack/ringbuffer.h>
 #include <cjson/cJSON.h>
 
 
@@ -77,6 +83,153 @@
 #define COPY_SIZE	20000		// max number of notes for copy buffer
 #define JSON_SIZE	4000000		// max number of chars in a Json load file
 
+/* midi export */
+#define MIDI_EXPORT_THREADS	4		// number of threads encoding instrument tracks (1 per core on the PI)
+
+/* journal of song changes, used to recover the session after a crash */
+#define JOURNAL_FILE	"journal.bin"	// journal file name, in save directory
+#define JOURNAL_ELT		1024			// max number of records waiting to be written by journal thread
+#define JOURNAL_RESET	0				// new starting point: empty song or song loaded/saved from a save slot
+#define JOURNAL_NOTE	1				// note written to the song
+#define JOURNAL_EDIT	2				// copy, cut, paste, insert, remove, color of bars
+#define JOURNAL_TRANSPO	3				// transposition of an instrument
+#define JOURNAL_VOLUME	4				// volume change of an instrument
+#define JOURNAL_PROGRAM	5				// midi instrument change
+#define JOURNAL_REQUANT	6				// requantization of an instrument
+
+/* song cache: save slots decoded in the background, so a song can be switched without disk access */
+#define SONG_CACHE_SIZE	4				// number of songs kept decoded (neighbours of the current song)
+#define CACHE_EMPTY		0
+#define CACHE_LOADING	1				// being decoded by the cache thread
+#define CACHE_READY		2				// decoded, may be switched to
+#define CACHE_IN_USE	3				// selected by the user; will be switched to by process
+#define CACHE_FAILED	4				// slot could not be decoded (eg. midi file only); not retried until slot changes
+#define CACHE_RETIRED	5				// holds the song switched from by process; emptied once the main loop cannot use it any more
+
+/* compact song files (.pak) */
+#define SAVE_COMPACT	FALSE				// TRUE: songs are saved as compact files instead of json files
+#define PACK_MAGIC		"CPAK"
+#define PACK_VERSION	2
+#define PACK_HEADER		54					// size of the header: magic, version, tempo, quantizer, number of notes, instruments, volumes
+#define PACK_SEGMENTS	64					// a song is split in segments of 1 instrument x 1 page (64 bars)
+#define PACK_SEGMENT(instr, page)	(1ULL << (((instr) * 8) + (page)))		// bit of a segment in a mask of segments
+#define PACK_ALL		0xFFFFFFFFFFFFFFFFULL	// mask of all segments
+#define PACK_SIZE		((SONG_SIZE * 16) + PACK_HEADER + 8 + (PACK_SEGMENTS * 8))	// max size of a compact file: 13 bytes max per note, 8 bytes max per segment
+
+/* timing statistics of process () */
+#define STATS_FILE		"stats.log"		// report file, in save directory
+#define STATS_LOG		FALSE			// TRUE: reports are appended to STATS_FILE as well (the last report is kept in memory anyway, for STATS_KEY)
+#define STATS_LOG_SIZE	(1024 * 1024)	// max size of STATS_FILE: it is then renamed to STATS_FILE.1 (previous one is dropped), and a new file started
+#define STATS_TEXT		4096			// max size of a report
+#define STATS_PERIOD	10				// seconds between 2 reports
+#define STATS_BUDGET	80				// a cycle is late if it takes more than this percentage of the period
+#define STATS_BUCKETS	128				// 4 buckets per power of 2 of ns
+#define STATS_STAGES	10				// stages of process () which are timed
+#define STATS_CYCLE		0				// whole cycle
+#define STATS_PLAY		1				// step 0, play song
+#define STATS_KBD_IN	2				// first, MIDI in (KBD)
+#define STATS_OUT		3				// second, MIDI out (music)
+#define STATS_CLOCK		4				// second bis & ter, clock out
+#define STATS_KBD_OUT	5				// third, MIDI out (KBD)
+#define STATS_UI_IN		6				// fourth, MIDI in (UI)
+#define STATS_UI_OUT	7				// fifth, MIDI out (UI)
+#define STATS_KEYS		8				// last, keyboard (UI)
+#define STATS_READ		9				// read_from_song, in step 0
+#define STATS_LISTS		5				// midi out lists which are counted: UI, KBD, OUT, CLK, KBD_CLK
+#define STATS_KEY		0x6C			// 'l' on a full keyboard: print the counters of the lists on the terminal
+
+/* JACK stub (make JACK=stub): ports, buffers and clock emulated in memory, for headless tests and benchmarks */
+#define STUB_PORTS		16				// max number of ports
+#define STUB_EVENTS		1024			// max number of events in a port buffer for 1 cycle
+#define STUB_EVENT_SIZE	16				// max size of a midi event, in bytes
+#define STUB_PENDING	65536			// max number of input events waiting for their cycle
+#define STUB_RATE		48000			// sample rate
+#define STUB_NFRAMES	256				// period when the stub clock runs on its own
+
+/* offline playback benchmark (make bench.a) */
+#define BENCH_CYCLES	20000			// default number of cycles per run
+#define BENCH_BURST		256				// default max number of events per cycle of the flood benchmark
+#define BENCH_FLOOD_CYCLES	2000		// default number of cycles per run of the flood benchmark
+#define BENCH_REQUANT_RUNS	20			// default number of runs per track of the requantization benchmark
+#define BENCH_QUANTIZE_RUNS	20			// default number of runs of the quantization benchmark
+#define BENCH_POOL_RUNS	200				// default number of runs of each pass of the pool benchmark
+#define BENCH_REPLAY_CYCLES	1000		// default number of cycles of a replay
+#define BENCH_DIR		"/tmp/compo-bench-XXXXXX"	// temporary directory of the files written by benchmarks (see mkdtemp)
+#define BENCH_MIDI_NOTES	SONG_SIZE	// default number of notes of the midi export benchmark
+#define BENCH_PAK_SONGS	8				// default number of songs of the file format benchmark
+
+/* event trace of process (), dumped to a Chrome trace file on request */
+#define TRACE_SIZE		65536			// number of events kept in the ring
+#define TRACE_KEY		0x74			// 't' on a full keyboard: dump the trace (SIGUSR1 does the same)
+#define TRACE_TYPES		7
+#define TRACE_CYCLE_START	0			// start of process (), with the number of frames
+#define TRACE_CYCLE_END	1				// end of process ()
+#define TRACE_KBD_IN	2				// midi in event (KBD)
+#define TRACE_UI_IN		3				// midi in event (UI)
+#define TRACE_NOTE		4				// note read from the song, with the instrument
+#define TRACE_CLOCK		5				// midi clock pulse
+#define TRACE_PUSH		6				// midi message pushed to a list, with the list
+
+/* round-trip latency calibration: probes sent on midi_out shall come back on midi_KBD_in */
+#define LATENCY_FILE	"latency.txt"	// record offset (frames, sample rate), in save directory
+#define LATENCY_KEY		0x63			// 'c' on a full keyboard: start a calibration
+#define LATENCY_PROBES	8				// number of probes; the median latency is used
+#define LATENCY_TIMEOUT	1				// seconds to wait for a probe
+#define LATENCY_CHANNEL	0x0F			// probe: control change on midi channel 16, not used by instruments
+#define LATENCY_CC		0x77			// undefined controller; value is the number of the probe
+#define LATENCY_IDLE	0
+#define LATENCY_SEND	1				// a probe shall be sent at next cycle
+#define LATENCY_WAIT	2				// waiting for the probe to come back
+#define LATENCY_DONE	3				// all probes have come back
+#define LATENCY_FAILED	4				// a probe has not come back in time
+
+/* deferred live notes: notes played while recording, quantized in the future */
+#define LIVE_SIZE		256				// max number of notes waiting to be played
+
+/* pads of the control surface (Launchpad mini), as seen by led.c */
+#define LED_PADS		80				// 64 grid pads (bars), 8 scene pads (pages), 8 top pads (instruments)
+#define LED_PAD_PAGES	64				// index of the first scene pad
+#define LED_PAD_INSTRUMENTS	72			// index of the first top pad
+#define LED_UNKNOWN		0xFE			// color of a pad which has not been sent yet
+#define LED_OUTPUT_PLAIN		0		// 1 note on / CC per pad, written to both buffers of the Launchpad
+#define LED_OUTPUT_LAUNCHPAD	1		// double buffering, and rapid LED update for large redraws
+#define LED_OUTPUT		LED_OUTPUT_PLAIN	// output used at startup (see led_output); LED_OUTPUT_LAUNCHPAD is not verified on a Launchpad mini yet
+#define LED_COLOR_MASK	0x33			// red and green bits of a color, without the copy and clear flags (0x0C)
+#define LED_RAPID		0x92			// rapid LED update: 2 pads per message, in pad order (grid, scene pads, top pads)
+#define LED_BUFFER_CC	0x00			// double buffering control: 0x20 + copy (0x10) + 4 x updated buffer + displayed buffer
+#define LED_BUDGET		16				// max number of led messages sent per cycle (0: no limit); see led_pace
+#define LED_PRIORITIES	3				// pads are sent by priority: cursor, bars and current page, other pads
+
+/* integer time base: tick math without double arithmetic nor division (see utils.c) */
+#define TIMEBASE_SHIFT	40				// n / d = (n * reciprocal of d) >> TIMEBASE_SHIFT, exact for n < TIMEBASE_MAX and d < 65536
+#define TIMEBASE_MAX	(1 << 24)		// larger ticks are divided the usual way
+#define TIMEBASE_QUANT	(THIRTY_SECOND + 1)	// quantizer values with a precomputed step (FREE_TIMING to THIRTY_SECOND)
+
+/* worker pool for whole-song passes outside of process */
+#define POOL_PARTS		4				// max number of parts a pass is split in: calling thread + 3 workers (4 cores)
+#define POOL_MIN_NOTES	4096			// smaller songs are processed by the calling thread only
+
+/* requantization of a track from raw timing */
+#define REQUANT_KEY		0x71			// 'q' on a full keyboard: requantize current instrument with current quantizers
+#define REQUANT_REQUEST(instr, on, off)	((instr) | ((on) << 8) | ((off) << 16))
+#define REQUANT_INSTR(request)	((request) & 0xFF)
+#define REQUANT_ON(request)		(((request) >> 8) & 0xFF)
+#define REQUANT_OFF(request)	(((request) >> 16) & 0xFF)
+#define REQUANT_RETRIES	8				// max number of copies of the song (or of requantizations) made again because the song has changed meanwhile
+
+/* grooves: notes on quantized to a per-bar table of targets (see groove.c) */
+#define GROOVE_TICKS	7680			// max number of ticks per bar (eg. 960 ticks per beat, 8 beats per bar)
+#define GROOVE_STEPS	256				// max number of steps (targets) per bar
+#define GROOVE_STRENGTH	100				// strength of the targets, in %: 100 moves notes onto the target, 50 half-way
+#define GROOVE_OFF		0				// no groove: notes on are quantized with the quantizer
+#define GROOVE_STRAIGHT	1				// straight grid of the quantizer
+#define GROOVE_SWING	2				// every other step of the quantizer is delayed (55 to 75%)
+#define GROOVE_TRIPLET	3				// triplets
+#define GROOVE_USER		4				// template extracted from a recorded bar
+#define GROOVE_KEY		0x67			// 'g' on a full keyboard: next groove
+#define GROOVE_USER_KEY	0x75			// 'u' on a full keyboard: extract a groove from the current bar of the current instrument
+#define GROOVE_PLAY_KEY	0x70			// 'p' on a full keyboard: apply the groove at playback, or stop applying it
+
 /* list management (used for led mgmt) */
 #define LIST_ELT 300
 
@@ -155,8 +308,92 @@ typedef struct {
 	uint8_t key;
 	uint8_t vel;
 	uint8_t color;
-	uint8_t padding [1];	// goal is to make 16 bytes, ie. 2 x 64 bits
+	uint8_t played;			// TRUE once played live at its quantized time (see live.c): song shall not play it again; goal is to make 16 bytes
 } note_t;
 
 
+// save slot metadata, kept up to date by the slot index
+typedef struct {
+	uint8_t exists;			// TRUE if there is a song or midi file for the slot
+	off_t size;				// file size, in bytes
+	time_t mtime;			// last modification of the file
+	int nb_notes;			// number of notes in the song, -1 if unknown (midi file)
+	double bpm;				// tempo of the song, 0 if unknown (midi file)
+} slot_t;
+
 
+// decoded song: settings and notes of a song file, either to be applied to the current song or kept in the song cache
+typedef struct {
+	volatile int state;		// CACHE_xxx (song cache only)
+	int slot;				// save slot of the song
+	int version;			// version of the slot when decoded (song cache only)
+	note_t *notes;			// SONG_SIZE notes
+	int length;
+	int instruments [8];
+	int volumes [8];
+	float beats_per_bar;
+	float beat_type;
+	double ticks_per_beat;
+	double beats_per_minute;
+	float bpm_multiplier;
+	int quantizer;
+	uint8_t bars [8][8][64];	// colors of the bars (song cache only)
+	int pak_size;			// size of the compact file the song was decoded from, 0 if decoded from a json file
+} song_cache_t;
+
+
+// journal record: fixed size, so a record that has been partially written (power cut) can be detected and dropped
+typedef struct {
+	uint8_t type;			// JOURNAL_xxx
+	uint8_t arg [7];		// arguments of the operation, depending on type
+	uint32_t seq;			// number of the record in the session (JOURNAL_RESET: last record included in the song it starts from)
+	note_t note;			// note written to the song (JOURNAL_NOTE only)
+} journal_t;
+
+
+// trace event: ring entry of the event trace
+typedef struct {
+	volatile uint32_t seq;	// index of the event + 1 once written, 0 while being written
+	jack_nframes_t frame;	// absolute frame time of the event
+	uint64_t ns;			// time stamp (monotonic clock)
+	uint8_t type;			// TRACE_xxx
+	uint8_t data [3];		// midi bytes
+	int arg;				// depending on type: list, instrument or number of frames
+} trace_t;
+
+
+// deferred live note: midi message to be played at an absolute frame time
+typedef struct {
+	jack_nframes_t frame;	// frame time at which the message is played
+	uint32_t seq;			// order of scheduling, for messages of the same frame
+	uint8_t data [3];		// midi message, with channel
+} live_t;
+
+
+// integer time base of the current song: ticks per bar, per beat and per quantizer step, with their reciprocals
+typedef struct {
+	uint32_t bar;						// ticks per bar
+	uint32_t beat;						// ticks per beat
+	uint64_t bar_recip;					// reciprocals (see TIMEBASE_SHIFT)
+	uint64_t beat_recip;
+	uint32_t step [TIMEBASE_QUANT];		// ticks per step of each quantizer value
+	uint32_t half [TIMEBASE_QUANT];		// half step: ticks from which a tick is rounded up
+	uint64_t step_recip [TIMEBASE_QUANT];
+} timebase_t;
+
+
+// pass of the worker pool: processes notes [from, to) of the song as part number part, returns the segments changed
+typedef uint64_t (*pool_job_t) (int part, int from, int to, void *arg);
+
+
+// groove: targets of the steps of a bar, and the lookup tables built from them for the current bar length
+typedef struct {
+	int nb_steps;						// number of steps per bar (0 if no groove)
+	int ticks_per_bar;					// bar length the tables have been built for
+	uint16_t grid [GROOVE_STEPS];		// straight position of each step, in ticks from the start of the bar
+	uint16_t target [GROOVE_STEPS];		// target of each step, in ticks from the start of the bar (increasing)
+	uint8_t strength [GROOVE_STEPS];	// how far notes are moved to the target, in %
+	int16_t record [GROOVE_TICKS];		// for each tick of a bar: offset to the quantized tick (recording)
+	int16_t play [GROOVE_TICKS];		// for each tick of a bar: offset to the tick the note is played at (playback)
+	int play_min, play_max;				// bounds of the playback offsets
+} groove_t;
@@ -12,6 +12,22 @@
 #include "song.h"
 #include "disk.h"
 #include "useless.h"
+#include "journal.h"
+#include "slot.h"
+#include "cache.h"
+#include "pack.h"
+#include "stats.h"
+#include "jackstub.h"
+#include "bench.h"
+#include "trace.h"
+#include "latency.h"
+#include "live.h"
+#include "requant.h"
+#include "groove.h"
+#include "pool.h"
+
+
+static timebase_t timebase;	// integer time base of the current song, computed by timebase_update
 
 
 // convert pad midi number to bar number : ie 0x00-0x77 to 0-63
@@ -89,6 +105,8 @@ int push_to_list (int device, uint8_t * buffer) {
 			break;
 	}
 
+	trace_event (TRACE_PUSH, jack_last_frame_time (client), device, buffer);
+	stats_push (device, *index);
 	for (i = 0; i < 3; i++) {
 		// add to the list
 		list [((*index) * 3) + i] = buffer [i];
@@ -231,15 +249,111 @@ int compute_bbt (jack_nframes_t nframes, jack_position_t *pos, int new_pos)
 }
 
 
+// compute the BBT of an event received during current cycle, at frame offset (event->time) of the cycle, and write it to note
+// offset may be negative for an event which happened during a previous cycle (eg. once latency is subtracted)
+// pos is the BBT computed by compute_bbt for this cycle, ie. the position at the end of the cycle
+void event_bbt (jack_position_t *pos, jack_nframes_t nframes, int offset, note_t *note)
+{
+	double ticks_per_bar;		// number of ticks per bar
+	double event_tick;			// number of ticks since play is pressed, at the time of the event
+	int tick;
+
+	if (offset > (int) nframes) offset = nframes;
+
+	// go back from the end of the cycle to the frame of the event, with the same ticks per frame as compute_bbt
+	event_tick = pos->bar_start_tick - (pos->ticks_per_beat * pos->beats_per_minute * ((int) nframes - offset) / (pos->frame_rate * 60));
+	if (event_tick < 0.0) event_tick = 0.0;
+
+	ticks_per_bar = pos->beats_per_bar * pos->ticks_per_beat;
+	tick = (int) event_tick % (int) ticks_per_bar;
+	note->tick = tick;
+	note->beat = tick / (int) time_ticks_per_beat;
+	note->bar = (pos->padding [0] + ((int) event_tick / (int) ticks_per_bar)) % 512;		// we loop after 512 bars
+}
+
+
+// frame offset, from the start of current cycle, of a tick of the song (number of ticks from BBT (0,0,0)); reverse of event_bbt
+// pos is the BBT computed by compute_bbt for this cycle; offset is negative if the tick is before the start of the cycle
+int tick_offset (jack_position_t *pos, jack_nframes_t nframes, uint32_t tick)
+{
+	double ticks_per_bar;		// number of ticks per bar
+	double ticks;				// number of ticks from the end of the cycle to tick
+
+	ticks_per_bar = pos->beats_per_bar * pos->ticks_per_beat;
+	ticks = (double) tick - (pos->padding [0] * ticks_per_bar) - pos->bar_start_tick;
+	return (int) nframes + (int) lround (ticks * pos->frame_rate * 60 / (pos->ticks_per_beat * pos->beats_per_minute));
+}
+
+
+// reciprocal of d, so that n / d = (n * reciprocal) >> TIMEBASE_SHIFT
+static uint64_t timebase_recip (uint32_t d) {
+
+	if (d == 0) return 0;
+	return ((1ULL << TIMEBASE_SHIFT) + d - 1) / d;
+}
+
+
+// compute the integer time base from the time signature of the song; to be called whenever time_ticks_per_beat or time_beats_per_bar change
+void timebase_update () {
+
+	int quant;
+
+	timebase.bar = (int) (time_ticks_per_beat * time_beats_per_bar);
+	timebase.beat = (int) time_ticks_per_beat;
+	timebase.bar_recip = timebase_recip (timebase.bar);
+	timebase.beat_recip = timebase_recip (timebase.beat);
+
+	// step of each quantizer value, as computed by quantize () so far
+	for (quant = 0; quant < TIMEBASE_QUANT; quant++) {
+		timebase.step [quant] = (quant == FREE_TIMING) ? 1 : (int) (time_ticks_per_beat / quant);
+		timebase.half [quant] = timebase.step [quant] / 2;
+		timebase.step_recip [quant] = timebase_recip (timebase.step [quant]);
+	}
+}
+
+
+// time base of the current song
+static inline timebase_t * timebase_get () {
+
+	return &timebase;
+}
+
+
+// integer division n / d, where recip is the reciprocal of d
+static inline uint32_t timebase_div (uint32_t n, uint32_t d, uint64_t recip) {
+
+	if (n >= TIMEBASE_MAX) return n / d;
+	return (uint32_t) ((n * recip) >> TIMEBASE_SHIFT);
+}
+
+
+// number of ticks per bar of the current song
+uint32_t ticks_per_bar () {
+
+	return timebase_get ()->bar;
+}
+
+
 // quantize a tick to the nearest value; tick could be of any value
 uint32_t quantize (uint32_t tick, int quant) {
-	int i;
-	int step;			// number of ticks per "quantized" step
+	timebase_t *tb;
+	uint32_t step;		// number of ticks per "quantized" step
 	uint32_t div, rem;	// temporary variables for calculation
 
 	if (quant == FREE_TIMING) return tick;	// no quantization required, leave
 
-	step = (int) (time_ticks_per_beat / quant);		// step is a number of ticks per each "quantized" step
+	// step is a number of ticks per each "quantized" step, precomputed for each quantizer value
+	tb = timebase_get ();
+	if ((quant > 0) && (quant < TIMEBASE_QUANT)) {
+		step = tb->step [quant];
+		div = timebase_div (tick, step, tb->step_recip [quant]);
+		rem = tick - (div * step);			// remaining of integer division: we are going to adjust this
+		if (rem < tb->half [quant]) rem = 0;
+		else rem = step;
+		return ((div * step) + rem);
+	}
+
+	step = (int) (time_ticks_per_beat / quant);
 	div = tick / step;
 	rem = tick % step;		// remaining of integer division: we are going to adjust this
 
@@ -255,6 +369,7 @@ uint32_t quantize (uint32_t tick, int quant) {
 // returns the smallest possible number of ticks for a value of quantizer
 uint32_t min_time (int quant) {
 	if ((quant == 0) || (quant == FREE_TIMING)) return 1;
+	if ((quant > 0) && (quant < TIMEBASE_QUANT)) return timebase_get ()->step [quant];
 	return (int)(time_ticks_per_beat / quant);
 }
 
@@ -269,6 +384,14 @@ int quantize_note (int quant_noteon, int quant_noteoff, note_t *note) {
 	uint32_t tick_off, qtick_off;		// temp structure to store tick info
 	int tick_difference, qtick_difference;
 
+	// groove: notes on are quantized to the nearest target of the groove, with a table lookup (see groove.c)
+	if ((note->status == MIDI_NOTEON) && (groove_active ())) {
+		note2tick (*note, &tick_off, FALSE);
+		qtick_off = groove_quantize (tick_off);
+		tick2note (qtick_off, note, TRUE);
+		return (qtick_off <= tick_off);
+	}
+
 	// go through the whole song backwards and check whether there is another note with the same instrument
 	i = song_length;
 	found = FALSE;
@@ -329,8 +452,8 @@ int quantize_note (int quant_noteon, int quant_noteoff, note_t *note) {
 // quantized indicates whether BBT info is in BBT structure or qBBT
 void note2tick (note_t note, uint32_t *tick, int quantized) {
 
-	if (quantized) *tick = ((note.qbar * (int) (time_ticks_per_beat * time_beats_per_bar)) + note.qtick);
-	else *tick = ((note.bar * (int) (time_ticks_per_beat * time_beats_per_bar)) + note.tick);
+	if (quantized) *tick = ((note.qbar * timebase_get ()->bar) + note.qtick);
+	else *tick = ((note.bar * timebase_get ()->bar) + note.tick);
 }
 
 
@@ -338,19 +461,22 @@ void note2tick (note_t note, uint32_t *tick, int quantized) {
 // quantized indicates whether BBT info is in BBT structure or qBBT
 void tick2note (uint32_t tick, note_t *note, int quantized) {
 
-	int ticks_per_bar;
+	timebase_t *tb;
+	uint32_t bar, rem;
 
-	ticks_per_bar = (int) (time_ticks_per_beat * time_beats_per_bar);
+	tb = timebase_get ();
+	bar = timebase_div (tick, tb->bar, tb->bar_recip);
+	rem = tick - (bar * tb->bar);
 
 	if (quantized) {
-		note->qbar = tick / ticks_per_bar;
-		note->qtick = tick % ticks_per_bar;
-		note->qbeat = note->qtick / (int) (time_ticks_per_beat);
+		note->qbar = bar;
+		note->qtick = rem;
+		note->qbeat = timebase_div (rem, tb->beat, tb->beat_recip);
 	}
 	else {
-		note->bar = tick / ticks_per_bar;
-		note->tick = tick % ticks_per_bar;
-		note->beat = note->tick / (int) (time_ticks_per_beat);
+		note->bar = bar;
+		note->tick = rem;
+		note->beat = timebase_div (rem, tb->beat, tb->beat_recip);
 	}
 }
 
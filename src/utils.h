@@ -13,6 +13,10 @@ int push_to_list (int, uint8_t *);
 int pull_from_list (int, uint8_t *);
 int midi_write (void *, jack_nframes_t, jack_midi_data_t *);
 int compute_bbt (jack_nframes_t, jack_position_t *, int);
+void event_bbt (jack_position_t *, jack_nframes_t, int, note_t *);
+int tick_offset (jack_position_t *, jack_nframes_t, uint32_t);
+void timebase_update ();
+uint32_t ticks_per_bar ();
 uint32_t quantize (uint32_t, int);
 uint32_t min_time (int);
 int quantize_note (int, int, note_t *);